@@ -0,0 +1,248 @@
+/*
+ * admitbench.c - replays a recorded trace of urls through caches with
+ * and without TinyLFU admission and compares their hit ratios
+ *
+ * The trace has one request per line. The url is the first field of the
+ * line that starts with http://, so a plain list of urls works, and so
+ * does an access log in the common log format, where it is the target of
+ * the quoted request line. Lines without one are skipped. The size of the
+ * object is the last of the numbers that follow the url: the bytes field
+ * of the common log format, which comes after the status, or a number
+ * written after a plain url. "-" counts as 0 bytes, and a line with no
+ * size is taken to be for an object of BENCH_OBJECT bytes.
+ *
+ * The trace is replayed with the LRU and CLOCK policies, each with every
+ * object admitted and with TinyLFU admission, through caches that hold
+ * 1%, 5%, 10% and 25% of the bytes of the distinct urls of the trace.
+ * Every miss for an object no bigger than MAX_OBJECT_SIZE is cached, with
+ * the size of that request, like the proxy does. A trace where a crawler
+ * sweeps through urls nobody asks for again is where TinyLFU should keep
+ * a higher ratio.
+ *
+ * usage: ./admitbench trace
+ */
+
+#include "cache.h"
+
+/* Bytes of data in an object whose size the trace doesn't give */
+#define BENCH_OBJECT 64
+
+/* Share of the bytes of the distinct urls each cache holds, in tenths of
+   a percent */
+static const int capacities[] = {10, 50, 100, 250};
+
+struct config{
+  const char *name;
+  int policy;
+  int admission;
+};
+
+static const struct config configs[] = {
+  {"lru", CACHE_LRU, CACHE_ADMIT_ALL},
+  {"lru+tinylfu", CACHE_LRU, CACHE_ADMIT_TINYLFU},
+  {"clock", CACHE_CLOCK, CACHE_ADMIT_ALL},
+  {"clock+tinylfu", CACHE_CLOCK, CACHE_ADMIT_TINYLFU},
+};
+
+/* One request of the trace */
+struct request{
+  char *url;
+  size_t size; //bytes of the object sent back
+};
+
+static char data[MAX_OBJECT_SIZE];
+
+static struct request *read_trace(FILE *fp, size_t *n);
+static size_t object_size(const char *p);
+static size_t count_distinct(struct request *trace, size_t n, size_t *bytes);
+static int compare_urls(const void *a, const void *b);
+static int request(cache *c_cache, struct request *r);
+static double hit_ratio(const struct config *cf, size_t budget,
+	struct request *trace, size_t n);
+
+/*
+ * main - this function reads the trace and prints the hit ratio of each
+ * policy and admission at each size of cache
+ */
+int main(int argc, char **argv)
+{
+  size_t n, distinct, bytes, i, j;
+  struct request *trace;
+  FILE *fp;
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s trace\n", argv[0]);
+    exit(1);
+  }
+  if ((fp = fopen(argv[1], "r")) == NULL) {
+    unix_error("admitbench: can't open the trace");
+  }
+  trace = read_trace(fp, &n);
+  fclose(fp);
+  if (n == 0) {
+    app_error("admitbench: no urls in the trace");
+  }
+  distinct = count_distinct(trace, n, &bytes);
+  printf("%zu requests for %zu urls, %zu bytes\n", n, distinct, bytes);
+  printf("%-14s", "cache size");
+  for (j = 0; j < sizeof(capacities) / sizeof(capacities[0]); j++) {
+    printf(" %7.1f%%", capacities[j] / 10.0);
+  }
+  printf("\n");
+  for (i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+    printf("%-14s", configs[i].name);
+    for (j = 0; j < sizeof(capacities) / sizeof(capacities[0]); j++) {
+      size_t budget = bytes / 1000 * capacities[j];
+      //a cache too small for the biggest object in every shard turns
+      //some of them away whatever the policy
+      if (budget < (size_t)MAX_OBJECT_SIZE * CACHE_DEFAULT_SHARDS) {
+        budget = (size_t)MAX_OBJECT_SIZE * CACHE_DEFAULT_SHARDS;
+      }
+      printf(" %8.4f", hit_ratio(&configs[i], budget, trace, n));
+      fflush(stdout);
+    }
+    printf("\n");
+  }
+  return 0;
+}
+
+/*
+ * read_trace - this function returns the requests of the trace fp, in
+ * order, and stores their number at *n
+ */
+static struct request *read_trace(FILE *fp, size_t *n)
+{
+  struct request *trace = NULL;
+  char *line = NULL, *url, *end;
+  size_t count = 0, cap = 0, len = 0;
+  while (getline(&line, &len, fp) != -1) {
+    for (url = line; (url = strstr(url, "http://")) != NULL; url++) {
+      if (url == line || isspace((unsigned char)url[-1]) || url[-1] == '"') {
+        break;
+      }
+    }
+    if (url == NULL) {
+      continue;
+    }
+    for (end = url; *end != '\0' && !isspace((unsigned char)*end) &&
+        *end != '"'; end++) {
+    }
+    if (count == cap) {
+      cap = cap ? cap * 2 : 1024;
+      trace = Realloc(trace, cap * sizeof(struct request));
+    }
+    trace[count].size = object_size(end);
+    *end = '\0';
+    trace[count].url = Malloc(end - url + 1);
+    strcpy(trace[count++].url, url);
+  }
+  free(line);
+  *n = count;
+  return trace;
+}
+
+/*
+ * object_size - this function returns the size of the object of a
+ * request, given the rest of its line p, which starts after the url. It
+ * is the last of the first run of fields that are numbers or "-".
+ */
+static size_t object_size(const char *p)
+{
+  size_t size = BENCH_OBJECT, len;
+  int found = 0;
+  while (*p != '\0') {
+    while (isspace((unsigned char)*p)) {
+      p++;
+    }
+    for (len = 0; p[len] != '\0' && !isspace((unsigned char)p[len]); len++) {
+    }
+    if (len == 0) {
+      break;
+    }
+    if (len == 1 && *p == '-') {
+      size = 0;
+      found = 1;
+    }
+    else if (strspn(p, "0123456789") == len) {
+      size = strtoul(p, NULL, 10);
+      found = 1;
+    }
+    else if (found) {
+      break; //the referer of the combined log format, say
+    }
+    p += len;
+  }
+  return size;
+}
+
+/*
+ * count_distinct - this function returns the number of different urls in
+ * the n requests of trace, and stores the bytes of their objects at
+ * *bytes, leaving out those too big to be cached
+ */
+static size_t count_distinct(struct request *trace, size_t n, size_t *bytes)
+{
+  struct request *sorted = Malloc(n * sizeof(struct request));
+  size_t i, distinct = 0;
+  memcpy(sorted, trace, n * sizeof(struct request));
+  qsort(sorted, n, sizeof(struct request), compare_urls);
+  *bytes = 0;
+  for (i = 0; i < n; i++) {
+    if (i > 0 && strcmp(sorted[i].url, sorted[i - 1].url) == 0) {
+      continue;
+    }
+    distinct++;
+    if (sorted[i].size <= MAX_OBJECT_SIZE) {
+      *bytes += sorted[i].size;
+    }
+  }
+  Free(sorted);
+  return distinct;
+}
+
+/*
+ * compare_urls - this function orders requests by their url, for qsort
+ */
+static int compare_urls(const void *a, const void *b)
+{
+  return strcmp(((const struct request *)a)->url,
+    ((const struct request *)b)->url);
+}
+
+/*
+ * request - this function asks the cache for the url of r, and caches an
+ * object of r's size for it if it missed and the object isn't too big. It
+ * returns 1 on a hit and 0 on a miss.
+ */
+static int request(cache *c_cache, struct request *r)
+{
+  cache_node *p = check_for_hit(c_cache, r->url);
+  cache_buf buf;
+  if (p != NULL) {
+    release_cache_node(p);
+    return 1;
+  }
+  if (r->size > MAX_OBJECT_SIZE) {
+    return 0;
+  }
+  cache_buf_init(&buf, c_cache);
+  cache_buf_append(&buf, data, r->size);
+  add_to_cache(c_cache, r->url, &buf, 0, 0, 0);
+  return 0;
+}
+
+/*
+ * hit_ratio - this function replays the n requests of trace through a
+ * new cache of budget bytes set up as cf says, and returns the share of
+ * them that hit
+ */
+static double hit_ratio(const struct config *cf, size_t budget,
+  struct request *trace, size_t n)
+{
+  cache *c_cache = initialize_cache(CACHE_DEFAULT_SHARDS, cf->policy,
+    cf->admission, budget, MAX_OBJECT_SIZE, NULL);
+  size_t i, hits = 0;
+  for (i = 0; i < n; i++) {
+    hits += request(c_cache, &trace[i]);
+  }
+  return (double)hits / n;
+}
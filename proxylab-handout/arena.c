@@ -0,0 +1,97 @@
+/*
+ * arena.c - memory that lives as long as a request
+ *
+ * What a request needs while it is served (its uri and the parts of it,
+ * the parsed head, the list of pieces of the request to the server) is
+ * taken from an arena instead of the stack or one malloc each. Taking
+ * memory is bumping an offset into the current chunk, and all of it is
+ * given back by rewinding the arena once the request is over.
+ *
+ * The first chunk is kept when the arena is reset, so a worker that
+ * serves request after request reuses the same memory. The chunks taken
+ * for an unusually big request are freed by the reset.
+ */
+
+#include "arena.h"
+
+static struct arena_chunk *new_chunk(size_t size);
+
+/*
+ * arena_alloc - this function returns size bytes from the arena a,
+ * aligned to ARENA_ALIGN. They stay valid until a is reset or freed.
+ */
+void *arena_alloc(arena *a, size_t size)
+{
+  struct arena_chunk *k = a->cur;
+  void *p;
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  if (k == NULL || size > k->size - k->used) {
+    //the chunk is full, the next one is big enough for size at least
+    k = new_chunk(size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE);
+    if (a->cur == NULL) {
+      a->first = k;
+    }
+    else {
+      a->cur->next = k;
+    }
+    a->cur = k;
+  }
+  p = k->data + k->used;
+  k->used += size;
+  return p;
+}
+
+/*
+ * arena_strndup - this function copies the n bytes at s into the arena
+ * a as a string, and returns the copy
+ */
+char *arena_strndup(arena *a, const char *s, size_t n)
+{
+  char *p = arena_alloc(a, n + 1);
+  memcpy(p, s, n);
+  p[n] = '\0';
+  return p;
+}
+
+/*
+ * arena_reset - this function gives back everything taken from the
+ * arena a. The first chunk is kept for the next request, the others
+ * are freed.
+ */
+void arena_reset(arena *a)
+{
+  struct arena_chunk *k, *next;
+  if (a->first == NULL) {
+    return;
+  }
+  for (k = a->first->next; k != NULL; k = next) {
+    next = k->next;
+    Free(k);
+  }
+  a->first->next = NULL;
+  a->first->used = 0;
+  a->cur = a->first;
+}
+
+/*
+ * arena_free - this function frees every chunk of the arena a, which is
+ * left empty
+ */
+void arena_free(arena *a)
+{
+  arena_reset(a);
+  Free(a->first);
+  a->first = a->cur = NULL;
+}
+
+/*
+ * new_chunk - this function allocates a chunk with size bytes of data
+ */
+static struct arena_chunk *new_chunk(size_t size)
+{
+  struct arena_chunk *k = Malloc(sizeof(struct arena_chunk) + size);
+  k->next = NULL;
+  k->size = size;
+  k->used = 0;
+  return k;
+}
@@ -0,0 +1,38 @@
+/*
+ * arena.h - memory that lives as long as a request, bump-allocated from
+ * chunks and given back all at once when the request is over
+ */
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include "csapp.h"
+
+/* Bytes in a chunk, enough for everything a usual request needs, the
+   buffers the response is relayed through included. Requests with
+   unusually big heads take more chunks */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+/* What every allocation is aligned to */
+#define ARENA_ALIGN 16
+
+struct arena_chunk{
+  struct arena_chunk *next; //chunk taken after this one
+  size_t size; //bytes in data
+  size_t used; //bytes of data handed out
+  char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+/* An arena filled with zeros is empty and ready to use */
+struct arena{
+  struct arena_chunk *first; //chunk kept across resets, NULL until needed
+  struct arena_chunk *cur; //chunk allocations come from
+};
+
+typedef struct arena arena;
+
+void *arena_alloc(arena *a, size_t size);
+char *arena_strndup(arena *a, const char *s, size_t n);
+void arena_reset(arena *a);
+void arena_free(arena *a);
+
+#endif /* __ARENA_H__ */
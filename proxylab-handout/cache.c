@@ -0,0 +1,1295 @@
+/*
+ * cache.c - the web object cache used by the proxy
+ *
+ * The cache structure is that of a doubly-linked list which is made up
+ * of cache nodes (cache_node). Each cache_node stores the following
+ * information:
+ * url -> this acts as the tag into the cache, we search for cached data based
+ * on the url with which the data is associated
+ * data -> this stores the data associated with the url
+ * data_size -> this stores the size of the data (in bytes)
+ * charge -> this stores the bytes the node really takes up (see below)
+ * next -> this is a pointer to the next cache_node in the cache linked list
+ * prev -> this is a pointer to the previous cache_node in the cache linked
+ * list
+ * The cache structure holds the following information:
+ * cache_size -> keeps track of the total amount of memory taken up by
+ * the nodes of the cache
+ * start -> this is a pointer to the start of the cache linked list
+ * end -> this is a pointer to the end of the cache linked list
+ *
+ * The LRU - policy is implemented in the following way:
+ * Any new data added to the cache (that is any new cache_node) is added
+ * to the start of the linked list. Whenever there is a hit, that particular
+ * node is moved to the start of the list. This ensures that the most recently
+ * used node is at the start of the linked list while the least recently used
+ * node is at the end of the linked list. Thus, any node that is deleted from
+ * the cache is deleted from the end of the linked list.
+ *
+ * The reason behind the choice for implementing the cache as a doubly linked
+ * list was that it allows for consant time addition to the list as well as
+ * constant time deletion from the list.
+ *
+ * Lookups do not walk the list. Every node is also chained into a hash
+ * table (buckets) indexed by a hash of its url that is computed once, when
+ * the node is created. check_for_hit hashes the query, walks only the
+ * matching bucket and only runs strcmp on nodes whose stored hash matches.
+ * add_to_cache and delete_from_cache keep the table in sync with the list,
+ * and the table doubles in size whenever the number of nodes exceeds the
+ * number of buckets, so a lookup costs O(1) however many objects are cached.
+ *
+ * Nodes are reference counted. The cache itself holds one reference for as
+ * long as a node is linked in, and check_for_hit hands out one more to the
+ * caller. This means the lock is only held for the lookup and the move to
+ * the front of the list: the caller streams the data to its client with no
+ * lock held and then calls release_cache_node. If the node was evicted in
+ * the meantime, it is freed by whichever side drops the last reference.
+ *
+ * Everything above describes a single shard. The cache is made up of
+ * nshards of them, and the hash of a url picks the one shard that may
+ * hold it. Each shard has its own lock, list, hash table and an equal
+ * share of the cache's budget, so LRU order is kept per shard and a hit in
+ * one shard never waits on a thread that is using another.
+ *
+ * With the CLOCK policy (second-chance) a hit does not touch the list at
+ * all: it only sets the node's reference bit. Lookups therefore only need
+ * the shard's lock in read mode and run in parallel with each other. New
+ * nodes still go to the front of the list, and the list is treated as a
+ * ring that the clock hand walks from the end towards the start. A node
+ * under the hand that has its bit set gets the bit cleared and a second
+ * chance; the first node found with a clear bit is evicted.
+ *
+ * With TinyLFU admission (W-TinyLFU) a new node does not go straight into
+ * the list described above (the main list). It goes to the front of a
+ * small LRU window that holds CACHE_WINDOW_PERCENT of the shard's bytes,
+ * or room for the biggest object the cache takes if that is more (up to
+ * half the shard). Nodes pushed out of the end of the window become
+ * candidates for the main list: if the main list is full, the candidate is only admitted when
+ * a count-min sketch of recent requests says it is asked for more often
+ * than the node the main list would evict for it. Otherwise the candidate
+ * itself is dropped. A scan of one-off urls therefore only churns the
+ * window and cannot flush the frequently used objects out of the cache.
+ * The sketch counts every lookup, hits and misses alike.
+ *
+ * A response is collected for the cache in a cache_buf while it is
+ * relayed. The bytes of each read go to the end of the last chunk of the
+ * buffer, or to a new chunk at least as big as everything collected so
+ * far, so a response is never moved once it has been copied in and a
+ * server that trickles bytes only makes a few chunks. The buffer lets go
+ * of its chunks as soon as the response grows past MAX_OBJECT_SIZE.
+ *
+ * Each object is a single block from the slab allocator (slab.c): the
+ * cache_node, then its url, then the data of the response, copied once
+ * out of the chunks it was collected in. Evicting an object frees its one
+ * block, and the memory of whole slab pages goes back to the system as
+ * they empty, so the proxy's memory use follows the size of the cache
+ * rather than the history of the heap.
+ *
+ * The budget counts what objects really cost rather than the bytes of
+ * their responses: a node is charged the size of its slab chunk (node,
+ * url, inline data and the rounding of its size class) plus the pages of
+ * its memfd, if it has one. The budget and the size of the biggest object
+ * are given when the cache is initialized, and sizes are 64-bit so the
+ * cache can be many gigabytes big.
+ *
+ * The cache may have a second tier on disk (disk.c). Nodes that leave
+ * memory, evicted or turned away by TinyLFU, are written to it, unless
+ * they came from it in the first place. A miss in memory looks on disk.
+ * An object found there that is small enough is read back into memory
+ * and served from there, a bigger one is served straight from its
+ * segment file with sendfile. Responses too big to be kept in memory are
+ * spilled to a file next to the log while they are relayed, and go
+ * straight to disk.
+ *
+ * Nobody serving a request waits for the disk to be written: demoted
+ * nodes and spilled responses are queued for a writer thread, which
+ * writes them in order. If it falls CACHE_WRITE_BACKLOG bytes behind,
+ * what comes next is dropped, the disk tier being only a cache. Event
+ * loops can't wait for a read either, so they look in memory with
+ * cache_lookup and hand the disk lookup to the reader threads with
+ * cache_load_start, which write the loop's eventfd when it is over.
+ *
+ * Objects of CACHE_MEMFD_MIN bytes or more are not kept in the block.
+ * Their data goes into a sealed memfd, which hits send to the client
+ * with sendfile, so the kernel copies the bytes straight from the page
+ * cache to the socket. The memfd is also mapped read-only at data, for
+ * anything that wants to look at the bytes.
+ */
+
+#define _GNU_SOURCE
+#include "cache.h"
+#include "slab.h"
+#include <limits.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+/* Most chunks sent or stored by one writev */
+#define CACHE_IOV_MAX 64
+
+/* Initial number of hash buckets per shard, grown as the shard fills up */
+#define CACHE_INIT_BUCKETS 64
+
+/* Something for the writer thread to put on disk: an evicted node, or a
+   spilled response */
+struct cache_write{
+  cache_node *node; //the node, whose reference the write holds, or NULL
+  char *url; //for a spilled response, the url and the file it is in
+  int fd;
+  size_t len;
+  size_t head_len;
+  time_t expires;
+  long lifetime;
+  struct cache_write *next;
+};
+
+struct cache_load{
+  char *url;
+  unsigned int hash;
+  int notify_fd; //eventfd written once the lookup is over
+  int done; //the lookup is over, node is what it found
+  int cancelled; //nobody wants the node any more
+  cache_node *node; //carries a reference for whoever takes it
+  struct cache_load *next;
+};
+
+static unsigned int hash_url(char *url);
+static cache_shard *shard_for(cache *c_cache, unsigned int h);
+static void hash_insert(cache_shard *shard, cache_node *p);
+static cache_node *hash_find(cache_shard *shard, char *url, unsigned int h);
+static void hash_remove(cache_shard *shard, cache_node *p);
+static void hash_grow(cache_shard *shard);
+static void list_push(cache_node **start, cache_node **end, cache_node *p);
+static void list_unlink(cache_node **start, cache_node **end, cache_node *p);
+static void fix_linking(cache_node *p, cache_shard *shard);
+static cache_node *clock_victim(cache_shard *shard);
+static cache_node *main_victim(cache_shard *shard, int policy);
+static void insert_node(cache *c_cache, cache_shard *shard, cache_node *p);
+static void admit_candidate(cache_shard *shard, cache_node *p, int policy,
+    cache_node **evicted);
+static void delete_from_cache(cache_shard *shard, int policy,
+    cache_node **evicted);
+static void drop_node(cache_shard *shard, cache_node *p, cache_node **evicted);
+static void remove_node(cache_shard *shard, cache_node *p);
+static void demote(cache *c_cache, cache_node *evicted);
+static void queue_write(cache *c_cache, struct cache_write *w);
+static void *disk_writer(void *vargp);
+static void *disk_reader(void *vargp);
+static cache_node *disk_hit(cache *c_cache, char *query, unsigned int h);
+static int spill(cache_buf *b);
+static cache_node *new_node(char *url, cache_buf *b);
+static int store_memfd(cache_buf *b, char **data);
+static size_t node_charge(cache_node *p);
+static void free_chunks(cache_chunk *chunk);
+static int chunk_iov(cache_chunk *chunk, size_t off, struct iovec *iov);
+
+/*
+ * initialize_cache - this function allocates space for the
+ * cache. It does what its name suggests, initializes a cache
+ * which can be used by the proxy. max_size bytes are split evenly
+ * between the nshards shards, objects bigger than max_object bytes are
+ * never kept in memory, policy selects LRU or CLOCK eviction and
+ * admission selects whether TinyLFU filters what enters the main list.
+ * disk is the second tier, or NULL if there is none.
+ */
+cache *initialize_cache(unsigned int nshards, int policy, int admission,
+    size_t max_size, size_t max_object, disk_store *disk){
+  unsigned int i;
+  slab_init();
+  cache *proxy_cache = Calloc(1, sizeof(cache));
+  if (nshards < 1){
+    nshards = 1;
+  }
+  proxy_cache->policy = policy;
+  proxy_cache->admission = admission;
+  proxy_cache->nshards = nshards;
+  proxy_cache->max_size = max_size;
+  proxy_cache->max_object = max_object;
+  proxy_cache->disk = disk;
+  proxy_cache->shards = Calloc(nshards, sizeof(cache_shard));
+  for (i = 0; i < nshards; i++){
+    cache_shard *shard = &proxy_cache->shards[i];
+    pthread_rwlock_init(&shard->lock, 0);
+    shard->start = NULL; //initially there is no start
+    shard->end = NULL; //initially there is no end
+    shard->hand = NULL; //and nothing for the clock hand to point at
+    shard->cache_size = 0; //initially there is no data in the cache
+    shard->max_size = max_size / nshards;
+    shard->wstart = NULL;
+    shard->wend = NULL;
+    shard->wsize = 0;
+    //the window holds its share of the bytes, but at least the biggest
+    //object, or objects would drop out of it as soon as they arrived.
+    //Half of the shard at most is left to the main list
+    shard->wmax = shard->max_size / 100 * CACHE_WINDOW_PERCENT;
+    if (shard->wmax < max_object){
+      shard->wmax = max_object;
+    }
+    if (shard->wmax > shard->max_size / 2){
+      shard->wmax = shard->max_size / 2;
+    }
+    //one counter per 512 bytes of budget tracks several times more urls
+    //than the shard can hold, which is what the sketch needs
+    sketch_init(&shard->sketch, (shard->max_size / 512 > UINT_MAX) ?
+      UINT_MAX : shard->max_size / 512);
+    shard->nbuckets = CACHE_INIT_BUCKETS;
+    shard->buckets = Calloc(CACHE_INIT_BUCKETS, sizeof(cache_node *));
+    shard->nnodes = 0;
+  }
+  pthread_mutex_init(&proxy_cache->disk_lock, NULL);
+  pthread_cond_init(&proxy_cache->write_cond, NULL);
+  pthread_cond_init(&proxy_cache->load_cond, NULL);
+  if (disk != NULL){
+    pthread_t tid;
+    Pthread_create(&tid, NULL, disk_writer, proxy_cache);
+    for (i = 0; i < CACHE_DISK_READERS; i++){
+      Pthread_create(&tid, NULL, disk_reader, proxy_cache);
+    }
+  }
+  return proxy_cache;
+}
+
+/*
+ * hash_url - this function computes the 32-bit FNV-1a hash of a url.
+ * It is computed once per node (in add_to_cache) and once per lookup
+ * (in check_for_hit).
+ */
+static unsigned int hash_url(char *url){
+  unsigned int h = 2166136261u;
+  unsigned char *c;
+  for (c = (unsigned char *)url; *c != '\0'; c++){
+    h ^= *c;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/*
+ * shard_for - this function returns the shard a url with hash h lives in.
+ * The buckets inside a shard are picked with the low bits of h, so the
+ * shard is picked from a remixed copy of it. Otherwise every node in a
+ * shard would fall into the same few buckets.
+ */
+static cache_shard *shard_for(cache *c_cache, unsigned int h){
+  h ^= h >> 16;
+  h *= 0x45d9f3bu;
+  h ^= h >> 16;
+  return &c_cache->shards[h % c_cache->nshards];
+}
+
+/*
+ * hash_insert - this function adds the cache_node p to the front of the
+ * bucket its hash maps to. There is at most one node per url, insert_node
+ * removes the one p replaces first.
+ */
+static void hash_insert(cache_shard *shard, cache_node *p){
+  unsigned int b = p->hash & (shard->nbuckets - 1);
+  p->hnext = shard->buckets[b];
+  shard->buckets[b] = p;
+  shard->nnodes += 1;
+  if (shard->nnodes > shard->nbuckets){
+    //keep the average bucket length at or below one
+    hash_grow(shard);
+  }
+}
+
+/*
+ * hash_find - this function returns the node of the shard for the url
+ * with hash h, or NULL if there is none. The caller must hold the shard's
+ * lock.
+ */
+static cache_node *hash_find(cache_shard *shard, char *url, unsigned int h){
+  cache_node *p = shard->buckets[h & (shard->nbuckets - 1)];
+  while (p != NULL && !(p->hash == h && strcmp(p->url, url) == 0)){
+    p = p->hnext;
+  }
+  return p;
+}
+
+/*
+ * hash_remove - this function unlinks the cache_node p from its bucket
+ */
+static void hash_remove(cache_shard *shard, cache_node *p){
+  cache_node **pp = &shard->buckets[p->hash & (shard->nbuckets - 1)];
+  while (*pp != NULL){
+    if (*pp == p){
+      *pp = p->hnext;
+      shard->nnodes -= 1;
+      return;
+    }
+    pp = &(*pp)->hnext;
+  }
+}
+
+/*
+ * hash_grow - this function doubles the number of buckets and moves every
+ * node into its new bucket. Since the hash is stored in the node, no url
+ * has to be hashed again.
+ */
+static void hash_grow(cache_shard *shard){
+  unsigned int nbuckets = shard->nbuckets * 2;
+  cache_node **buckets = Calloc(nbuckets, sizeof(cache_node *));
+  unsigned int i;
+  for (i = 0; i < shard->nbuckets; i++){
+    cache_node *p = shard->buckets[i];
+    while (p != NULL){
+      cache_node *next = p->hnext;
+      unsigned int b = p->hash & (nbuckets - 1);
+      p->hnext = buckets[b];
+      buckets[b] = p;
+      p = next;
+    }
+  }
+  Free(shard->buckets);
+  shard->buckets = buckets;
+  shard->nbuckets = nbuckets;
+}
+
+/*
+ * list_push - this function adds the cache_node p to the front of the
+ * list that runs from *start to *end
+ */
+static void list_push(cache_node **start, cache_node **end, cache_node *p){
+  p->prev = NULL;
+  p->next = *start;
+  if (*start == NULL){
+    //the list is empty, so p is both its start and its end
+    *end = p;
+  }
+  else {
+    (*start)->prev = p;
+  }
+  *start = p;
+}
+
+/*
+ * list_unlink - this function removes the cache_node p from wherever it is
+ * in the list that runs from *start to *end
+ */
+static void list_unlink(cache_node **start, cache_node **end, cache_node *p){
+  if (p->prev != NULL){
+    p->prev->next = p->next;
+  }
+  else { //p was the start of the list
+    *start = p->next;
+  }
+  if (p->next != NULL){
+    p->next->prev = p->prev;
+  }
+  else { //p was the end of the list
+    *end = p->prev;
+  }
+  p->prev = NULL;
+  p->next = NULL;
+}
+
+/*
+ * fix_linking - this function basically the cache_node p
+ * from wherever it is in the cache linked list, to the front
+ * of the list to indicate that it has been most recently used
+ * Nodes in the TinyLFU window move to the front of the window.
+ */
+static void fix_linking(cache_node *p, cache_shard *shard){
+  if (p->prev != NULL){
+    if (p->in_window){
+      list_unlink(&shard->wstart, &shard->wend, p);
+      list_push(&shard->wstart, &shard->wend, p);
+    }
+    else {
+      list_unlink(&shard->start, &shard->end, p);
+      list_push(&shard->start, &shard->end, p);
+    }
+  }
+}
+
+/*
+ * check_for_hit - this function checks whether the data associated
+ * with the url query has been cached in our cache. If so,
+ * then it returns the cache node which has the data in question
+ * and moves that node to the front of its shard
+ * Otherwise it looks on disk, if the cache has a second tier, and
+ * returns NULL if the object isn't there either
+ * The returned node carries a reference that the caller must drop with
+ * release_cache_node once it is done reading the data.
+ */
+cache_node *check_for_hit(cache *c_cache, char *query){
+  cache_node *p = cache_lookup(c_cache, query);
+  if (p == NULL && c_cache->disk != NULL){
+    p = disk_hit(c_cache, query, hash_url(query));
+  }
+  return p;
+}
+
+/*
+ * cache_lookup - this function is check_for_hit without the disk tier.
+ * It never waits for the disk, which event loops use cache_load_start
+ * for.
+ */
+cache_node *cache_lookup(cache *c_cache, char *query){
+  unsigned int h = hash_url(query);
+  cache_shard *shard = shard_for(c_cache, h);
+  int clock = (c_cache->policy == CACHE_CLOCK);
+  if (clock){
+    //a CLOCK hit never relinks nodes, so other readers can share the lock
+    pthread_rwlock_rdlock(&shard->lock);
+  }
+  else {
+    //we don't want other threads accessing the shard while we might be
+    //changing the order of nodes in it
+    pthread_rwlock_wrlock(&shard->lock);
+  }
+  if (c_cache->admission == CACHE_ADMIT_TINYLFU){
+    //count the request whether it hits or not, a miss now is what lets
+    //the object into the main list later
+    sketch_increment(&shard->sketch, h);
+  }
+  cache_node *p = hash_find(shard, query, h);
+  if (p != NULL){
+    if (clock){
+      __atomic_store_n(&p->referenced, 1, __ATOMIC_RELAXED);
+    }
+    else {
+      fix_linking(p, shard);
+    }
+    //pin the node so that it can't be freed while the caller is
+    //still sending its data
+    __atomic_add_fetch(&p->refcnt, 1, __ATOMIC_RELAXED);
+  }
+  pthread_rwlock_unlock(&shard->lock);
+  return p;
+}
+
+/*
+ * cache_load_start - this function hands the lookup of the url query on
+ * the disk tier, which the cache must have, to the reader threads.
+ * notify_fd, an eventfd, is written once it is over, and the caller
+ * then takes what was found with cache_load_done, or gives up on it
+ * with cache_load_cancel.
+ */
+cache_load *cache_load_start(cache *c_cache, char *query, int notify_fd){
+  cache_load *l = Calloc(1, sizeof(cache_load));
+  l->url = Malloc(strlen(query) + 1);
+  strcpy(l->url, query);
+  l->hash = hash_url(query);
+  l->notify_fd = notify_fd;
+  pthread_mutex_lock(&c_cache->disk_lock);
+  if (c_cache->loads_tail != NULL){
+    c_cache->loads_tail->next = l;
+  }
+  else {
+    c_cache->loads = l;
+  }
+  c_cache->loads_tail = l;
+  pthread_cond_signal(&c_cache->load_cond);
+  pthread_mutex_unlock(&c_cache->disk_lock);
+  return l;
+}
+
+/*
+ * cache_load_done - this function returns 0 if the lookup l isn't over.
+ * Otherwise it stores at *p what check_for_hit would have returned,
+ * frees l and returns 1.
+ */
+int cache_load_done(cache *c_cache, cache_load *l, cache_node **p){
+  int done;
+  pthread_mutex_lock(&c_cache->disk_lock);
+  done = l->done;
+  pthread_mutex_unlock(&c_cache->disk_lock);
+  if (!done){
+    return 0;
+  }
+  *p = l->node;
+  Free(l->url);
+  Free(l);
+  return 1;
+}
+
+/*
+ * cache_load_cancel - this function gives up on the lookup l, which is
+ * freed once it is over
+ */
+void cache_load_cancel(cache *c_cache, cache_load *l){
+  cache_node *p;
+  pthread_mutex_lock(&c_cache->disk_lock);
+  l->cancelled = !l->done;
+  pthread_mutex_unlock(&c_cache->disk_lock);
+  if (!l->cancelled && cache_load_done(c_cache, l, &p) && p != NULL){
+    release_cache_node(p);
+  }
+}
+
+
+/*
+ * add_to_cache - this function creates a new cache node with the given
+ * information: query as the url and q_data as the data associated with that
+ * url, which the cache takes over (q_data is left empty). head_len is
+ * the length of the head the response in q_data starts with, and
+ * expires when it stops being fresh, lifetime seconds after it was sent
+ * the newly created node is added to the front of its shard, or to the
+ * front of the shard's window when TinyLFU admission is on
+ */
+void add_to_cache(cache *c_cache, char *query, cache_buf *q_data,
+    size_t head_len, time_t expires, long lifetime)
+{
+  unsigned int h = hash_url(query);
+  cache_shard *shard = shard_for(c_cache, h);
+  size_t q_size = q_data->size;
+  if (q_data->spill_fd >= 0){
+    //too big to be kept in memory, it goes straight to disk, and the
+    //writer thread closes the file once it has been copied
+    struct cache_write *w = Calloc(1, sizeof(struct cache_write));
+    w->url = Malloc(strlen(query) + 1);
+    strcpy(w->url, query);
+    w->fd = q_data->spill_fd;
+    w->len = q_size;
+    w->head_len = head_len;
+    w->expires = expires;
+    w->lifetime = lifetime;
+    q_data->spill_fd = -1;
+    queue_write(c_cache, w);
+  }
+  else if (!q_data->full && !(q_size > c_cache->max_object) &&
+      !(q_size + sizeof(cache_node) + strlen(query) >= shard->max_size)){
+    //we only add a web obect to the cache if its size is less than
+    //the max object size allowed, and if it fits in its shard at all
+    //the node is made before taking the lock, nobody can see it yet
+    cache_node *to_add = new_node(query, q_data);
+    to_add->head_len = head_len;
+    to_add->expires = expires;
+    to_add->lifetime = lifetime;
+    to_add->hash = h;
+    to_add->refcnt = 1; //the reference held by the cache
+    insert_node(c_cache, shard, to_add);
+  }
+  cache_buf_drop(q_data);
+}
+
+/*
+ * insert_node - this function adds the new cache_node p to the front of
+ * its shard, or to the front of the shard's window when TinyLFU
+ * admission is on, and evicts what no longer fits. An older node for the
+ * same url, like a stale object that was fetched again, is replaced.
+ * Evicted nodes go to the disk tier once the lock is released.
+ */
+static void insert_node(cache *c_cache, cache_shard *shard, cache_node *p){
+  cache_node *evicted = NULL, *old;
+  if (p->charge > shard->max_size){
+    //the rounding of its chunk pushed it over
+    release_cache_node(p);
+    return;
+  }
+  //again, we don't want other threads accessing the shard while we
+  //are writing to it
+  pthread_rwlock_wrlock(&shard->lock);
+  if ((old = hash_find(shard, p->url, p->hash)) != NULL){
+    //the old copy would go on taking up room, and be written to
+    //snapshots, even though nobody can find it any more
+    remove_node(shard, old);
+  }
+  hash_insert(shard, p);
+  //update the shard size to include what the new node takes up
+  shard->cache_size += p->charge;
+  if (c_cache->admission == CACHE_ADMIT_TINYLFU){
+    //new objects always get into the window, and whatever falls out
+    //of the end of the window has to earn its place in the main list
+    p->in_window = 1;
+    list_push(&shard->wstart, &shard->wend, p);
+    shard->wsize += p->charge;
+    while (shard->wsize > shard->wmax && shard->wend != NULL){
+      cache_node *candidate = shard->wend;
+      list_unlink(&shard->wstart, &shard->wend, candidate);
+      candidate->in_window = 0;
+      shard->wsize -= candidate->charge;
+      admit_candidate(shard, candidate, c_cache->policy, &evicted);
+    }
+  }
+  else {
+    //we just add the newly created node to the front of the shard
+    list_push(&shard->start, &shard->end, p);
+  }
+  //if the addition of the new data caused us to exceed the maximum
+  //size allowed for the shard, we keep deleting nodes from the end of
+  //it till it is within the required size bounds
+  while (shard->cache_size > shard->max_size && shard->end != NULL){
+    delete_from_cache(shard, c_cache->policy, &evicted);
+  }
+  //we're done writing to the shard, so we can now allow other threads
+  //to access it
+  pthread_rwlock_unlock(&shard->lock);
+  if (old != NULL){
+    //it is out of date, so it isn't demoted, a reader may still be
+    //using it though
+    release_cache_node(old);
+  }
+  demote(c_cache, evicted);
+}
+
+/*
+ * clock_victim - this function advances the clock hand of the shard until
+ * it finds a node whose reference bit is clear, clearing the bits it
+ * passes over, and returns that node. The hand moves from the end of the
+ * list towards the start and wraps around, so it is guaranteed to find a
+ * victim within two turns. The hand is left on the victim, so the nodes
+ * it passed over aren't looked at again before the others. The caller
+ * must hold the shard's lock for writing.
+ */
+static cache_node *clock_victim(cache_shard *shard){
+  cache_node *p = (shard->hand != NULL) ? shard->hand : shard->end;
+  while (__atomic_exchange_n(&p->referenced, 0, __ATOMIC_RELAXED)){
+    //the node was used since the hand last passed, give it another chance
+    p = (p->prev != NULL) ? p->prev : shard->end;
+  }
+  //the nodes passed over have had their chance, the next look starts here
+  shard->hand = p;
+  return p;
+}
+
+/*
+ * main_victim - this function returns the node of the main list that
+ * would be evicted next, or NULL if the main list is empty. Under LRU
+ * this is the last node (that is the end node), since this will always
+ * be the least recently used node. Under CLOCK it is the node the clock
+ * hand stops at.
+ */
+static cache_node *main_victim(cache_shard *shard, int policy){
+  if (shard->end == NULL){
+    return NULL;
+  }
+  if (policy == CACHE_CLOCK){
+    return clock_victim(shard);
+  }
+  return shard->end;
+}
+
+/*
+ * admit_candidate - this function decides the fate of the cache_node p,
+ * which was just pushed out of the TinyLFU window. If the shard has room,
+ * or p has been requested more often than the main list's victim, p moves
+ * to the front of the main list (and the shard's size is brought back in
+ * bounds by insert_node). Otherwise p is dropped from the cache.
+ */
+static void admit_candidate(cache_shard *shard, cache_node *p, int policy,
+    cache_node **evicted){
+  if (shard->cache_size > shard->max_size){
+    cache_node *victim = main_victim(shard, policy);
+    if (victim != NULL && sketch_estimate(&shard->sketch, p->hash) <=
+        sketch_estimate(&shard->sketch, victim->hash)){
+      //the object already in the cache is at least as popular, keep it
+      drop_node(shard, p, evicted);
+      return;
+    }
+  }
+  list_push(&shard->start, &shard->end, p);
+}
+
+/*
+ * delete_from_cache - this function deletes one node from the main list
+ * of the shard, the one main_victim picks, and adds it to *evicted. The
+ * caller must hold the shard's lock.
+ */
+static void delete_from_cache(cache_shard *shard, int policy,
+    cache_node **evicted){
+  cache_node *temp = main_victim(shard, policy);
+  if (temp != NULL){ //can't delete from an empty cache!
+    if (policy == CACHE_CLOCK){
+      //the hand continues from the node after the victim
+      shard->hand = temp->prev;
+    }
+    list_unlink(&shard->start, &shard->end, temp);
+    drop_node(shard, temp, evicted);
+  }
+}
+
+/*
+ * drop_node - this function removes the cache_node p, which is no longer
+ * on any list, from the shard's hash table and size and adds it to the
+ * list *evicted, linked through hnext. The cache's reference goes with it.
+ */
+static void drop_node(cache_shard *shard, cache_node *p, cache_node **evicted){
+  //since we're removing the node, we update the size of the cache
+  //to exclude what it takes up
+  shard->cache_size -= p->charge;
+  hash_remove(shard, p);
+  p->hnext = *evicted;
+  *evicted = p;
+}
+
+/*
+ * remove_node - this function takes the cache_node p out of the list it
+ * is on, the window or the main list, and out of the shard's hash table
+ * and size. The cache's reference is left for the caller to drop. The
+ * caller must hold the shard's lock.
+ */
+static void remove_node(cache_shard *shard, cache_node *p){
+  if (p->in_window){
+    list_unlink(&shard->wstart, &shard->wend, p);
+    shard->wsize -= p->charge;
+  }
+  else {
+    if (shard->hand == p){
+      shard->hand = p->prev;
+    }
+    list_unlink(&shard->start, &shard->end, p);
+  }
+  shard->cache_size -= p->charge;
+  hash_remove(shard, p);
+}
+
+/*
+ * demote - this function queues the nodes of the list evicted to be
+ * written to the disk tier, if there is one and they aren't already on
+ * it, and drops the cache's references to the others
+ */
+static void demote(cache *c_cache, cache_node *evicted){
+  while (evicted != NULL){
+    cache_node *next = evicted->hnext;
+    if (c_cache->disk != NULL && !evicted->on_disk){
+      //the write takes over the cache's reference
+      struct cache_write *w = Calloc(1, sizeof(struct cache_write));
+      w->node = evicted;
+      w->len = evicted->data_size;
+      queue_write(c_cache, w);
+    }
+    else {
+      //a reader may still be using the node
+      release_cache_node(evicted);
+    }
+    evicted = next;
+  }
+}
+
+/*
+ * queue_write - this function queues w for the writer thread, or drops
+ * it if the writer is too far behind
+ */
+static void queue_write(cache *c_cache, struct cache_write *w){
+  pthread_mutex_lock(&c_cache->disk_lock);
+  if (c_cache->writes_bytes + w->len > CACHE_WRITE_BACKLOG){
+    pthread_mutex_unlock(&c_cache->disk_lock);
+    if (w->node != NULL){
+      release_cache_node(w->node);
+    }
+    else {
+      close(w->fd);
+      Free(w->url);
+    }
+    Free(w);
+    return;
+  }
+  c_cache->writes_bytes += w->len;
+  if (c_cache->writes_tail != NULL){
+    c_cache->writes_tail->next = w;
+  }
+  else {
+    c_cache->writes = w;
+  }
+  c_cache->writes_tail = w;
+  pthread_cond_signal(&c_cache->write_cond);
+  pthread_mutex_unlock(&c_cache->disk_lock);
+}
+
+/*
+ * disk_writer - this is the body of the writer thread, which writes the
+ * queued demotions and spills to the disk tier one after the other
+ */
+static void *disk_writer(void *vargp){
+  cache *c_cache = vargp;
+  struct cache_write *w;
+  Pthread_detach(pthread_self());
+  while (1){
+    pthread_mutex_lock(&c_cache->disk_lock);
+    while (c_cache->writes == NULL){
+      pthread_cond_wait(&c_cache->write_cond, &c_cache->disk_lock);
+    }
+    w = c_cache->writes;
+    if ((c_cache->writes = w->next) == NULL){
+      c_cache->writes_tail = NULL;
+    }
+    pthread_mutex_unlock(&c_cache->disk_lock);
+    if (w->node != NULL){
+      cache_node *p = w->node;
+      disk_put(c_cache->disk, p->url, p->data, -1, p->data_size, p->head_len,
+        __atomic_load_n(&p->expires, __ATOMIC_RELAXED), p->lifetime);
+      //a reader may still be using the node
+      release_cache_node(p);
+    }
+    else {
+      disk_put(c_cache->disk, w->url, NULL, w->fd, w->len, w->head_len,
+        w->expires, w->lifetime);
+      close(w->fd);
+      Free(w->url);
+    }
+    //only now, so the backlog counts the write under way
+    pthread_mutex_lock(&c_cache->disk_lock);
+    c_cache->writes_bytes -= w->len;
+    pthread_mutex_unlock(&c_cache->disk_lock);
+    Free(w);
+  }
+  return NULL;
+}
+
+/*
+ * disk_reader - this is the body of a reader thread, which does the
+ * lookups queued by cache_load_start and tells their event loops
+ */
+static void *disk_reader(void *vargp){
+  cache *c_cache = vargp;
+  cache_load *l;
+  cache_node *p;
+  uint64_t one = 1;
+  int cancelled;
+  Pthread_detach(pthread_self());
+  while (1){
+    pthread_mutex_lock(&c_cache->disk_lock);
+    while (c_cache->loads == NULL){
+      pthread_cond_wait(&c_cache->load_cond, &c_cache->disk_lock);
+    }
+    l = c_cache->loads;
+    if ((c_cache->loads = l->next) == NULL){
+      c_cache->loads_tail = NULL;
+    }
+    pthread_mutex_unlock(&c_cache->disk_lock);
+    p = disk_hit(c_cache, l->url, l->hash);
+    pthread_mutex_lock(&c_cache->disk_lock);
+    l->node = p;
+    l->done = 1;
+    cancelled = l->cancelled;
+    if (!cancelled && write(l->notify_fd, &one, sizeof(one)) < 0){
+      //the counter is already set, the loop will look anyway
+    }
+    pthread_mutex_unlock(&c_cache->disk_lock);
+    if (cancelled){
+      if (p != NULL){
+        release_cache_node(p);
+      }
+      Free(l->url);
+      Free(l);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * disk_hit - this function looks the url query, with hash h, up on disk.
+ * An object small enough for memory is read back into the cache and its
+ * node is returned. Otherwise a node that is in no shard is returned,
+ * which sends the object from its segment file. Either carries a
+ * reference for the caller. It returns NULL if the object isn't on disk.
+ */
+static cache_node *disk_hit(cache *c_cache, char *query, unsigned int h){
+  disk_object o;
+  cache_node *p;
+  size_t url_len = strlen(query) + 1;
+  if (disk_get(c_cache->disk, query, &o) < 0){
+    return NULL;
+  }
+  if (o.len <= c_cache->max_object){
+    cache_buf b;
+    cache_chunk *chunk = Malloc(sizeof(cache_chunk) + o.len);
+    chunk->next = NULL;
+    chunk->len = chunk->cap = o.len;
+    if (pread(o.fd, chunk->data, o.len, o.off) == (ssize_t)o.len){
+      close(o.fd);
+      cache_buf_init(&b, c_cache);
+      b.head = b.tail = chunk;
+      b.size = o.len;
+      p = new_node(query, &b);
+      p->head_len = o.head_len;
+      p->expires = o.expires;
+      p->lifetime = o.lifetime;
+      p->hash = h;
+      p->on_disk = 1; //it needn't be written again when it is evicted
+      p->refcnt = 2; //the cache's and the caller's
+      insert_node(c_cache, shard_for(c_cache, h), p);
+      return p;
+    }
+    Free(chunk);
+  }
+  p = slab_alloc(sizeof(cache_node) + url_len);
+  memset(p, 0, sizeof(cache_node));
+  p->url = (char *)(p + 1);
+  memcpy(p->url, query, url_len);
+  p->fd = o.fd;
+  p->file_off = o.off;
+  p->data_size = o.len;
+  p->head_len = o.head_len;
+  p->expires = o.expires;
+  p->lifetime = o.lifetime;
+  p->hash = h;
+  p->on_disk = 1;
+  p->refcnt = 1; //only the caller's, the node is in no shard
+  return p;
+}
+
+/*
+ * release_cache_node - this function drops one reference to the cache_node
+ * p. The node is freed when the last reference goes away, which can only
+ * happen once it has been evicted from the cache.
+ */
+void release_cache_node(cache_node *p){
+  if (__atomic_sub_fetch(&p->refcnt, 1, __ATOMIC_ACQ_REL) == 0){
+    //the url and the data are in the node's block, unless the data
+    //is in a memfd or on disk
+    if (p->fd >= 0){
+      if (p->data != NULL){
+        munmap(p->data, p->data_size);
+      }
+      close(p->fd);
+    }
+    slab_free(p);
+  }
+}
+
+/*
+ * cache_node_fresh - this function returns whether the object in p is
+ * still fresh, and may be sent without asking the server
+ */
+int cache_node_fresh(cache_node *p){
+  return __atomic_load_n(&p->expires, __ATOMIC_RELAXED) > time(NULL);
+}
+
+/*
+ * cache_refresh - this function makes the object in p fresh again, after
+ * the server said it hasn't changed: it now stops being fresh at expires,
+ * and lifetime seconds after its next revalidation. The disk tier's copy
+ * is refreshed too, so the object doesn't go stale again when it is
+ * demoted or read back.
+ */
+void cache_refresh(cache *c_cache, cache_node *p, time_t expires,
+    long lifetime){
+  //readers only look at expires, a racing refresh wins either way
+  p->lifetime = lifetime;
+  __atomic_store_n(&p->expires, expires, __ATOMIC_RELAXED);
+  if (p->on_disk && c_cache->disk != NULL){
+    disk_refresh(c_cache->disk, p->url, expires, lifetime);
+  }
+}
+
+/*
+ * cache_node_head - this function copies the first len bytes of the
+ * object in p, or all of it if it is smaller, to buf, wherever the data
+ * is kept, and returns how many it copied
+ */
+size_t cache_node_head(cache_node *p, char *buf, size_t len){
+  ssize_t n;
+  if (len > p->data_size){
+    len = p->data_size;
+  }
+  if (p->data != NULL){
+    memcpy(buf, p->data, len);
+    return len;
+  }
+  n = pread(p->fd, buf, len, p->file_off);
+  return (n < 0) ? 0 : n;
+}
+
+/*
+ * cache_used - this function returns the bytes taken up by the nodes of
+ * the cache, the figure its budget is checked against, and stores the
+ * number of nodes at *nobjects
+ */
+size_t cache_used(cache *c_cache, size_t *nobjects){
+  size_t used = 0, n = 0;
+  unsigned int i;
+  for (i = 0; i < c_cache->nshards; i++){
+    cache_shard *shard = &c_cache->shards[i];
+    pthread_rwlock_rdlock(&shard->lock);
+    used += shard->cache_size;
+    n += shard->nnodes;
+    pthread_rwlock_unlock(&shard->lock);
+  }
+  *nobjects = n;
+  return used;
+}
+
+/*
+ * cache_nodes - this function returns every node held in memory, shard
+ * by shard and from the least to the most recently used (the window of
+ * a shard after its main list), and stores their number at *n. Each node
+ * carries a reference that the caller must drop with release_cache_node,
+ * and the caller frees the array.
+ */
+cache_node **cache_nodes(cache *c_cache, size_t *n){
+  cache_node **nodes = NULL, *p;
+  size_t count = 0;
+  unsigned int i;
+  for (i = 0; i < c_cache->nshards; i++){
+    cache_shard *shard = &c_cache->shards[i];
+    pthread_rwlock_rdlock(&shard->lock);
+    nodes = Realloc(nodes, (count + shard->nnodes + 1) * sizeof(cache_node *));
+    for (p = shard->end; p != NULL; p = p->prev){
+      __atomic_add_fetch(&p->refcnt, 1, __ATOMIC_RELAXED);
+      nodes[count++] = p;
+    }
+    for (p = shard->wend; p != NULL; p = p->prev){
+      __atomic_add_fetch(&p->refcnt, 1, __ATOMIC_RELAXED);
+      nodes[count++] = p;
+    }
+    pthread_rwlock_unlock(&shard->lock);
+  }
+  *n = count;
+  return nodes;
+}
+
+/*
+ * cache_node_send - this function writes the object p to fd with a single
+ * system call, from offset off on, with the len bytes at framing put in
+ * before the blank line that ends its head: the headers that say how it
+ * is framed for this client. off counts those bytes too. The body of
+ * objects kept in a memfd or on disk is sent with sendfile, without
+ * copying it through user space. It returns the number of bytes written,
+ * or -1 with errno set, like write does.
+ */
+ssize_t cache_node_send(int fd, cache_node *p, size_t off,
+    const char *framing, size_t len){
+  size_t split = (p->head_len >= 2) ? p->head_len - 2 : 0;
+  struct iovec iov[3];
+  int n = 0;
+  off_t pos;
+  if (off >= split + len){
+    //only body is left
+    off -= len;
+    if (p->fd >= 0){
+      pos = p->file_off + off;
+      return sendfile(fd, p->fd, &pos, p->data_size - off);
+    }
+    return write(fd, p->data + off, p->data_size - off);
+  }
+  if (off < split){
+    if (p->data == NULL){
+      //the object is on disk, its head is sent on its own
+      pos = p->file_off + off;
+      return sendfile(fd, p->fd, &pos, split - off);
+    }
+    iov[n].iov_base = p->data + off;
+    iov[n++].iov_len = split - off;
+    off = split;
+  }
+  iov[n].iov_base = (char *)framing + (off - split);
+  iov[n++].iov_len = split + len - off;
+  if (p->fd < 0){
+    //an object in the block goes out in one piece
+    iov[n].iov_base = p->data + split;
+    iov[n++].iov_len = p->data_size - split;
+  }
+  return writev(fd, iov, n);
+}
+
+/*
+ * cache_buf_init - this function gets b ready to collect a response for
+ * c_cache, up to the biggest object it takes in memory, or on disk if it
+ * has a second tier that takes bigger ones
+ */
+void cache_buf_init(cache_buf *b, cache *c_cache){
+  b->head = b->tail = NULL;
+  b->size = 0;
+  b->mem_limit = b->limit = c_cache->max_object;
+  b->disk = c_cache->disk;
+  if (b->disk != NULL && disk_max_object(b->disk) > b->limit){
+    b->limit = disk_max_object(b->disk);
+  }
+  b->spill_fd = -1;
+  b->full = 0;
+}
+
+/*
+ * cache_buf_append - this function adds the next len bytes of the
+ * response to b, unless the response has become too big for the cache
+ */
+void cache_buf_append(cache_buf *b, char *data, size_t len){
+  size_t n;
+  if (b->full || b->size + len > b->limit ||
+      (b->spill_fd < 0 && b->size + len > b->mem_limit && !spill(b))){
+    cache_buf_skip(b, len);
+    return;
+  }
+  if (b->spill_fd >= 0){
+    if (rio_writen(b->spill_fd, data, len) < 0){
+      cache_buf_skip(b, len);
+      return;
+    }
+    b->size += len;
+    return;
+  }
+  b->size += len;
+  //fill up the room left in the last chunk first
+  if (b->tail != NULL){
+    n = b->tail->cap - b->tail->len;
+    n = (n < len) ? n : len;
+    memcpy(b->tail->data + b->tail->len, data, n);
+    b->tail->len += n;
+    data += n;
+    len -= n;
+  }
+  if (len > 0){
+    //the new chunk is as big as everything so far, a trickle of small
+    //reads still only makes a few chunks
+    size_t cap = (len > b->size - len) ? len : b->size - len;
+    cache_chunk *chunk = Malloc(sizeof(cache_chunk) + cap);
+    chunk->next = NULL;
+    chunk->len = len;
+    chunk->cap = cap;
+    memcpy(chunk->data, data, len);
+    if (b->tail != NULL){
+      b->tail->next = chunk;
+    }
+    else {
+      b->head = chunk;
+    }
+    b->tail = chunk;
+  }
+}
+
+/*
+ * cache_buf_skip - this function counts len bytes of the response that
+ * were relayed without being collected, for instance because they were
+ * spliced. The response can't be cached any more, so b lets go of what
+ * it has collected.
+ */
+void cache_buf_skip(cache_buf *b, size_t len){
+  cache_buf_drop(b);
+  b->size += len;
+}
+
+/*
+ * cache_buf_drop - this function frees the chunks or the spill file of
+ * b. b can't be used to cache the response any more, until it is
+ * initialized again.
+ */
+void cache_buf_drop(cache_buf *b){
+  free_chunks(b->head);
+  b->head = b->tail = NULL;
+  if (b->spill_fd >= 0){
+    close(b->spill_fd);
+    b->spill_fd = -1;
+  }
+  b->full = 1;
+}
+
+/*
+ * spill - this function moves what b has collected to a file of the disk
+ * tier, where the rest of the response will go too. It returns 1 on
+ * success and 0 if the response can't be spilled.
+ */
+static int spill(cache_buf *b){
+  cache_chunk *chunk;
+  int fd;
+  if (b->disk == NULL || (fd = disk_spill_file(b->disk)) < 0){
+    return 0;
+  }
+  for (chunk = b->head; chunk != NULL; chunk = chunk->next){
+    if (rio_writen(fd, chunk->data, chunk->len) < 0){
+      close(fd);
+      return 0;
+    }
+  }
+  free_chunks(b->head);
+  b->head = b->tail = NULL;
+  b->spill_fd = fd;
+  return 1;
+}
+
+/*
+ * free_chunks - this function frees a list of chunks
+ */
+static void free_chunks(cache_chunk *chunk){
+  while (chunk != NULL){
+    cache_chunk *next = chunk->next;
+    Free(chunk);
+    chunk = next;
+  }
+}
+
+/*
+ * chunk_iov - this function fills iov with the bytes of the chunks from
+ * offset off on, at most CACHE_IOV_MAX chunks' worth, and returns how
+ * many entries it used
+ */
+static int chunk_iov(cache_chunk *chunk, size_t off, struct iovec *iov){
+  int n = 0;
+  while (chunk != NULL && off >= chunk->len){
+    off -= chunk->len;
+    chunk = chunk->next;
+  }
+  for (; chunk != NULL && n < CACHE_IOV_MAX; chunk = chunk->next){
+    iov[n].iov_base = chunk->data + off;
+    iov[n].iov_len = chunk->len - off;
+    off = 0;
+    n++;
+  }
+  return n;
+}
+
+/*
+ * new_node - this function makes the node for url with the response
+ * collected in b, in one slab block that holds the node, the url and,
+ * unless the response goes to a memfd, the data. b is left empty.
+ */
+static cache_node *new_node(char *url, cache_buf *b){
+  size_t url_len = strlen(url) + 1;
+  char *data = NULL;
+  int fd = store_memfd(b, &data);
+  size_t inline_size = (fd < 0) ? b->size : 0;
+  cache_node *p = slab_alloc(sizeof(cache_node) + url_len + inline_size);
+  memset(p, 0, sizeof(cache_node));
+  p->url = (char *)(p + 1);
+  memcpy(p->url, url, url_len);
+  p->data_size = b->size;
+  p->fd = fd;
+  p->data = data;
+  p->charge = node_charge(p);
+  if (fd < 0){
+    cache_chunk *chunk;
+    size_t off = 0;
+    p->data = p->url + url_len;
+    for (chunk = b->head; chunk != NULL; chunk = chunk->next){
+      memcpy(p->data + off, chunk->data, chunk->len);
+      off += chunk->len;
+    }
+  }
+  cache_buf_drop(b);
+  return p;
+}
+
+/*
+ * store_memfd - this function writes a big response collected in b to a
+ * sealed memfd, straight from the chunks, and maps it at *data. It
+ * returns the memfd, or -1 if the response is small or the memfd could
+ * not be made, in which case the data is kept in the node's block.
+ */
+static int store_memfd(cache_buf *b, char **data){
+  struct iovec iov[CACHE_IOV_MAX];
+  size_t size = b->size, off = 0;
+  ssize_t n;
+  int fd;
+  if (size < CACHE_MEMFD_MIN ||
+      (fd = memfd_create("cache_object", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0){
+    return -1;
+  }
+  while (off < size &&
+      (n = writev(fd, iov, chunk_iov(b->head, off, iov))) > 0){
+    off += n;
+  }
+  //sealed, the object can't change under the readers that share it
+  if (off == size &&
+      fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE |
+        F_SEAL_SEAL) == 0 &&
+      (*data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED){
+    return fd;
+  }
+  close(fd);
+  *data = NULL;
+  return -1;
+}
+
+/*
+ * node_charge - this function returns the bytes the node p takes up: its
+ * slab chunk, and the pages of its memfd if the data is in one
+ */
+static size_t node_charge(cache_node *p){
+  size_t charge = slab_size(p);
+  if (p->fd >= 0){
+    size_t page = getpagesize();
+    charge += (p->data_size + page - 1) / page * page;
+  }
+  return charge;
+}
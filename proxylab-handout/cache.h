@@ -0,0 +1,167 @@
+/*
+ * cache.h - interface to the web object cache used by the proxy
+ *
+ * The cache is split into shards. A url always maps to the same shard
+ * (chosen from the hash of the url), and each shard has its own lock,
+ * LRU list, hash table and share of the total byte budget, so threads
+ * working on different shards never wait on each other.
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "csapp.h"
+#include "tinylfu.h"
+#include "disk.h"
+
+/* Max cache and object sizes used unless the proxy is told otherwise */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+/* Objects this big or bigger are kept in a memfd and sent with sendfile */
+#define CACHE_MEMFD_MIN 16384
+
+/* Number of shards used unless the proxy is told otherwise */
+#define CACHE_DEFAULT_SHARDS 4
+#define CACHE_MAX_SHARDS 1024
+
+/* Eviction policies, picked when the cache is initialized */
+#define CACHE_LRU 0 //move to the front on every hit, evict from the end
+#define CACHE_CLOCK 1 //set a reference bit on a hit, second-chance eviction
+
+/* Admission policies, picked when the cache is initialized */
+#define CACHE_ADMIT_ALL 0 //every object that fits is cached
+#define CACHE_ADMIT_TINYLFU 1 //window LRU plus frequency-based admission
+
+/* Share of a shard's bytes given to the TinyLFU window, in percent. The
+   window has room for an object of the cache's max_object bytes, as long
+   as that is no more than half the shard */
+#define CACHE_WINDOW_PERCENT 1
+
+/* Threads that read the disk tier for event loops */
+#define CACHE_DISK_READERS 2
+
+/* Most bytes waiting for the disk writer thread. Demotions and spills
+   past this are dropped rather than queued */
+#define CACHE_WRITE_BACKLOG (64 * 1024 * 1024)
+
+/* Cache data structures */
+
+/* A piece of a response, as it was read from the server */
+struct cache_chunk{
+  struct cache_chunk *next;
+  size_t len; //bytes in data
+  size_t cap; //room in data
+  char data[];
+};
+
+typedef struct cache_chunk cache_chunk;
+
+/* A response being collected for the cache while it is relayed. Reads
+   are appended to chunks that are never moved, and the whole response is
+   copied once, into the cache's block or memfd, when it is cached. */
+struct cache_buf{
+  cache_chunk *head;
+  cache_chunk *tail;
+  size_t size; //bytes of the response seen so far, kept or not
+  size_t limit; //responses bigger than this are not kept
+  size_t mem_limit; //responses bigger than this are spilled to disk
+  int spill_fd; //file the response is spilled to, -1 while it is in chunks
+  disk_store *disk; //where the spill file comes from, NULL if none
+  int full; //the response is too big for the cache, nothing is kept
+};
+
+typedef struct cache_buf cache_buf;
+
+struct cache_node{
+  char *url; //stores the url, right after the node in its slab block
+  char *data; //the data, after the url or mapped from fd, NULL on disk
+  size_t data_size; //size of data
+  size_t charge; //bytes the node takes up, counted against the budget
+  int fd; //memfd or disk segment holding the data, -1 if in the block
+  off_t file_off; //where the data starts in fd
+  int on_disk; //the object is on disk too, or only there
+  size_t head_len; //bytes of the head data starts with, blank line included
+  time_t expires; //when the response stops being fresh, atomic
+  long lifetime; //how long it stays fresh, once stored or revalidated
+  unsigned int hash; //hash of url, used to index the hash table
+  int refcnt; //references held by the cache and by readers, atomic
+  int referenced; //CLOCK reference bit, set on a hit, atomic
+  int in_window; //node is in the TinyLFU window rather than the main list
+  struct cache_node *prev; // previous cache node
+  struct cache_node *next; // next cache node
+  struct cache_node *hnext; // next cache node in the same bucket
+};
+
+typedef struct cache_node cache_node;
+
+/* One shard of the cache, this is what the whole cache used to be */
+struct cache_shard{
+  pthread_rwlock_t lock; //protects everything in this shard
+  size_t cache_size; //bytes taken up by the nodes of the shard
+  size_t max_size; //this shard's share of the cache's budget
+  struct cache_node *start;
+  struct cache_node *end;
+  struct cache_node *hand; //CLOCK hand, next node to consider for eviction
+  struct cache_node *wstart; //start of the TinyLFU window list
+  struct cache_node *wend; //end of the TinyLFU window list
+  size_t wsize; //bytes in the window, included in cache_size
+  size_t wmax; //the window's share of max_size
+  freq_sketch sketch; //recent access counts, used for TinyLFU admission
+  struct cache_node **buckets; //hash table over all the nodes
+  unsigned int nbuckets; //always a power of 2
+  unsigned int nnodes; //number of nodes in the shard
+};
+
+typedef struct cache_shard cache_shard;
+
+/* A lookup of the disk tier handed to the reader threads, see
+   cache_load_start */
+typedef struct cache_load cache_load;
+
+/* Cache main structure */
+struct cache{
+  int policy; //CACHE_LRU or CACHE_CLOCK
+  int admission; //CACHE_ADMIT_ALL or CACHE_ADMIT_TINYLFU
+  unsigned int nshards;
+  size_t max_size; //bytes the nodes may take up, across all shards
+  size_t max_object; //biggest response that is kept in memory
+  disk_store *disk; //second tier, NULL if there is none
+  struct cache_shard *shards;
+  pthread_mutex_t disk_lock; //protects the queues of the disk threads
+  pthread_cond_t write_cond; //signalled when a write is queued
+  pthread_cond_t load_cond; //signalled when a lookup is queued
+  struct cache_write *writes; //what the writer thread has to write
+  struct cache_write *writes_tail;
+  size_t writes_bytes; //bytes of writes
+  struct cache_load *loads; //lookups for the reader threads
+  struct cache_load *loads_tail;
+};
+
+typedef struct cache cache;
+
+/* Cache functions */
+
+cache *initialize_cache(unsigned int nshards, int policy, int admission,
+	size_t max_size, size_t max_object, disk_store *disk);
+cache_node *check_for_hit(cache *c_cache, char *query);
+cache_node *cache_lookup(cache *c_cache, char *query);
+cache_load *cache_load_start(cache *c_cache, char *query, int notify_fd);
+int cache_load_done(cache *c_cache, cache_load *l, cache_node **p);
+void cache_load_cancel(cache *c_cache, cache_load *l);
+void add_to_cache(cache *c_cache, char *query, cache_buf *q_data,
+	size_t head_len, time_t expires, long lifetime);
+void release_cache_node(cache_node *p);
+int cache_node_fresh(cache_node *p);
+void cache_refresh(cache *c_cache, cache_node *p, time_t expires,
+	long lifetime);
+size_t cache_node_head(cache_node *p, char *buf, size_t len);
+ssize_t cache_node_send(int fd, cache_node *p, size_t off,
+	const char *framing, size_t len);
+size_t cache_used(cache *c_cache, size_t *nobjects);
+cache_node **cache_nodes(cache *c_cache, size_t *n);
+void cache_buf_init(cache_buf *b, cache *c_cache);
+void cache_buf_append(cache_buf *b, char *data, size_t len);
+void cache_buf_drop(cache_buf *b);
+void cache_buf_skip(cache_buf *b, size_t len);
+
+#endif /* __CACHE_H__ */
@@ -575,22 +575,16 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 /* $end rio_writen */
 
 
-/* 
- * rio_read - This is a wrapper for the Unix read() function that
- *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
- *    buffer, where n is the number of bytes requested by the user and
- *    rio_cnt is the number of unread bytes in the internal buffer. On
- *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+/*
+ * rio_refill - Refills the internal buffer via a call to read() if it
+ *    is empty. Returns 1 if there are unread bytes, 0 on EOF and -1 on
+ *    error.
  */
-/* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+/* $begin rio_refill */
+static int rio_refill(rio_t *rp)
 {
-    int cnt;
-
     while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
-	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-			   sizeof(rp->rio_buf));
+	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, rp->rio_size);
 	if (rp->rio_cnt < 0) {
 	    if (errno != EINTR) /* interrupted by sig handler return */
 		return -1;
@@ -600,6 +594,25 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 	else 
 	    rp->rio_bufptr = rp->rio_buf; /* reset buffer ptr */
     }
+    return 1;
+}
+/* $end rio_refill */
+
+/* 
+ * rio_read - This is a wrapper for the Unix read() function that
+ *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
+ *    buffer, where n is the number of bytes requested by the user and
+ *    rio_cnt is the number of unread bytes in the internal buffer. On
+ *    entry, rio_read() refills the internal buffer via a call to
+ *    read() if the internal buffer is empty.
+ */
+/* $begin rio_read */
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    int cnt, rc;
+
+    if ((rc = rio_refill(rp)) <= 0)
+	return rc;
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;          
@@ -617,12 +630,26 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
  */
 /* $begin rio_readinitb */
 void rio_readinitb(rio_t *rp, int fd) 
+{
+    rio_readinitbuf(rp, fd, rp->rio_inbuf, RIO_BUFSIZE);
+}
+/* $end rio_readinitb */
+
+/*
+ * rio_readinitbuf - Like rio_readinitb, but reads through the size bytes
+ *    at buf instead of the RIO_BUFSIZE bytes in rp, so that each
+ *    descriptor can have its own buffer size. buf belongs to the caller.
+ */
+/* $begin rio_readinitbuf */
+void rio_readinitbuf(rio_t *rp, int fd, char *buf, size_t size) 
 {
     rp->rio_fd = fd;  
     rp->rio_cnt = 0;  
+    rp->rio_buf = buf;
+    rp->rio_size = size;
     rp->rio_bufptr = rp->rio_buf;
 }
-/* $end rio_readinitb */
+/* $end rio_readinitbuf */
 
 /*
  * rio_readnb - Robustly read n bytes (buffered)
@@ -651,32 +678,99 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 /* $end rio_readnb */
 
 /* 
- * rio_readlineb - robustly read a text line (buffered)
+ * rio_readlineb - robustly read a text line (buffered). The newline is
+ *    looked for in the internal buffer with memchr, and the line is
+ *    copied out of it a buffer at a time rather than a byte at a time.
+ *    Returns the number of bytes read, at most maxlen - 1, and 0 on EOF.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-	if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n')
-		break;
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
+    size_t n = 0, cnt;
+    int rc;
+    char *bufp = usrbuf, *nl = NULL;
+
+    while (nl == NULL && n + 1 < maxlen) { 
+	if ((rc = rio_refill(rp)) < 0)
 	    return -1;	  /* error */
+	if (rc == 0)
+	    break;        /* EOF */
+	/* Copy up to the newline, or as much as fits */
+	cnt = maxlen - 1 - n;
+	if (rp->rio_cnt < cnt)
+	    cnt = rp->rio_cnt;
+	if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp + n, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	n += cnt;
     }
-    *bufp = 0;
+    bufp[n] = 0;
     return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_peekb - Points *bufp at the unread bytes in the internal buffer,
+ *    refilling it first if it is empty, so that they can be looked at
+ *    where they are. Returns how many there are, 0 on EOF and -1 on
+ *    error. They stay unread until rio_consumeb.
+ */
+/* $begin rio_peekb */
+ssize_t rio_peekb(rio_t *rp, char **bufp) 
+{
+    int rc;
+
+    if ((rc = rio_refill(rp)) <= 0)
+	return rc;
+    *bufp = rp->rio_bufptr;
+    return rp->rio_cnt;
+}
+/* $end rio_peekb */
+
+/*
+ * rio_fillb - Reads more bytes into the internal buffer behind the
+ *    unread ones, which are moved to the front of it first. Returns the
+ *    number of bytes read, 0 on EOF and -1 on error, with errno set to
+ *    ENOBUFS if the unread bytes already fill the buffer. Pointers from
+ *    rio_peekb are no longer valid afterwards.
+ */
+/* $begin rio_fillb */
+ssize_t rio_fillb(rio_t *rp) 
+{
+    ssize_t nread;
+
+    if (rp->rio_bufptr != rp->rio_buf) {
+	memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+	rp->rio_bufptr = rp->rio_buf;
+    }
+    if (rp->rio_cnt == rp->rio_size) {
+	errno = ENOBUFS;
+	return -1;
+    }
+    while ((nread = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+			 rp->rio_size - rp->rio_cnt)) < 0) {
+	if (errno != EINTR) /* interrupted by sig handler return */
+	    return -1;
+    }
+    rp->rio_cnt += nread;
+    return nread;
+}
+/* $end rio_fillb */
+
+/*
+ * rio_consumeb - Marks the next n unread bytes, which rio_peekb showed,
+ *    as read
+ */
+/* $begin rio_consumeb */
+void rio_consumeb(rio_t *rp, size_t n) 
+{
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+}
+/* $end rio_consumeb */
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -757,43 +851,227 @@ int open_clientfd(char *hostname, int port)
 /* $end open_clientfd */
 
 /*
- * open_clientfd_r - thread-safe version of open_clientfd
+ * open_clientfd_r - thread-safe version of open_clientfd. The IPv4 and
+ *   IPv6 addresses of the server are raced with race_connect, so a dead
+ *   address only delays the connection by RACE_ATTEMPT_DELAY.
  */
 int open_clientfd_r(char *hostname, int port) {
-    int clientfd;
-    struct addrinfo *addlist, *p;
+    struct addrinfo hints, *addlist, *p;
+    struct sockaddr_storage addrs[RACE_MAX_ADDRS];
+    socklen_t addrlens[RACE_MAX_ADDRS];
     char port_str[MAXLINE];
-    int rv;
-
-    /* Create the socket descriptor */
-    if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        return -1;
-    }
+    int naddrs = 0;
+    race_t r;
 
     /* Get a list of addrinfo structs */
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
     sprintf(port_str, "%d", port);
-    if ((rv = getaddrinfo(hostname, port_str, NULL, &addlist)) != 0) {
+    if (getaddrinfo(hostname, port_str, &hints, &addlist) != 0) {
         return -1;
     }
-  
-    /* Walk the list, using each addrinfo to try to connect */
-    for (p = addlist; p; p = p->ai_next) {
-        if ((p->ai_family == AF_INET)) {
-            if (connect(clientfd, p->ai_addr, p->ai_addrlen) == 0) {
-                break; /* success */
-            }
+    for (p = addlist; p && naddrs < RACE_MAX_ADDRS; p = p->ai_next) {
+        if (p->ai_family == AF_INET || p->ai_family == AF_INET6) {
+            memcpy(&addrs[naddrs], p->ai_addr, p->ai_addrlen);
+            addrlens[naddrs++] = p->ai_addrlen;
         }
-    } 
-
-    /* Clean up */
+    }
     freeaddrinfo(addlist);
-    if (!p) { /* all connects failed */
-        close(clientfd);
-        return -1;
+
+    race_init(&r, addrs, addrlens, naddrs);
+    return race_connect(&r);
+}
+
+/*
+ * race_now - milliseconds on a clock that only goes forward
+ */
+static long long race_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * race_init - get r ready to race connects to the naddrs addresses in
+ *     addrs, ports included. As RFC 8305 says, the addresses are tried
+ *     IPv6 first and then alternating between the two families, and
+ *     each family keeps its own order.
+ */
+void race_init(race_t *r, struct sockaddr_storage *addrs, socklen_t *addrlens,
+               int naddrs)
+{
+    int i, i4 = 0, i6 = 0, family = AF_INET6;
+
+    if (naddrs > RACE_MAX_ADDRS)
+	naddrs = RACE_MAX_ADDRS;
+    r->naddrs = 0;
+    while (r->naddrs < naddrs) {
+	int *ip = (family == AF_INET6) ? &i6 : &i4;
+	/* the next address of this family, if it has any left */
+	while (*ip < naddrs && addrs[*ip].ss_family != family)
+	    (*ip)++;
+	if (*ip < naddrs) {
+	    r->addrs[r->naddrs] = addrs[*ip];
+	    r->addrlens[r->naddrs++] = addrlens[*ip];
+	    (*ip)++;
+	}
+	else if ((family == AF_INET6 ? i4 : i6) >= naddrs) {
+	    break; /* neither family has any left (unknown families) */
+	}
+	family = (family == AF_INET6) ? AF_INET : AF_INET6;
+    }
+    for (i = 0; i < RACE_MAX_ADDRS; i++)
+	r->fds[i] = -1;
+    r->next = 0;
+    r->next_start = 0;
+}
+
+/*
+ * race_step - move the race along without blocking. Finished attempts
+ *     are looked at, attempts that took too long are given up, and the
+ *     next address is tried if it is time to. *started is set to the
+ *     socket of an attempt started by this call, or -1, so that callers
+ *     can wait for it. Returns the socket of the first attempt that
+ *     connected (the others are closed), RACE_PENDING if attempts are
+ *     still under way, or RACE_FAILED if every address has failed.
+ *     Sockets are non-blocking.
+ */
+int race_step(race_t *r, int *started)
+{
+    struct pollfd pfds[RACE_MAX_ADDRS];
+    int i, n = 0, err, winner = -1, running = 0;
+    socklen_t len;
+    long long now = race_now();
+
+    *started = -1;
+    for (i = 0; i < r->next; i++) {
+	if (r->fds[i] >= 0) {
+	    pfds[n].fd = r->fds[i];
+	    pfds[n].events = POLLOUT;
+	    pfds[n++].revents = 0;
+	}
+    }
+    if (n > 0 && poll(pfds, n, 0) < 0)
+	n = 0; /* nothing is known about the attempts this time */
+    for (i = 0, n = 0; i < r->next; i++) {
+	if (r->fds[i] < 0)
+	    continue;
+	if (pfds[n++].revents != 0) {
+	    /* the connect has finished, find out how it went */
+	    err = 0;
+	    len = sizeof(err);
+	    if (winner < 0 &&
+		getsockopt(r->fds[i], SOL_SOCKET, SO_ERROR, &err, &len) == 0 &&
+		err == 0) {
+		winner = r->fds[i];
+		r->fds[i] = -1;
+		continue;
+	    }
+	}
+	else if (now < r->deadlines[i]) {
+	    running++;
+	    continue;
+	}
+	close(r->fds[i]);
+	r->fds[i] = -1;
+    }
+    if (winner >= 0) {
+	race_cancel(r);
+	return winner;
+    }
+
+    /* start the next attempt if the last one has had its head start, or
+       has already failed. An address that fails at once is skipped. */
+    while (r->next < r->naddrs && (running == 0 || now >= r->next_start)) {
+	i = r->next++;
+	r->fds[i] = socket(r->addrs[i].ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (r->fds[i] < 0)
+	    continue;
+	if (connect(r->fds[i], (SA *)&r->addrs[i], r->addrlens[i]) == 0) {
+	    /* connected at once, which happens on the loopback */
+	    winner = r->fds[i];
+	    r->fds[i] = -1;
+	    *started = winner;
+	    race_cancel(r);
+	    return winner;
+	}
+	if (errno != EINPROGRESS) {
+	    close(r->fds[i]);
+	    r->fds[i] = -1;
+	    continue;
+	}
+	*started = r->fds[i];
+	r->deadlines[i] = now + RACE_ATTEMPT_TIMEOUT;
+	r->next_start = now + RACE_ATTEMPT_DELAY;
+	running++;
+	break;
+    }
+    return running > 0 ? RACE_PENDING : RACE_FAILED;
+}
+
+/*
+ * race_timeout - return in how many ms race_step has something to do
+ *     even if no attempt finishes, or -1 if it never will
+ */
+int race_timeout(race_t *r)
+{
+    int i;
+    long long when = -1, now = race_now();
+
+    if (r->next < r->naddrs)
+	when = r->next_start;
+    for (i = 0; i < r->next; i++) {
+	if (r->fds[i] >= 0 && (when < 0 || r->deadlines[i] < when))
+	    when = r->deadlines[i];
+    }
+    if (when < 0)
+	return -1;
+    return when > now ? (int)(when - now) : 0;
+}
+
+/*
+ * race_cancel - close every attempt of the race that is still under way
+ */
+void race_cancel(race_t *r)
+{
+    int i;
+
+    for (i = 0; i < r->next; i++) {
+	if (r->fds[i] >= 0) {
+	    close(r->fds[i]);
+	    r->fds[i] = -1;
+	}
     }
-    else { /* one of the connects succeeded */
-        return clientfd;
+    r->next = r->naddrs;
+}
+
+/*
+ * race_connect - run the race to the end, waiting for the attempts in
+ *     poll. Returns a blocking socket connected to the first address
+ *     that answered, or -1 if none did.
+ */
+int race_connect(race_t *r)
+{
+    struct pollfd pfds[RACE_MAX_ADDRS];
+    int i, n, fd, started;
+
+    while ((fd = race_step(r, &started)) == RACE_PENDING) {
+	for (i = 0, n = 0; i < r->next; i++) {
+	    if (r->fds[i] >= 0) {
+		pfds[n].fd = r->fds[i];
+		pfds[n++].events = POLLOUT;
+	    }
+	}
+	if (poll(pfds, n, race_timeout(r)) < 0 && errno != EINTR) {
+	    race_cancel(r);
+	    return -1;
+	}
     }
+    if (fd < 0)
+	return -1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+    return fd;
 }
 
 /*  
@@ -831,6 +1109,43 @@ int open_listenfd(int port)
 }
 /* $end open_listenfd */
 
+/*
+ * open_listenfd_reuseport - like open_listenfd, but the socket is also
+ *     bound with SO_REUSEPORT. Several such sockets can listen on the
+ *     same port, and the kernel spreads new connections across them.
+ *     Returns -1 and sets errno on Unix error.
+ */
+int open_listenfd_reuseport(int port)
+{
+    int listenfd, optval=1;
+    struct sockaddr_in serveraddr;
+
+    /* Create a socket descriptor */
+    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	return -1;
+
+    /* Eliminates "Address already in use" error from bind, and lets the
+       other listeners of this process bind the same port */
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
+		   (const void *)&optval , sizeof(int)) < 0 ||
+	setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+		   (const void *)&optval , sizeof(int)) < 0) {
+	close(listenfd);
+	return -1;
+    }
+
+    bzero((char *) &serveraddr, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serveraddr.sin_port = htons((unsigned short)port);
+    if (bind(listenfd, (SA *)&serveraddr, sizeof(serveraddr)) < 0 ||
+	listen(listenfd, LISTENQ) < 0) {
+	close(listenfd);
+	return -1;
+    }
+    return listenfd;
+}
+
 /******************************************
  * Wrappers for the client/server helper routines 
  ******************************************/
@@ -865,6 +1180,15 @@ int Open_listenfd(int port)
 	unix_error("Open_listenfd error");
     return rc;
 }
+
+int Open_listenfd_reuseport(int port)
+{
+    int rc;
+
+    if ((rc = open_listenfd_reuseport(port)) < 0)
+	unix_error("Open_listenfd_reuseport error");
+    return rc;
+}
 /* $end csapp.c */
 
 
@@ -23,6 +23,8 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <time.h>
 
 
 /* Default file permissions are DEF_MODE & ~DEF_UMASK */
@@ -43,10 +45,30 @@ typedef struct {
     int rio_fd;                /* descriptor for this internal buf */
     int rio_cnt;               /* unread bytes in internal buf */
     char *rio_bufptr;          /* next unread byte in internal buf */
-    char rio_buf[RIO_BUFSIZE]; /* internal buffer */
+    char *rio_buf;             /* internal buffer */
+    size_t rio_size;           /* size of internal buffer */
+    char rio_inbuf[RIO_BUFSIZE]; /* internal buffer unless one is given */
 } rio_t;
 /* $end rio_t */
 
+/* State of a Happy Eyeballs (RFC 8305) connection race: connects to
+   the addresses of a server are started one after the other, a little
+   apart, and the first one to finish wins */
+#define RACE_MAX_ADDRS 16
+#define RACE_ATTEMPT_DELAY 250    /* ms before the next address is tried */
+#define RACE_ATTEMPT_TIMEOUT 5000 /* ms one connect attempt may take */
+#define RACE_PENDING -1           /* returned by race_step */
+#define RACE_FAILED -2
+typedef struct {
+    int naddrs;
+    struct sockaddr_storage addrs[RACE_MAX_ADDRS]; /* in the order tried */
+    socklen_t addrlens[RACE_MAX_ADDRS];
+    int next;                  /* next address to try */
+    int fds[RACE_MAX_ADDRS];   /* attempt on each address, -1 if none */
+    long long deadlines[RACE_MAX_ADDRS]; /* when each attempt gives up */
+    long long next_start;      /* when the next address is tried */
+} race_t;
+
 /* External variables */
 extern int h_errno;    /* defined by BIND for DNS errors */ 
 extern char **environ; /* defined by libc */
@@ -146,8 +168,12 @@ void V(sem_t *sem);
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd); 
+void rio_readinitbuf(rio_t *rp, int fd, char *buf, size_t size);
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t	rio_peekb(rio_t *rp, char **bufp);
+ssize_t	rio_fillb(rio_t *rp);
+void rio_consumeb(rio_t *rp, size_t n);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
@@ -160,11 +186,19 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 int open_clientfd(char *hostname, int portno);
 int open_clientfd_r(char *hostname, int portno);
 int open_listenfd(int portno);
+int open_listenfd_reuseport(int portno);
+void race_init(race_t *r, struct sockaddr_storage *addrs, socklen_t *addrlens,
+               int naddrs);
+int race_step(race_t *r, int *started);
+int race_timeout(race_t *r);
+void race_cancel(race_t *r);
+int race_connect(race_t *r);
 
 /* Wrappers for client/server helper functions */
 int Open_clientfd(char *hostname, int port);
 int Open_clientfd_r(char *hostname, int port);
 int Open_listenfd(int port); 
+int Open_listenfd_reuseport(int port);
 
 #endif /* __CSAPP_H__ */
 /* $end csapp.h */
@@ -0,0 +1,522 @@
+/*
+ * disk.c - on-disk second tier of the cache
+ *
+ * Objects evicted from memory, and objects too big to be kept in memory
+ * at all, are written here instead of being thrown away, and the cache
+ * looks here when an object isn't in memory.
+ *
+ * The store is a log. Objects are only ever appended to it, each as a
+ * record (a header, the url, the data), so writes are sequential and a
+ * record never changes once it is written. The log is cut into
+ * DISK_SEGMENTS segment files of equal size. When the segment being
+ * written is full a new one is started, and once there are DISK_SEGMENTS
+ * of them the oldest segment is deleted, with whatever objects are still
+ * in it. Space is therefore reclaimed a whole file at a time, in the
+ * order it was written, and there is nothing to compact.
+ *
+ * The index is a hash table of DISK_WAYS-slot buckets in a file that is
+ * mapped with MAP_SHARED, so every change to it is in the page cache at
+ * once and is there for the next run of the proxy. A slot holds the
+ * 64-bit hash of a url and where its record is. A slot pointing into a
+ * deleted segment is dead and can be reused. If a bucket is full, the
+ * slot with the oldest record goes. The index only says where to look:
+ * a record's header and url are read and checked before it is served,
+ * so a hash collision, or a slot written just before a crash, is a miss.
+ * Since records never change, the freshness of an object is kept in its
+ * slot, where revalidating it can update it.
+ *
+ * Space for a record is reserved at the end of the log under the lock,
+ * the record is written with the lock released, and only then is the
+ * slot filled in, so a reader never finds a record that is still being
+ * written. Readers are given a duplicate of the segment's descriptor,
+ * which keeps the data readable even if the segment is deleted while
+ * they are sending it.
+ */
+
+#define _GNU_SOURCE
+#include "disk.h"
+#include <dirent.h>
+
+/* Header of the index file, followed by the slots */
+struct disk_header{
+  uint32_t magic; //DISK_INDEX_MAGIC once the index is set up
+  uint32_t nbuckets; //always a power of 2
+  uint64_t segment_size;
+  uint64_t first_seg; //oldest segment that still exists
+  uint64_t cur_seg; //segment being appended to
+  uint64_t cur_off; //where the next record goes in cur_seg
+};
+
+/* A slot of the index */
+struct disk_slot{
+  uint64_t hash; //hash of the url, 0 if the slot was never used
+  uint64_t seg; //segment of the record
+  uint64_t off; //where the record starts in the segment
+  uint64_t len; //bytes of data in the record
+  int64_t expires; //when the object stops being fresh
+  int64_t lifetime; //how long it stays fresh once revalidated
+};
+
+/* Header of a record of the log, followed by the url and the data */
+struct disk_record{
+  uint32_t magic; //DISK_RECORD_MAGIC
+  uint32_t url_len;
+  uint64_t hash;
+  uint64_t len;
+  uint32_t head_len;
+  uint32_t pad;
+};
+
+struct disk_store{
+  char *dir;
+  pthread_mutex_t lock; //protects the index and the segments
+  struct disk_header *header; //the mapped index file
+  struct disk_slot *slots; //nbuckets * DISK_WAYS of them
+  size_t map_size;
+  int segfds[DISK_SEGMENTS]; //open segments, by number mod DISK_SEGMENTS
+};
+
+static uint64_t hash_key(char *url);
+static void segment_path(disk_store *d, uint64_t seg, char *path);
+static int open_index(disk_store *d, size_t segment_size, uint32_t nbuckets);
+static void remove_segments(disk_store *d);
+static int reserve(disk_store *d, size_t len, uint64_t *seg, uint64_t *off);
+static void new_segment(disk_store *d);
+static struct disk_slot *find_slot(disk_store *d, uint64_t h);
+static struct disk_slot *free_slot(disk_store *d, uint64_t h);
+static int live(disk_store *d, uint64_t seg);
+static int write_all(int fd, char *buf, size_t len, off_t off);
+static int copy_all(int from, int to, size_t len, off_t off);
+
+/*
+ * disk_open - this function opens the store in the directory dir, made
+ * if it doesn't exist, and lets it use about size bytes. Objects stored
+ * by an earlier run of the proxy with the same size are kept, otherwise
+ * the store starts empty.
+ */
+disk_store *disk_open(char *dir, size_t size)
+{
+  char path[MAXLINE];
+  uint32_t nbuckets = 64;
+  size_t segment_size = size / DISK_SEGMENTS;
+  uint64_t seg;
+  struct stat st;
+  if (segment_size < DISK_MIN_SEGMENT_SIZE) {
+    segment_size = DISK_MIN_SEGMENT_SIZE;
+  }
+  while ((size_t)nbuckets * DISK_BUCKET_BYTES < size) {
+    nbuckets *= 2;
+  }
+  if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+    unix_error("disk_open: mkdir error");
+  }
+  disk_store *d = Calloc(1, sizeof(disk_store));
+  d->dir = Malloc(strlen(dir) + 1);
+  strcpy(d->dir, dir);
+  pthread_mutex_init(&d->lock, NULL);
+  if (!open_index(d, segment_size, nbuckets)) {
+    //a new store, or one made with other settings
+    remove_segments(d);
+  }
+  for (seg = 0; seg < DISK_SEGMENTS; seg++) {
+    d->segfds[seg] = -1;
+  }
+  for (seg = d->header->first_seg; seg <= d->header->cur_seg; seg++) {
+    segment_path(d, seg, path);
+    d->segfds[seg % DISK_SEGMENTS] = open(path, O_RDWR | O_CREAT | O_CLOEXEC,
+      0600);
+  }
+  //records may have been written past the offset last saved, the next
+  //one goes after them
+  if (fstat(d->segfds[d->header->cur_seg % DISK_SEGMENTS], &st) == 0 &&
+      (uint64_t)st.st_size > d->header->cur_off) {
+    d->header->cur_off = st.st_size;
+  }
+  return d;
+}
+
+/*
+ * disk_max_object - this function returns the size of the biggest
+ * response the store takes
+ */
+size_t disk_max_object(disk_store *d)
+{
+  return d->header->segment_size - sizeof(struct disk_record) - MAXLINE;
+}
+
+/*
+ * disk_spill_file - this function returns a new anonymous file in the
+ * store's directory, for a response that is too big to be collected in
+ * memory, or -1 if there is none. Being on the same file system as the
+ * log, it can be copied into it without going through user space.
+ */
+int disk_spill_file(disk_store *d)
+{
+  char path[MAXLINE];
+  int fd = open(d->dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    //the file system can't make unnamed files
+    snprintf(path, sizeof(path), "%s/spill.XXXXXX", d->dir);
+    if ((fd = mkostemp(path, O_CLOEXEC)) >= 0) {
+      unlink(path);
+    }
+  }
+  return fd;
+}
+
+/*
+ * disk_put - this function stores len bytes of data for url, which come
+ * from data, or from the start of the file fd if data is NULL. head_len
+ * is the length of the head the response starts with, expires when
+ * it stops being fresh and lifetime how long it stays fresh once
+ * revalidated. Objects that can't be written are simply not stored.
+ */
+void disk_put(disk_store *d, char *url, char *data, int fd, size_t len,
+    size_t head_len, time_t expires, long lifetime)
+{
+  struct disk_record *rec;
+  struct disk_slot *slot;
+  uint64_t seg, off;
+  size_t url_len = strlen(url);
+  size_t head = sizeof(struct disk_record) + url_len;
+  int ok, wfd;
+  if (len > disk_max_object(d) || url_len >= MAXLINE) {
+    return;
+  }
+  pthread_mutex_lock(&d->lock);
+  wfd = reserve(d, head + len, &seg, &off);
+  pthread_mutex_unlock(&d->lock);
+  if (wfd < 0) {
+    return;
+  }
+  rec = Calloc(1, head);
+  rec->magic = DISK_RECORD_MAGIC;
+  rec->url_len = url_len;
+  rec->hash = hash_key(url);
+  rec->len = len;
+  rec->head_len = head_len;
+  memcpy(rec + 1, url, url_len);
+  ok = write_all(wfd, (char *)rec, head, off) &&
+    (data != NULL ? write_all(wfd, data, len, off + head) :
+      copy_all(fd, wfd, len, off + head));
+  close(wfd);
+  if (ok) {
+    pthread_mutex_lock(&d->lock);
+    //the segment may have been deleted while the record was written
+    if (live(d, seg)) {
+      slot = free_slot(d, rec->hash);
+      slot->hash = rec->hash;
+      slot->seg = seg;
+      slot->off = off;
+      slot->len = len;
+      slot->expires = expires;
+      slot->lifetime = lifetime;
+    }
+    pthread_mutex_unlock(&d->lock);
+  }
+  Free(rec);
+}
+
+/*
+ * disk_get - this function looks url up. If it is stored, it fills in o
+ * and returns 0, and the caller must close o->fd. Otherwise it returns
+ * -1.
+ */
+int disk_get(disk_store *d, char *url, disk_object *o)
+{
+  struct disk_record rec;
+  struct disk_slot slot;
+  uint64_t h = hash_key(url);
+  size_t url_len = strlen(url);
+  char *stored;
+  int fd = -1, same;
+  pthread_mutex_lock(&d->lock);
+  struct disk_slot *p = find_slot(d, h);
+  if (p != NULL) {
+    slot = *p;
+    fd = dup(d->segfds[slot.seg % DISK_SEGMENTS]);
+  }
+  pthread_mutex_unlock(&d->lock);
+  if (fd < 0) {
+    return -1;
+  }
+  //the hash only says where to look, the record says what is there
+  if (pread(fd, &rec, sizeof(rec), slot.off) != sizeof(rec) ||
+      rec.magic != DISK_RECORD_MAGIC || rec.hash != h ||
+      rec.url_len != url_len || rec.len != slot.len) {
+    close(fd);
+    return -1;
+  }
+  stored = Malloc(url_len);
+  same = pread(fd, stored, url_len, slot.off + sizeof(rec)) ==
+    (ssize_t)url_len && memcmp(stored, url, url_len) == 0;
+  Free(stored);
+  if (!same) {
+    close(fd);
+    return -1;
+  }
+  o->fd = fd;
+  o->off = slot.off + sizeof(rec) + url_len;
+  o->len = rec.len;
+  o->head_len = rec.head_len;
+  o->expires = slot.expires;
+  o->lifetime = slot.lifetime;
+  return 0;
+}
+
+/*
+ * disk_refresh - this function sets when the object stored for url stops
+ * being fresh, and how long it stays fresh, if it is stored
+ */
+void disk_refresh(disk_store *d, char *url, time_t expires, long lifetime)
+{
+  pthread_mutex_lock(&d->lock);
+  struct disk_slot *p = find_slot(d, hash_key(url));
+  if (p != NULL) {
+    //a collision only makes the other object go stale early or late
+    p->expires = expires;
+    p->lifetime = lifetime;
+  }
+  pthread_mutex_unlock(&d->lock);
+}
+
+/*
+ * hash_key - this function computes the 64-bit FNV-1a hash of a url,
+ * which is never 0 since 0 marks unused slots
+ */
+static uint64_t hash_key(char *url)
+{
+  uint64_t h = 14695981039346656037ull;
+  unsigned char *c;
+  for (c = (unsigned char *)url; *c != '\0'; c++) {
+    h ^= *c;
+    h *= 1099511628211ull;
+  }
+  return (h != 0) ? h : 1;
+}
+
+/*
+ * segment_path - this function writes the name of the file of segment
+ * seg to path
+ */
+static void segment_path(disk_store *d, uint64_t seg, char *path)
+{
+  snprintf(path, MAXLINE, "%s/segment.%010llu", d->dir,
+    (unsigned long long)seg);
+}
+
+/*
+ * open_index - this function maps the index file of the store, made with
+ * the given settings if need be. It returns 1 if the index was already
+ * there with the same settings, and 0 if it was set up empty.
+ */
+static int open_index(disk_store *d, size_t segment_size, uint32_t nbuckets)
+{
+  char path[MAXLINE];
+  struct stat st;
+  struct disk_header *h;
+  int fd;
+  d->map_size = sizeof(struct disk_header) +
+    (size_t)nbuckets * DISK_WAYS * sizeof(struct disk_slot);
+  snprintf(path, sizeof(path), "%s/index", d->dir);
+  if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0 ||
+      fstat(fd, &st) < 0) {
+    unix_error("disk_open: index error");
+  }
+  if ((size_t)st.st_size == d->map_size) {
+    h = Mmap(NULL, d->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (h->magic == DISK_INDEX_MAGIC && h->nbuckets == nbuckets &&
+        h->segment_size == segment_size &&
+        h->cur_seg - h->first_seg < DISK_SEGMENTS) {
+      close(fd);
+      d->header = h;
+      d->slots = (struct disk_slot *)(h + 1);
+      return 1;
+    }
+    Munmap(h, d->map_size);
+  }
+  //emptied and grown back, which zeroes every slot
+  if (ftruncate(fd, 0) < 0 || ftruncate(fd, d->map_size) < 0) {
+    unix_error("disk_open: index error");
+  }
+  h = Mmap(NULL, d->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  h->nbuckets = nbuckets;
+  h->segment_size = segment_size;
+  h->first_seg = h->cur_seg = 1;
+  h->cur_off = 0;
+  h->magic = DISK_INDEX_MAGIC;
+  d->header = h;
+  d->slots = (struct disk_slot *)(h + 1);
+  return 0;
+}
+
+/*
+ * remove_segments - this function deletes every segment file in the
+ * store's directory, when the index that described them is gone
+ */
+static void remove_segments(disk_store *d)
+{
+  char path[MAXLINE];
+  struct dirent *e;
+  DIR *dir = opendir(d->dir);
+  if (dir == NULL) {
+    return;
+  }
+  while ((e = readdir(dir)) != NULL) {
+    if (strncmp(e->d_name, "segment.", 8) == 0) {
+      snprintf(path, sizeof(path), "%s/%s", d->dir, e->d_name);
+      unlink(path);
+    }
+  }
+  closedir(dir);
+}
+
+/*
+ * reserve - this function makes room for a record of len bytes at the
+ * end of the log, starting a new segment if the current one is full. It
+ * stores where the record goes at *seg and *off and returns a descriptor
+ * of the segment for the caller to write it with and close, or -1. The
+ * caller must hold the lock.
+ */
+static int reserve(disk_store *d, size_t len, uint64_t *seg, uint64_t *off)
+{
+  struct disk_header *h = d->header;
+  if (h->cur_off + len > h->segment_size && h->cur_off > 0) {
+    new_segment(d);
+  }
+  *seg = h->cur_seg;
+  *off = h->cur_off;
+  h->cur_off += len;
+  return dup(d->segfds[h->cur_seg % DISK_SEGMENTS]);
+}
+
+/*
+ * new_segment - this function starts a new segment, deleting the oldest
+ * one if there are already DISK_SEGMENTS of them. The caller must hold
+ * the lock.
+ */
+static void new_segment(disk_store *d)
+{
+  char path[MAXLINE];
+  struct disk_header *h = d->header;
+  if (h->cur_seg + 1 - h->first_seg >= DISK_SEGMENTS) {
+    //its slots are dead from now on, readers that have it open can
+    //still finish
+    segment_path(d, h->first_seg, path);
+    unlink(path);
+    close(d->segfds[h->first_seg % DISK_SEGMENTS]);
+    d->segfds[h->first_seg % DISK_SEGMENTS] = -1;
+    h->first_seg += 1;
+  }
+  h->cur_seg += 1;
+  h->cur_off = 0;
+  segment_path(d, h->cur_seg, path);
+  d->segfds[h->cur_seg % DISK_SEGMENTS] = open(path,
+    O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+}
+
+/*
+ * find_slot - this function returns the live slot for hash h, or NULL.
+ * The caller must hold the lock.
+ */
+static struct disk_slot *find_slot(disk_store *d, uint64_t h)
+{
+  struct disk_slot *s = &d->slots[(h & (d->header->nbuckets - 1)) *
+    DISK_WAYS];
+  int i;
+  for (i = 0; i < DISK_WAYS; i++) {
+    if (s[i].hash == h && live(d, s[i].seg)) {
+      return &s[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * free_slot - this function returns the slot a new record for hash h
+ * goes in: the one of an older record for h, else a dead one, else the
+ * one with the oldest record of the bucket. The caller must hold the
+ * lock.
+ */
+static struct disk_slot *free_slot(disk_store *d, uint64_t h)
+{
+  struct disk_slot *s = &d->slots[(h & (d->header->nbuckets - 1)) *
+    DISK_WAYS];
+  struct disk_slot *oldest = &s[0];
+  int i;
+  for (i = 0; i < DISK_WAYS; i++) {
+    if (s[i].hash == h || !live(d, s[i].seg)) {
+      return &s[i];
+    }
+    if (s[i].seg < oldest->seg ||
+        (s[i].seg == oldest->seg && s[i].off < oldest->off)) {
+      oldest = &s[i];
+    }
+  }
+  return oldest;
+}
+
+/*
+ * live - this function returns whether segment seg still exists. The
+ * caller must hold the lock.
+ */
+static int live(disk_store *d, uint64_t seg)
+{
+  return seg >= d->header->first_seg && seg <= d->header->cur_seg &&
+    d->segfds[seg % DISK_SEGMENTS] >= 0;
+}
+
+/*
+ * write_all - this function writes len bytes of buf to fd at offset off.
+ * It returns 1 on success and 0 on failure.
+ */
+static int write_all(int fd, char *buf, size_t len, off_t off)
+{
+  ssize_t n;
+  while (len > 0) {
+    if ((n = pwrite(fd, buf, len, off)) <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      return 0;
+    }
+    buf += n;
+    off += n;
+    len -= n;
+  }
+  return 1;
+}
+
+/*
+ * copy_all - this function copies the first len bytes of the file from
+ * to the file to at offset off, in the kernel when it can. It returns 1
+ * on success and 0 on failure.
+ */
+static int copy_all(int from, int to, size_t len, off_t off)
+{
+  char buf[MAXBUF];
+  off_t in = 0;
+  ssize_t n;
+  while (len > 0) {
+    if ((n = copy_file_range(from, &in, to, &off, len, 0)) > 0) {
+      len -= n;
+      continue;
+    }
+    if (n == 0) {
+      return 0;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    //not supported between these files, copy through a buffer
+    if ((n = pread(from, buf, (len < MAXBUF) ? len : MAXBUF, in)) <= 0 ||
+        !write_all(to, buf, n, off)) {
+      return 0;
+    }
+    in += n;
+    off += n;
+    len -= n;
+  }
+  return 1;
+}
@@ -0,0 +1,53 @@
+/*
+ * disk.h - on-disk second tier of the cache
+ *
+ * Objects are appended to a log of segment files in one directory, and
+ * a hash index mapped from a file of the same directory says where each
+ * object is. Both survive restarts.
+ */
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include "csapp.h"
+#include <stdint.h>
+
+/* Space used on disk unless the proxy is told otherwise */
+#define DISK_DEFAULT_SIZE (1024L * 1024 * 1024)
+
+/* The log is split into this many segments. When the last one is full,
+   the oldest is deleted with every object in it. Objects may be as big
+   as a segment. */
+#define DISK_SEGMENTS 16
+#define DISK_MIN_SEGMENT_SIZE (1024 * 1024)
+
+/* Each bucket of the index has this many slots, and the index has a
+   bucket for every DISK_BUCKET_BYTES of space */
+#define DISK_WAYS 8
+#define DISK_BUCKET_BYTES (DISK_WAYS * 4096)
+
+/* Marks records of the log and the header of the index */
+#define DISK_RECORD_MAGIC 0x4f424a32u //"OBJ2"
+#define DISK_INDEX_MAGIC 0x49445832u //"IDX2"
+
+/* Where an object was found */
+struct disk_object{
+  int fd; //the segment holding it, the caller must close it
+  off_t off; //where the data starts in fd
+  size_t len; //bytes of data
+  size_t head_len; //bytes of the head the data starts with
+  time_t expires; //when it stops being fresh
+  long lifetime; //how long it stays fresh once revalidated
+};
+
+typedef struct disk_object disk_object;
+typedef struct disk_store disk_store;
+
+disk_store *disk_open(char *dir, size_t size);
+size_t disk_max_object(disk_store *d);
+int disk_spill_file(disk_store *d);
+void disk_put(disk_store *d, char *url, char *data, int fd, size_t len,
+	size_t head_len, time_t expires, long lifetime);
+int disk_get(disk_store *d, char *url, disk_object *o);
+void disk_refresh(disk_store *d, char *url, time_t expires, long lifetime);
+
+#endif /* __DISK_H__ */
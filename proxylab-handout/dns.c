@@ -0,0 +1,586 @@
+/*
+ * dns.c - caching resolver for the names of the servers the proxy
+ * talks to
+ *
+ * Without it every miss called getaddrinfo, which waits for a round trip
+ * to the nameserver each time. Here the answer for each name is kept in
+ * a hash table for as long as its TTL says. getaddrinfo doesn't report
+ * TTLs, so the A and AAAA records of names are looked up with res_nsearch
+ * and the answers are parsed with the ns_ functions of libresolv, which
+ * keep the TTL of each record. The TTL is clamped to [DNS_MIN_TTL,
+ * DNS_MAX_TTL], and names that don't resolve are remembered for
+ * DNS_NEGATIVE_TTL seconds.
+ *
+ * The hosts file is read once, at startup, and its names never expire.
+ * In DNS_HOSTS mode nothing else is looked at, which makes the proxy
+ * testable without a network. In DNS_SERVER mode queries go to one given
+ * nameserver (a local stub server, say) instead of those in resolv.conf.
+ *
+ * Each name has one entry, whatever the number of threads that want it.
+ * The first thread to miss marks the entry DNS_RESOLVING and looks the
+ * name up, and threads that ask in the meantime wait for its answer on
+ * dns_cond instead of sending queries of their own. Event loops can't
+ * wait, so dns_resolve_nb hands the lookup to the background resolver
+ * threads and returns. The caller's eventfd is written once the answer
+ * is in, and the caller then asks again.
+ *
+ * An answer that is used when less than DNS_REFRESH_PERCENT of its TTL
+ * is left is refreshed by the resolver threads while it is still served,
+ * so names in steady use are never looked up in the request path again.
+ */
+
+#include "dns.h"
+#include <resolv.h>
+#include <arpa/nameser.h>
+
+/* States of an entry */
+#define DNS_RESOLVING 0 //the first lookup of the name is under way
+#define DNS_VALID 1 //the entry holds an answer, maybe an expired one
+
+struct dns_entry{
+  char *name;
+  int state; //DNS_RESOLVING or DNS_VALID
+  int refreshing; //a new answer is being looked up
+  int queued; //the entry is waiting for a resolver thread
+  int permanent; //the name comes from the hosts file
+  unsigned int ttl; //of the current answer
+  time_t expires; //when the current answer runs out
+  dns_result result;
+  int *waiters; //eventfds to write once the lookup is over
+  int nwaiters;
+  struct dns_entry *next; //next entry in the same bucket
+  struct dns_entry *qnext; //next entry waiting for a resolver thread
+};
+
+typedef struct dns_entry dns_entry;
+
+static int dns_mode = DNS_SYSTEM;
+static struct sockaddr_in dns_server; //nameserver used in DNS_SERVER mode
+static dns_entry *entries[DNS_BUCKETS];
+static unsigned int nentries;
+static dns_entry *queue_head, *queue_tail; //lookups for the resolvers
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_cond = PTHREAD_COND_INITIALIZER; //answer is in
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER; //job queued
+
+/* resolver state of the calling thread, for res_nsearch */
+static __thread struct __res_state resolver;
+static __thread int resolver_ready;
+
+static void *dns_thread(void *vargp);
+static int numeric_host(char *host, dns_result *res);
+static void read_hosts(void);
+static void add_address(dns_result *res, int family, void *addr);
+static dns_entry **find_entry(char *name);
+static dns_entry *new_entry(char *name);
+static void sweep_entries(time_t now);
+static int fresh(dns_entry *e, time_t now);
+static void maybe_refresh(dns_entry *e, time_t now);
+static void enqueue(dns_entry *e);
+static void store_answer(dns_entry *e, dns_result *res, unsigned int ttl);
+static unsigned int dns_query(char *name, dns_result *res);
+static int query_type(char *name, int type, dns_result *res,
+  unsigned int *ttl);
+static unsigned int system_query(char *name, dns_result *res);
+static int copy_answer(dns_entry *e, dns_result *res);
+
+/*
+ * dns_init - this function sets where names are looked up, reads the
+ * hosts file and starts the resolver threads. In DNS_SERVER mode, server
+ * is the nameserver's address, as ip or ip:port.
+ */
+void dns_init(int mode, char *server)
+{
+  pthread_t tid;
+  int i;
+  char addr[INET_ADDRSTRLEN + 1];
+  dns_mode = mode;
+  if (mode == DNS_SERVER) {
+    char *colon = strchr(server, ':');
+    size_t len = colon != NULL ? (size_t)(colon - server) : strlen(server);
+    memset(&dns_server, 0, sizeof(dns_server));
+    dns_server.sin_family = AF_INET;
+    dns_server.sin_port = htons(colon != NULL ? atoi(colon + 1) : NS_DEFAULTPORT);
+    if (len > INET_ADDRSTRLEN) {
+      len = INET_ADDRSTRLEN;
+    }
+    memcpy(addr, server, len);
+    addr[len] = '\0';
+    if (inet_pton(AF_INET, addr, &dns_server.sin_addr) != 1) {
+      app_error("dns_init: bad nameserver address");
+    }
+  }
+  read_hosts();
+  for (i = 0; i < DNS_THREADS; i++) {
+    Pthread_create(&tid, NULL, dns_thread, NULL);
+  }
+}
+
+/*
+ * dns_resolve - this function fills res with the addresses of host,
+ * waiting for them if they aren't known yet. It returns 0 on success
+ * and -1 if host doesn't resolve.
+ */
+int dns_resolve(char *host, dns_result *res)
+{
+  dns_entry *e;
+  time_t now = time(NULL);
+  if (numeric_host(host, res)) {
+    return 0;
+  }
+  pthread_mutex_lock(&dns_lock);
+  while (1) {
+    e = *find_entry(host);
+    if (e != NULL && fresh(e, now)) {
+      int rc = copy_answer(e, res);
+      maybe_refresh(e, now);
+      pthread_mutex_unlock(&dns_lock);
+      return rc;
+    }
+    if (e == NULL || (e->state == DNS_VALID && !e->refreshing)) {
+      break;
+    }
+    //somebody is already looking the name up, wait for their answer
+    pthread_cond_wait(&dns_cond, &dns_lock);
+    now = time(NULL);
+  }
+  if (e == NULL) {
+    e = new_entry(host);
+  }
+  else {
+    //the answer has expired, look it up again
+    e->refreshing = 1;
+  }
+  pthread_mutex_unlock(&dns_lock);
+
+  dns_result answer;
+  unsigned int ttl = dns_query(host, &answer);
+
+  pthread_mutex_lock(&dns_lock);
+  store_answer(e, &answer, ttl);
+  int rc = copy_answer(e, res);
+  pthread_mutex_unlock(&dns_lock);
+  return rc;
+}
+
+/*
+ * dns_resolve_nb - this function is dns_resolve for callers that must
+ * not wait. If the addresses of host are known it fills res and returns
+ * 1, or -1 if host doesn't resolve. Otherwise the lookup goes to the
+ * resolver threads, notify_fd (an eventfd) is written once it is over,
+ * and 0 is returned.
+ */
+int dns_resolve_nb(char *host, dns_result *res, int notify_fd)
+{
+  dns_entry *e;
+  int i;
+  time_t now = time(NULL);
+  if (numeric_host(host, res)) {
+    return 1;
+  }
+  pthread_mutex_lock(&dns_lock);
+  e = *find_entry(host);
+  if (e != NULL && fresh(e, now)) {
+    int rc = copy_answer(e, res);
+    maybe_refresh(e, now);
+    pthread_mutex_unlock(&dns_lock);
+    return rc == 0 ? 1 : -1;
+  }
+  if (e == NULL) {
+    e = new_entry(host);
+    enqueue(e);
+  }
+  else if (e->state == DNS_VALID && !e->refreshing) {
+    e->refreshing = 1;
+    enqueue(e);
+  }
+  //several connections of one loop may wait for the same name
+  for (i = 0; i < e->nwaiters && e->waiters[i] != notify_fd; i++)
+    ;
+  if (i == e->nwaiters) {
+    e->waiters = Realloc(e->waiters, (e->nwaiters + 1) * sizeof(int));
+    e->waiters[e->nwaiters++] = notify_fd;
+  }
+  pthread_mutex_unlock(&dns_lock);
+  return 0;
+}
+
+/*
+ * dns_thread - this is the body of one resolver thread. It looks up the
+ * names queued by dns_resolve_nb and by background refreshes.
+ */
+static void *dns_thread(void *vargp)
+{
+  dns_entry *e;
+  dns_result answer;
+  unsigned int ttl;
+  Pthread_detach(pthread_self());
+  while (1) {
+    pthread_mutex_lock(&dns_lock);
+    while (queue_head == NULL) {
+      pthread_cond_wait(&queue_cond, &dns_lock);
+    }
+    e = queue_head;
+    queue_head = e->qnext;
+    if (queue_head == NULL) {
+      queue_tail = NULL;
+    }
+    e->queued = 0;
+    pthread_mutex_unlock(&dns_lock);
+
+    //the entry can't be thrown away while a lookup is under way, so
+    //its name stays valid without the lock
+    ttl = dns_query(e->name, &answer);
+
+    pthread_mutex_lock(&dns_lock);
+    store_answer(e, &answer, ttl);
+    pthread_mutex_unlock(&dns_lock);
+  }
+  return NULL;
+}
+
+/*
+ * numeric_host - this function fills res and returns 1 if host is an
+ * address rather than a name, there is nothing to look up then
+ */
+static int numeric_host(char *host, dns_result *res)
+{
+  struct in_addr a4;
+  struct in6_addr a6;
+  res->naddrs = 0;
+  if (inet_pton(AF_INET, host, &a4) == 1) {
+    add_address(res, AF_INET, &a4);
+    return 1;
+  }
+  if (inet_pton(AF_INET6, host, &a6) == 1) {
+    add_address(res, AF_INET6, &a6);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * read_hosts - this function puts the names of the hosts file in the
+ * table, as entries that never expire
+ */
+static void read_hosts(void)
+{
+  char line[MAXLINE], *tok, *save;
+  struct in_addr a4;
+  struct in6_addr a6;
+  FILE *fp = fopen("/etc/hosts", "r");
+  if (fp == NULL) {
+    return;
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    int family;
+    void *addr;
+    line[strcspn(line, "#\n")] = '\0';
+    if ((tok = strtok_r(line, " \t", &save)) == NULL) {
+      continue;
+    }
+    if (inet_pton(AF_INET, tok, &a4) == 1) {
+      family = AF_INET;
+      addr = &a4;
+    }
+    else if (inet_pton(AF_INET6, tok, &a6) == 1) {
+      family = AF_INET6;
+      addr = &a6;
+    }
+    else {
+      continue;
+    }
+    //the canonical name and all the aliases get the address
+    while ((tok = strtok_r(NULL, " \t", &save)) != NULL) {
+      dns_entry *e = *find_entry(tok);
+      if (e == NULL) {
+        e = new_entry(tok);
+        e->state = DNS_VALID;
+        e->permanent = 1;
+      }
+      add_address(&e->result, family, addr);
+    }
+  }
+  fclose(fp);
+}
+
+/*
+ * add_address - this function appends an address of the given family to
+ * res, if there is room for it
+ */
+static void add_address(dns_result *res, int family, void *addr)
+{
+  if (res->naddrs == DNS_MAX_ADDRS) {
+    return;
+  }
+  struct sockaddr_storage *ss = &res->addrs[res->naddrs];
+  memset(ss, 0, sizeof(*ss));
+  if (family == AF_INET) {
+    struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+    sin->sin_family = AF_INET;
+    memcpy(&sin->sin_addr, addr, sizeof(struct in_addr));
+    res->addrlens[res->naddrs] = sizeof(struct sockaddr_in);
+  }
+  else {
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+    sin6->sin6_family = AF_INET6;
+    memcpy(&sin6->sin6_addr, addr, sizeof(struct in6_addr));
+    res->addrlens[res->naddrs] = sizeof(struct sockaddr_in6);
+  }
+  res->naddrs += 1;
+}
+
+/*
+ * find_entry - this function returns the link that points to the entry
+ * of name, which is NULL if there is no such entry. Names are compared
+ * without regard to case. The caller must hold dns_lock.
+ */
+static dns_entry **find_entry(char *name)
+{
+  unsigned int h = 2166136261u; //FNV-1a, as for urls in the cache
+  unsigned char *c;
+  for (c = (unsigned char *)name; *c != '\0'; c++) {
+    h ^= tolower(*c);
+    h *= 16777619u;
+  }
+  dns_entry **ep = &entries[h % DNS_BUCKETS];
+  while (*ep != NULL && strcasecmp((*ep)->name, name) != 0) {
+    ep = &(*ep)->next;
+  }
+  return ep;
+}
+
+/*
+ * new_entry - this function adds an entry for name to the table, in the
+ * DNS_RESOLVING state. The caller must hold dns_lock.
+ */
+static dns_entry *new_entry(char *name)
+{
+  if (nentries >= DNS_MAX_ENTRIES) {
+    sweep_entries(time(NULL));
+  }
+  dns_entry *e = Calloc(1, sizeof(dns_entry));
+  e->name = Malloc(strlen(name) + 1);
+  strcpy(e->name, name);
+  e->state = DNS_RESOLVING;
+  *find_entry(name) = e;
+  nentries += 1;
+  return e;
+}
+
+/*
+ * sweep_entries - this function throws away the entries whose answer has
+ * expired and that nobody is looking up. The caller must hold dns_lock.
+ */
+static void sweep_entries(time_t now)
+{
+  int i;
+  for (i = 0; i < DNS_BUCKETS; i++) {
+    dns_entry **ep = &entries[i];
+    while (*ep != NULL) {
+      dns_entry *e = *ep;
+      if (e->state == DNS_VALID && !e->permanent && !e->refreshing &&
+          !e->queued && e->nwaiters == 0 && now >= e->expires) {
+        *ep = e->next;
+        Free(e->name);
+        Free(e);
+        nentries -= 1;
+      }
+      else {
+        ep = &e->next;
+      }
+    }
+  }
+}
+
+/*
+ * fresh - this function returns whether e holds an answer that can be
+ * used at time now
+ */
+static int fresh(dns_entry *e, time_t now)
+{
+  return e->state == DNS_VALID && (e->permanent || now < e->expires);
+}
+
+/*
+ * maybe_refresh - this function queues a background lookup of the name
+ * of e if its answer is about to run out. The caller must hold dns_lock.
+ */
+static void maybe_refresh(dns_entry *e, time_t now)
+{
+  if (e->permanent || e->refreshing) {
+    return;
+  }
+  if ((e->expires - now) * 100 <= (time_t)e->ttl * DNS_REFRESH_PERCENT) {
+    e->refreshing = 1;
+    enqueue(e);
+  }
+}
+
+/*
+ * enqueue - this function queues e for a resolver thread. The caller must
+ * hold dns_lock.
+ */
+static void enqueue(dns_entry *e)
+{
+  e->queued = 1;
+  e->qnext = NULL;
+  if (queue_tail != NULL) {
+    queue_tail->qnext = e;
+  }
+  else {
+    queue_head = e;
+  }
+  queue_tail = e;
+  pthread_cond_signal(&queue_cond);
+}
+
+/*
+ * store_answer - this function makes res the answer of e for the next
+ * ttl seconds and wakes up everyone who was waiting for it. The caller
+ * must hold dns_lock.
+ */
+static void store_answer(dns_entry *e, dns_result *res, unsigned int ttl)
+{
+  uint64_t one = 1;
+  int i;
+  e->result = *res;
+  e->ttl = ttl;
+  e->expires = time(NULL) + ttl;
+  e->state = DNS_VALID;
+  e->refreshing = 0;
+  pthread_cond_broadcast(&dns_cond);
+  for (i = 0; i < e->nwaiters; i++) {
+    //an eventfd only fails to take this if its counter is huge, and
+    //then the loop will wake up anyway
+    if (write(e->waiters[i], &one, sizeof(one)) < 0) {
+      continue;
+    }
+  }
+  Free(e->waiters);
+  e->waiters = NULL;
+  e->nwaiters = 0;
+}
+
+/*
+ * dns_query - this function looks name up on the network, without using
+ * or changing the table, and fills res with its IPv4 and then its IPv6
+ * addresses. It returns the TTL of the answer.
+ */
+static unsigned int dns_query(char *name, dns_result *res)
+{
+  unsigned int ttl = DNS_MAX_TTL;
+
+  res->naddrs = 0;
+  if (dns_mode == DNS_HOSTS) {
+    //every name in the hosts file is already in the table
+    return DNS_NEGATIVE_TTL;
+  }
+  if (!resolver_ready) {
+    if (res_ninit(&resolver) < 0) {
+      return DNS_NEGATIVE_TTL;
+    }
+    if (dns_mode == DNS_SERVER) {
+      resolver.nsaddr_list[0] = dns_server;
+      resolver.nscount = 1;
+    }
+    resolver_ready = 1;
+  }
+  if (query_type(name, ns_t_a, res, &ttl) < 0) {
+    if (resolver.res_h_errno == HOST_NOT_FOUND) {
+      return DNS_NEGATIVE_TTL;
+    }
+    if (resolver.res_h_errno != NO_DATA) {
+      if (dns_mode == DNS_SERVER) {
+        return DNS_NEGATIVE_TTL;
+      }
+      //the nameservers couldn't be asked, let the system try its other
+      //sources. getaddrinfo doesn't tell us a TTL.
+      return system_query(name, res);
+    }
+  }
+  //a name with no IPv6 address is fine, as long as it has IPv4 ones
+  query_type(name, ns_t_aaaa, res, &ttl);
+  if (res->naddrs == 0) {
+    return DNS_NEGATIVE_TTL;
+  }
+  if (ttl < DNS_MIN_TTL) {
+    ttl = DNS_MIN_TTL;
+  }
+  return ttl;
+}
+
+/*
+ * query_type - this function asks the nameserver for the records of the
+ * given type (A or AAAA) of name, and appends the addresses in them to
+ * res. *ttl is lowered to the shortest TTL of the records. Like
+ * getaddrinfo, it tries the domains of the search list of resolv.conf as
+ * its ndots option says, so names with no dot in them still resolve. It
+ * returns -1 if the query failed, with the reason in resolver.res_h_errno.
+ */
+static int query_type(char *name, int type, dns_result *res,
+  unsigned int *ttl)
+{
+  unsigned char answer[NS_PACKETSZ * 4];
+  ns_msg msg;
+  ns_rr rr;
+  int len, i;
+  len = res_nsearch(&resolver, name, ns_c_in, type, answer, sizeof(answer));
+  if (len < 0 || ns_initparse(answer, len, &msg) < 0) {
+    return -1;
+  }
+  //the answer section may hold CNAMEs before the addresses, only the
+  //addresses are kept, and the shortest TTL of all the records counts
+  for (i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+    if (ns_parserr(&msg, ns_s_an, i, &rr) < 0) {
+      break;
+    }
+    if (ns_rr_ttl(rr) < *ttl) {
+      *ttl = ns_rr_ttl(rr);
+    }
+    if (type == ns_t_a && ns_rr_type(rr) == ns_t_a &&
+        ns_rr_rdlen(rr) == 4) {
+      add_address(res, AF_INET, (void *)ns_rr_rdata(rr));
+    }
+    else if (type == ns_t_aaaa && ns_rr_type(rr) == ns_t_aaaa &&
+        ns_rr_rdlen(rr) == 16) {
+      add_address(res, AF_INET6, (void *)ns_rr_rdata(rr));
+    }
+  }
+  return 0;
+}
+
+/*
+ * system_query - this function looks name up with getaddrinfo, for when
+ * the nameservers can't be asked. It returns the TTL of the answer.
+ */
+static unsigned int system_query(char *name, dns_result *res)
+{
+  struct addrinfo hints, *addlist, *p;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(name, NULL, &hints, &addlist) != 0) {
+    return DNS_NEGATIVE_TTL;
+  }
+  for (p = addlist; p; p = p->ai_next) {
+    if (p->ai_family == AF_INET) {
+      add_address(res, AF_INET, &((struct sockaddr_in *)p->ai_addr)->sin_addr);
+    }
+    else if (p->ai_family == AF_INET6) {
+      add_address(res, AF_INET6,
+        &((struct sockaddr_in6 *)p->ai_addr)->sin6_addr);
+    }
+  }
+  freeaddrinfo(addlist);
+  return res->naddrs > 0 ? DNS_DEFAULT_TTL : DNS_NEGATIVE_TTL;
+}
+
+/*
+ * copy_answer - this function copies the answer of e to res and returns
+ * 0, or -1 if the name doesn't resolve. The caller must hold dns_lock.
+ */
+static int copy_answer(dns_entry *e, dns_result *res)
+{
+  *res = e->result;
+  return res->naddrs > 0 ? 0 : -1;
+}
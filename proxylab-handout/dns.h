@@ -0,0 +1,49 @@
+/*
+ * dns.h - caching resolver for the names of the servers the proxy
+ * talks to
+ */
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include "csapp.h"
+
+/* Where names are looked up */
+#define DNS_SYSTEM 0 //hosts file, then the nameservers of /etc/resolv.conf
+#define DNS_HOSTS 1 //hosts file only, nothing goes out on the network
+#define DNS_SERVER 2 //hosts file, then one nameserver given at startup
+
+/* Most addresses kept for one name */
+#define DNS_MAX_ADDRS 8
+
+/* Time to live of cached answers, in seconds */
+#define DNS_DEFAULT_TTL 60 //for answers that come without a TTL
+#define DNS_MIN_TTL 1
+#define DNS_MAX_TTL 3600
+#define DNS_NEGATIVE_TTL 5 //for names that don't resolve
+
+/* An answer is refreshed in the background once this much of its TTL is
+   left, in percent, so that names in use never expire */
+#define DNS_REFRESH_PERCENT 10
+
+/* Threads that resolve names in the background */
+#define DNS_THREADS 2
+
+/* Size of the table of names, and the number of names above which
+   expired ones are thrown away */
+#define DNS_BUCKETS 1024
+#define DNS_MAX_ENTRIES 4096
+
+/* The addresses of a name, the ports are left 0 */
+struct dns_result{
+  int naddrs; //0 if the name doesn't resolve
+  struct sockaddr_storage addrs[DNS_MAX_ADDRS];
+  socklen_t addrlens[DNS_MAX_ADDRS];
+};
+
+typedef struct dns_result dns_result;
+
+void dns_init(int mode, char *server);
+int dns_resolve(char *host, dns_result *res);
+int dns_resolve_nb(char *host, dns_result *res, int notify_fd);
+
+#endif /* __DNS_H__ */
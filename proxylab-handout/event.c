@@ -0,0 +1,1555 @@
+/*
+ * event.c - epoll based I/O core of the proxy
+ *
+ * In this mode the proxy does not start a thread per connection. A fixed
+ * number of event loop threads each own an epoll instance, and every
+ * socket (clients and servers alike) is non-blocking. The listening
+ * socket is added to every loop with EPOLLEXCLUSIVE, so each new
+ * connection wakes up one loop, which accepts it and keeps it for good.
+ * With SO_REUSEPORT sharding every loop has a listening socket of its
+ * own instead, and the kernel picks the loop for each new connection,
+ * so the loops never contend for one accept queue.
+ *
+ * Each connection is a small state machine (struct conn) that goes
+ * through the same steps as doit does in the threaded proxy:
+ *   CONN_READ_REQUEST  - read the request head from the client
+ *   CONN_LOAD          - the url isn't cached in memory, wait for the
+ *                        disk tier to be looked up
+ *   CONN_SEND_HIT      - the url was cached and is fresh, write the
+ *                        cached object
+ *   CONN_RESOLVE       - wait for the resolver to look up the server
+ *   CONN_CONNECT       - wait for a connect to the server to finish
+ *   CONN_SEND_REQUEST  - write the compiled request to the server
+ *   CONN_RELAY         - copy the server's response to the client, one
+ *                        buffer at a time, and keep a copy for the cache
+ *   CONN_SEND_ERROR    - write an error response to the client
+ *   CONN_FOLLOW        - another connection is fetching the url, relay
+ *                        its response as it arrives
+ * Whenever a socket would block, the connection tells epoll which event
+ * it is waiting for and goes back to the loop. While relaying, the server
+ * is only read from once the client has taken everything read so far, so
+ * a slow client slows down its own server and nothing else.
+ *
+ * When connections to servers are kept alive, an idle connection from
+ * the upstream pool skips CONN_CONNECT. The response is framed as it is
+ * relayed, and once its last byte has been written to the client the
+ * server connection is taken out of this loop and goes back to the pool.
+ * If a pooled connection turns out to be closed before any of the
+ * response arrived, the request is sent again on a new connection.
+ *
+ * Server names are looked up with dns_resolve_nb, which answers at once
+ * from the resolver's cache. Names that aren't cached are looked up by
+ * the resolver's threads, and the connection waits on the loop's
+ * resolving list. Each loop has an eventfd that the resolver writes when
+ * a lookup is over, and the loop then asks again for every connection
+ * on its resolving list.
+ *
+ * New server connections race the server's addresses, IPv6 and IPv4,
+ * as RFC 8305 says: every attempt's socket is watched by epoll, and one
+ * more address is tried each RACE_ATTEMPT_DELAY ms until one of them
+ * connects. Connections in a race sit on the loop's connecting list, and
+ * epoll_wait wakes up in time for the next attempt that is due.
+ *
+ * The loops never touch the disk tier of the cache themselves. A url
+ * that isn't cached in memory is looked up on disk by the cache's reader
+ * threads (cache_load_start), and the connection waits on the loop's
+ * loading list, until the readers write the loop's third eventfd.
+ * Objects the loops add to the cache, and those evicted to make room
+ * for them, are written to disk by the cache's writer thread.
+ *
+ * Nothing of a response is relayed until its head is over: the client
+ * gets the head without its hop-by-hop headers, and the body framed for
+ * it as http.c says, in the relay buffer, which has room before the
+ * body for the head and the size of a chunk. A cached object that is no
+ * longer fresh is revalidated: the request sent to the server is made
+ * conditional. A 304 is not relayed, the object is sent as a hit
+ * instead.
+ *
+ * A response that turns out too big for the cache is not read into the
+ * out buffer any more: the rest of its body is spliced from the server
+ * into a pipe of the connection and from there to the client, so it is
+ * never copied into user space. Cached objects kept in a memfd are sent
+ * with sendfile.
+ *
+ * A miss for a url that another connection is already fetching doesn't
+ * go to the server: the connection follows that fetch (see inflight.c)
+ * and sends its client the leader's bytes. Followers that have sent all
+ * there is so far sit on the loop's following list, and each loop has
+ * a second eventfd that leaders write when more bytes arrive. Followers
+ * go at the pace of the leader, which reads from the server when its
+ * own client has taken the previous chunk. A leader whose client goes
+ * away while it has followers keeps reading the response for them.
+ *
+ * Client connections are kept alive. Once a response has been written in
+ * full, a connection whose client asked for keep-alive (and whose response
+ * says where it ends) goes back to CONN_READ_REQUEST. Bytes the client
+ * pipelined behind a request stay in the input buffer and are answered
+ * next, and the client isn't read from while a response is being sent,
+ * so pipelined requests are answered in order. Connections waiting for a
+ * request sit on the loop's idle list, oldest first, and are closed once
+ * they have waited for client_idle_timeout seconds.
+ *
+ * A loop that runs out of descriptors can't accept the connections that
+ * are waiting, and the listening socket would stay ready and wake it up
+ * at once on every pass. Each loop holds a spare descriptor, which it
+ * closes to accept the first of them and close it again, before opening
+ * the spare once more. If the spare can't be opened again, the listening
+ * socket is left out of the loop's epoll for a second instead.
+ *
+ * A connection that is closed while handling one event may still have
+ * another event waiting in the same batch, so closed connections are
+ * only freed once the whole batch has been handled.
+ */
+
+#define _GNU_SOURCE
+#include "proxy.h"
+#include "event.h"
+#include "http.h"
+#include "request.h"
+#include "gather.h"
+#include "arena.h"
+#include "upstream.h"
+#include "inflight.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/* Most events handled per epoll_wait */
+#define EVENT_MAX_EVENTS 256
+
+/* States of a connection */
+#define CONN_READ_REQUEST 0
+#define CONN_SEND_HIT 1
+#define CONN_CONNECT 2
+#define CONN_SEND_REQUEST 3
+#define CONN_RELAY 4
+#define CONN_SEND_ERROR 5
+#define CONN_RESOLVE 6
+#define CONN_CLOSED 7
+#define CONN_FOLLOW 8
+#define CONN_LOAD 9
+
+typedef struct conn conn;
+
+/* What an event loop thread is started with */
+struct loop_args{
+  int listenfd; //listening socket the loop accepts from
+  int cpu; //CPU to run the loop on, -1 to let it run anywhere
+};
+
+/* State of one event loop thread */
+struct event_loop{
+  int epfd; //this loop's epoll instance
+  int listenfd; //listening socket, shared unless sharded by SO_REUSEPORT
+  conn *dead; //connections closed during the current batch
+  conn *idle_head; //connections waiting for a request, oldest first
+  conn *idle_tail;
+  int dnsfd; //eventfd written by the resolver when a lookup is over
+  conn *resolving; //connections waiting for a lookup
+  conn *connecting; //connections racing connects to their server
+  int flightfd; //eventfd written by leaders when a fetch moves on
+  conn *following; //followers waiting for their fetch to move on
+  int diskfd; //eventfd written by the cache's readers when a lookup is over
+  conn *loading; //connections waiting for the disk tier
+  int sparefd; //descriptor given up to turn a client away when there are
+               //no others, -1 if it couldn't be opened again
+  time_t paused_since; //when the listening socket was taken out of epoll
+                       //for lack of descriptors, 0 if it is watched
+};
+
+/* The eventfds are registered with pointers to these, to tell them apart
+   from the listening socket and the connections */
+static char dns_marker;
+static char flight_marker;
+static char disk_marker;
+
+/* One of the two sockets of a connection, this is what epoll hands back */
+struct conn_end{
+  conn *c; //connection the socket belongs to
+  int fd; //the socket, -1 if not open
+  unsigned int events; //events epoll is currently asked to report
+  int registered; //whether fd has been added to the epoll instance
+};
+
+struct conn{
+  struct event_loop *loop; //loop that owns this connection
+  int state;
+  struct conn_end client;
+  struct conn_end server;
+  char *in; //request head read from the client so far, and anything
+  size_t in_len; //pipelined behind it
+  size_t scanned; //how much of in was looked at for the end of the head
+  size_t head_len; //bytes of in the head takes, until the request ends
+  int keepalive; //the client wants the connection kept open
+  int authorized; //the request carried Authorization
+  int nrequests; //requests answered on this connection so far
+  int idle; //the connection is on the loop's idle list
+  time_t idle_since; //when it started waiting for a request
+  conn *idle_prev; //links in the loop's idle list
+  conn *idle_next;
+  arena mem; //memory of the request, given back when it ends
+  char *uri; //uri of the request, the key into the cache, in mem
+  char *host; //server the request goes to, in mem
+  char *path; //path of the url on the server, in mem
+  int port;
+  http_request *req; //the parsed head while the disk is looked up, in mem
+  cache_load *load; //lookup of the disk tier under way
+  dns_result *addrs; //addresses of the server, once they're known
+  race_t *race; //connects to the server's addresses under way
+  conn **waiting; //resolving, connecting, following or loading list
+                  //it is on
+  conn *wait_prev; //links in that list
+  conn *wait_next;
+  int reused; //the server connection came from the upstream pool
+  gather *request; //compiled request in mem, its pieces lie in in and mem
+  size_t request_off; //how much of request has been written
+  http_frame *frame; //tells where the server's response ends, in mem
+  int resp_done; //the last chunk of the response has been read
+  int pipefd[2]; //pipe the body is spliced through, -1s until needed
+  size_t piped; //bytes in the pipe that the client hasn't taken yet
+  char *out; //pending bytes, a relayed piece or an error, the relay
+             //buffer of HTTP_RELAY_SIZE bytes unless it is an error
+  size_t out_len; //where the pending bytes end in out
+  size_t out_off; //where they start, how much of out has been written
+  cache_node *hit; //cached object being sent, we hold a reference
+  size_t hit_off; //how much of the cached object has been written
+  char *framing; //headers the hit is framed with for the client, in mem
+  size_t framing_len;
+  cache_node *stale; //cached object being revalidated, we hold a reference
+  cache_buf response; //the server's response, collected for the cache
+  inflight *flight; //fetch of the url this connection leads or follows
+  int leader; //the connection leads flight
+  size_t flight_off; //how much of flight's response has been taken
+  conn *next_dead; //link in the loop's list of closed connections
+};
+
+static void *event_loop_thread(void *vargp);
+static void accept_clients(struct event_loop *loop);
+static int turn_away(struct event_loop *loop);
+static void watch_listener(struct event_loop *loop);
+static void set_events(conn *c, struct conn_end *end, unsigned int events);
+static void client_event(conn *c, unsigned int events);
+static void server_event(conn *c, unsigned int events);
+static void read_request(conn *c);
+static void start_request(conn *c, http_request *r, size_t head_len);
+static void looked_up(conn *c, http_request *r);
+static void load_done(struct event_loop *loop);
+static void next_request(conn *c, size_t head_len);
+static void fetch_server(conn *c);
+static void start_hit(conn *c);
+static void send_hit(conn *c);
+static void connect_server(conn *c);
+static void resolve_done(struct event_loop *loop);
+static void follow_flight(conn *c);
+static void flight_done(struct event_loop *loop);
+static void flight_end(conn *c, int ok);
+static void connect_step(conn *c);
+static void connect_timers(struct event_loop *loop);
+static int connect_timeout(struct event_loop *loop, int timeout);
+static void wait_add(conn **list, conn *c);
+static void wait_remove(conn *c);
+static int retry_server(conn *c);
+static void send_request(conn *c);
+static void finish_response(conn *c);
+static void not_modified(conn *c);
+static void end_request(conn *c, int framed);
+static void idle_add(conn *c);
+static void idle_remove(conn *c);
+static void expire_idle(struct event_loop *loop);
+static void relay_read(conn *c);
+static void relay_write(conn *c);
+static void send_error(conn *c, char *cause, char *errnum,
+	char *shortmsg, char *longmsg);
+static void send_out(conn *c);
+static void client_lost(conn *c);
+static void close_conn(conn *c);
+static void free_conn(conn *c);
+
+/*
+ * event_run - this function starts nthreads event loops that serve
+ * the connections accepted on the nlisteners sockets in listenfds.
+ * Either all loops share listenfds[0], or there is one socket per loop.
+ * If pin is set, loop i is pinned to CPU i (modulo the number of CPUs).
+ * The calling thread becomes one of the loops, so this function never
+ * returns.
+ */
+void event_run(int *listenfds, int nlisteners, int nthreads, int pin)
+{
+  pthread_t tid;
+  int i;
+  int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  for (i = 0; i < nlisteners; i++) {
+    int flags = fcntl(listenfds[i], F_GETFL, 0);
+    //a shared socket wakes every loop for new connections, but only one
+    //of them gets to accept each one, the others must not block in accept
+    fcntl(listenfds[i], F_SETFL, flags | O_NONBLOCK);
+  }
+  for (i = nthreads - 1; i >= 0; i--) {
+    struct loop_args *args = Malloc(sizeof(struct loop_args));
+    args->listenfd = listenfds[i % nlisteners];
+    args->cpu = pin ? i % ncpus : -1;
+    if (i > 0) {
+      Pthread_create(&tid, NULL, event_loop_thread, args);
+    }
+    else {
+      event_loop_thread(args);
+    }
+  }
+}
+
+/*
+ * event_loop_thread - this is the body of one event loop. It waits for
+ * events on its own epoll instance and hands each one to the connection
+ * it belongs to.
+ */
+static void *event_loop_thread(void *vargp)
+{
+  struct epoll_event ev, events[EVENT_MAX_EVENTS];
+  struct event_loop loop;
+  int i, n;
+
+  struct loop_args *args = vargp;
+  loop.listenfd = args->listenfd;
+  if (args->cpu >= 0) {
+    pin_to_cpu(args->cpu);
+  }
+  Free(vargp);
+  Pthread_detach(pthread_self());
+  loop.dead = NULL;
+  loop.idle_head = loop.idle_tail = NULL;
+  loop.resolving = loop.connecting = loop.following = loop.loading = NULL;
+  loop.sparefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  loop.paused_since = 0;
+  if ((loop.epfd = epoll_create1(0)) < 0) {
+    unix_error("epoll_create1 error");
+  }
+  if ((loop.dnsfd = eventfd(0, EFD_NONBLOCK)) < 0) {
+    unix_error("eventfd error");
+  }
+  ev.events = EPOLLIN;
+  ev.data.ptr = &dns_marker;
+  if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.dnsfd, &ev) < 0) {
+    unix_error("epoll_ctl error");
+  }
+  if ((loop.flightfd = eventfd(0, EFD_NONBLOCK)) < 0) {
+    unix_error("eventfd error");
+  }
+  ev.events = EPOLLIN;
+  ev.data.ptr = &flight_marker;
+  if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.flightfd, &ev) < 0) {
+    unix_error("epoll_ctl error");
+  }
+  if ((loop.diskfd = eventfd(0, EFD_NONBLOCK)) < 0) {
+    unix_error("eventfd error");
+  }
+  ev.events = EPOLLIN;
+  ev.data.ptr = &disk_marker;
+  if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.diskfd, &ev) < 0) {
+    unix_error("epoll_ctl error");
+  }
+  watch_listener(&loop);
+
+  while (1) {
+    //wake up every second to close idle connections, if there are any,
+    //or to watch the listening socket again, and whenever a connect race
+    //has something to do
+    n = epoll_wait(loop.epfd, events, EVENT_MAX_EVENTS,
+      connect_timeout(&loop, (loop.idle_head != NULL ||
+        loop.paused_since != 0) ? 1000 : -1));
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      unix_error("epoll_wait error");
+    }
+    for (i = 0; i < n; i++) {
+      struct conn_end *end = events[i].data.ptr;
+      if (end == NULL) {
+        accept_clients(&loop);
+      }
+      else if (events[i].data.ptr == &dns_marker) {
+        resolve_done(&loop);
+      }
+      else if (events[i].data.ptr == &flight_marker) {
+        flight_done(&loop);
+      }
+      else if (events[i].data.ptr == &disk_marker) {
+        load_done(&loop);
+      }
+      else if (end->c->state != CONN_CLOSED) {
+        if (end == &end->c->client) {
+          client_event(end->c, events[i].events);
+        }
+        else {
+          server_event(end->c, events[i].events);
+        }
+      }
+    }
+    connect_timers(&loop);
+    expire_idle(&loop);
+    if (loop.paused_since != 0 && time(NULL) - loop.paused_since >= 1) {
+      watch_listener(&loop);
+    }
+    //no event left in this batch can refer to the closed connections
+    while (loop.dead != NULL) {
+      conn *c = loop.dead;
+      loop.dead = c->next_dead;
+      free_conn(c);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * accept_clients - this function accepts every pending connection and
+ * starts reading a request from each of them
+ */
+static void accept_clients(struct event_loop *loop)
+{
+  int connfd;
+  while (1) {
+    if ((connfd = accept4(loop->listenfd, NULL, NULL, SOCK_NONBLOCK)) < 0) {
+      if ((errno == EMFILE || errno == ENFILE) && turn_away(loop) == 0) {
+        continue;
+      }
+      break;
+    }
+    conn *c = Calloc(1, sizeof(conn));
+    c->loop = loop;
+    c->state = CONN_READ_REQUEST;
+    c->client.c = c;
+    c->client.fd = connfd;
+    c->server.c = c;
+    c->server.fd = -1;
+    c->pipefd[0] = c->pipefd[1] = -1;
+    //free_conn drops it whether or not a request ever got that far, it
+    //must not find a spill file at descriptor 0
+    cache_buf_init(&c->response, proxy_cache);
+    c->in = Malloc(client_buffer_size);
+    c->in_len = c->scanned = 0;
+    idle_add(c);
+    set_events(c, &c->client, EPOLLIN);
+  }
+  //EAGAIN means another loop took the connection or there are no more.
+  //Anything else is retried on the next wakeup.
+}
+
+/*
+ * turn_away - this function accepts the first waiting connection and
+ * closes it, when there is no descriptor left to accept it with: the
+ * loop's spare descriptor is closed to make room, and opened again after.
+ * Without a spare, the listening socket is taken out of the loop's epoll
+ * for a second. It returns 0 if a connection was turned away and -1
+ * otherwise.
+ */
+static int turn_away(struct event_loop *loop)
+{
+  int connfd;
+  if (loop->sparefd < 0 &&
+      (loop->sparefd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) {
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->listenfd, NULL) < 0) {
+      unix_error("epoll_ctl error");
+    }
+    loop->paused_since = time(NULL);
+    return -1;
+  }
+  close(loop->sparefd);
+  connfd = accept(loop->listenfd, NULL, NULL);
+  if (connfd >= 0) {
+    close(connfd);
+  }
+  loop->sparefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  return (connfd >= 0) ? 0 : -1;
+}
+
+/*
+ * watch_listener - this function has the loop's epoll report new
+ * connections on the listening socket
+ */
+static void watch_listener(struct event_loop *loop)
+{
+  struct epoll_event ev;
+  //the listening socket is registered with a NULL pointer, since it
+  //doesn't belong to any connection
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->listenfd, &ev) < 0) {
+    unix_error("epoll_ctl error");
+  }
+  loop->paused_since = 0;
+}
+
+/*
+ * set_events - this function sets the events epoll should report for one
+ * socket of the connection. Asking for no events still reports errors and
+ * hangups.
+ */
+static void set_events(conn *c, struct conn_end *end, unsigned int events)
+{
+  struct epoll_event ev;
+  if (end->registered && end->events == events) {
+    return;
+  }
+  ev.events = events;
+  ev.data.ptr = end;
+  if (epoll_ctl(c->loop->epfd, end->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+      end->fd, &ev) < 0) {
+    close_conn(c);
+    return;
+  }
+  end->registered = 1;
+  end->events = events;
+}
+
+/*
+ * client_event - this function handles an event on the client's socket
+ */
+static void client_event(conn *c, unsigned int events)
+{
+  if (c->state == CONN_READ_REQUEST) {
+    //a hangup shows up as end of file when reading
+    read_request(c);
+    return;
+  }
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    //the client went away, there's nobody left to send anything to
+    client_lost(c);
+    return;
+  }
+  switch (c->state) {
+  case CONN_SEND_HIT:
+    send_hit(c);
+    break;
+  case CONN_RELAY:
+    relay_write(c);
+    break;
+  case CONN_SEND_ERROR:
+    send_out(c);
+    break;
+  case CONN_FOLLOW:
+    follow_flight(c);
+    break;
+  }
+}
+
+/*
+ * server_event - this function handles an event on the server's socket
+ */
+static void server_event(conn *c, unsigned int events)
+{
+  switch (c->state) {
+  case CONN_CONNECT:
+    //one of the connects of the race has finished
+    connect_step(c);
+    break;
+  case CONN_SEND_REQUEST:
+    send_request(c);
+    break;
+  case CONN_RELAY:
+    relay_read(c);
+    break;
+  }
+}
+
+/*
+ * read_request - this function reads as much of the request head as the
+ * client has sent. Once the blank line that ends the head has arrived,
+ * the request is started. The head may already be in the buffer, if the
+ * client pipelined it behind the previous request.
+ */
+static void read_request(conn *c)
+{
+  http_request req;
+  ssize_t n;
+  int head_len;
+  while (1) {
+    head_len = request_parse(c->in, c->in_len, &c->scanned, &req);
+    if (head_len > 0) {
+      start_request(c, &req, head_len);
+      return;
+    }
+    if (head_len == REQUEST_BAD || c->in_len == client_buffer_size) {
+      send_error(c, "request", "400", "Bad Request",
+        "Proxy could not read the request header");
+      return;
+    }
+    n = read(c->client.fd, c->in + c->in_len,
+      client_buffer_size - c->in_len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN) {
+        close_conn(c);
+      }
+      return;
+    }
+    if (n == 0) { //the client closed the connection before finishing
+      close_conn(c);
+      return;
+    }
+    c->in_len += n;
+  }
+}
+
+/*
+ * start_request - this function does what doit does once the request has
+ * been read and parsed into r, where it lies in c->in: it answers the
+ * request from the cache if it can, follows the fetch of the url if
+ * another connection is making it, and starts connecting to the server
+ * otherwise
+ */
+static void start_request(conn *c, http_request *r, size_t head_len)
+{
+  idle_remove(c);
+  //the head stays in c->in until the request ends, the request to the
+  //server is sent from where it lies
+  c->head_len = head_len;
+  if (r->method_len != 3 || strncasecmp(r->method, "GET", 3) != 0) {
+    send_error(c, arena_strndup(&c->mem, r->method, r->method_len), "501",
+      "Not Implemented", "Proxy does not implement this method");
+    return;
+  }
+  c->uri = arena_strndup(&c->mem, r->uri, r->uri_len);
+  c->keepalive = request_keepalive(r);
+  c->authorized = (request_find(r, "Authorization") != NULL);
+
+  //we first check if the given request has been cached, in memory here
+  //and on disk by the cache's readers, while the connection waits
+  c->hit = cache_lookup(proxy_cache, c->uri);
+  if (c->hit == NULL && proxy_cache->disk != NULL) {
+    //r points into c->in, which is left alone until the request ends
+    c->req = arena_alloc(&c->mem, sizeof(http_request));
+    *c->req = *r;
+    c->load = cache_load_start(proxy_cache, c->uri, c->loop->diskfd);
+    c->state = CONN_LOAD;
+    set_events(c, &c->client, 0);
+    wait_add(&c->loop->loading, c);
+    return;
+  }
+  looked_up(c, r);
+}
+
+/*
+ * looked_up - this function goes on with the request r once the cache
+ * has been looked up, c->hit being what was found. An object that is no
+ * longer fresh can only be sent once the server says it hasn't changed.
+ */
+static void looked_up(conn *c, http_request *r)
+{
+  char *hostname, *path, *port;
+
+  if (c->hit != NULL && cache_node_fresh(c->hit)) {
+    start_hit(c);
+    return;
+  }
+  c->stale = c->hit;
+  c->hit = NULL;
+
+  //parse the uri to get the hostname, path and port number, none of
+  //which is longer than the uri or the defaults "/" and "80"
+  hostname = arena_alloc(&c->mem, r->uri_len + 3);
+  path = arena_alloc(&c->mem, r->uri_len + 3);
+  port = arena_alloc(&c->mem, r->uri_len + 3);
+  if (parse_uri(c->uri, hostname, path, port) < 0) {
+    close_conn(c);
+    return;
+  }
+  c->host = hostname;
+  c->path = path;
+  c->port = atoi(port);
+  c->request = arena_alloc(&c->mem, sizeof(gather));
+  compile_request(c->request, r, c->host, c->path);
+  //a stale object is revalidated with a conditional request, if it has
+  //what it takes, and fetched again like a miss otherwise
+  if (c->stale != NULL &&
+      revalidate_request(&c->mem, c->request, r, c->stale) < 0) {
+    release_cache_node(c->stale);
+    c->stale = NULL;
+  }
+  c->frame = arena_alloc(&c->mem, sizeof(http_frame));
+  http_out_init(&c->frame->out, r->version, c->keepalive);
+  cache_buf_init(&c->response, proxy_cache);
+  set_events(c, &c->client, 0);
+
+  //if another connection is already fetching this url, we relay its
+  //response as it arrives rather than fetching it a second time.
+  //Revalidations aren't shared, they don't bring a body back
+  if (c->stale == NULL) {
+    c->flight = inflight_join(c->uri, proxy_cache->max_object, &c->leader);
+  }
+  if (c->flight != NULL && !c->leader) {
+    if (c->out == NULL) {
+      c->out = Malloc(HTTP_RELAY_SIZE);
+    }
+    c->out_len = c->out_off = 0;
+    c->flight_off = 0;
+    c->state = CONN_FOLLOW;
+    follow_flight(c);
+    return;
+  }
+  fetch_server(c);
+}
+
+/*
+ * next_request - this function takes the head_len bytes of the request
+ * that just ended out of c->in. Whatever the client sent after them is
+ * the next request.
+ */
+static void next_request(conn *c, size_t head_len)
+{
+  c->in_len -= head_len;
+  memmove(c->in, c->in + head_len, c->in_len);
+  c->scanned = 0;
+}
+
+/*
+ * fetch_server - this function sends the compiled request to the server,
+ * on a kept-alive connection if there is one and on a new one otherwise
+ */
+static void fetch_server(conn *c)
+{
+  //take a kept-alive connection to the server if there is one
+  c->server.fd = upstream_get(c->host, c->port);
+  if (c->server.fd >= 0) {
+    set_nonblocking(c->server.fd, 1);
+    c->reused = 1;
+    c->request_off = 0;
+    c->state = CONN_SEND_REQUEST;
+    set_events(c, &c->server, EPOLLOUT);
+    return;
+  }
+  connect_server(c);
+}
+
+/*
+ * connect_server - this function starts racing connects to the server's
+ * addresses on new connections. If the server's addresses aren't known
+ * yet, the connection waits for the resolver first.
+ */
+static void connect_server(conn *c)
+{
+  if (c->addrs == NULL) {
+    c->addrs = Malloc(sizeof(dns_result));
+    switch (dns_resolve_nb(c->host, c->addrs, c->loop->dnsfd)) {
+    case 0:
+      c->state = CONN_RESOLVE;
+      wait_add(&c->loop->resolving, c);
+      return;
+    case -1:
+      close_conn(c);
+      return;
+    }
+  }
+  if (c->race == NULL) {
+    c->race = Malloc(sizeof(race_t));
+  }
+  upstream_race(c->race, c->addrs, c->port);
+  c->reused = 0;
+  c->request_off = 0;
+  c->state = CONN_CONNECT;
+  connect_step(c);
+}
+
+/*
+ * connect_step - this function moves the connection's race along. Each
+ * new attempt's socket is handed to epoll, which reports it under the
+ * server end of the connection, like the socket of the winner will be.
+ * Once an attempt has connected, the request is sent on it.
+ */
+static void connect_step(conn *c)
+{
+  struct epoll_event ev;
+  int started;
+  int fd = race_step(c->race, &started);
+  if (started >= 0) {
+    ev.events = EPOLLOUT;
+    ev.data.ptr = &c->server;
+    //if this fails the attempt is still looked at by the timers
+    epoll_ctl(c->loop->epfd, EPOLL_CTL_ADD, started, &ev);
+  }
+  if (fd == RACE_PENDING) {
+    if (c->waiting == NULL) {
+      wait_add(&c->loop->connecting, c);
+    }
+    return;
+  }
+  wait_remove(c);
+  if (fd == RACE_FAILED) {
+    close_conn(c);
+    return;
+  }
+  c->server.fd = fd;
+  c->server.registered = 1;
+  c->server.events = EPOLLOUT;
+  c->state = CONN_SEND_REQUEST;
+  send_request(c);
+}
+
+/*
+ * connect_timers - this function moves along the races that have an
+ * attempt to start or to give up by now
+ */
+static void connect_timers(struct event_loop *loop)
+{
+  conn *c, *next;
+  for (c = loop->connecting; c != NULL; c = next) {
+    next = c->wait_next;
+    if (race_timeout(c->race) == 0) {
+      connect_step(c);
+    }
+  }
+}
+
+/*
+ * connect_timeout - this function returns how long epoll_wait may wait,
+ * in ms, so that the loop is back before the next race timer is due and
+ * no later than timeout (-1 for no limit)
+ */
+static int connect_timeout(struct event_loop *loop, int timeout)
+{
+  conn *c;
+  for (c = loop->connecting; c != NULL; c = c->wait_next) {
+    int t = race_timeout(c->race);
+    if (t >= 0 && (timeout < 0 || t < timeout)) {
+      timeout = t;
+    }
+  }
+  return timeout;
+}
+
+/*
+ * resolve_done - this function is called when the resolver has finished
+ * some lookups for this loop. Every connection that waits for one asks
+ * again, and those whose server is now known start connecting to it.
+ */
+static void resolve_done(struct event_loop *loop)
+{
+  uint64_t count;
+  conn *c, *next;
+  if (read(loop->dnsfd, &count, sizeof(count)) < 0) {
+    return;
+  }
+  for (c = loop->resolving; c != NULL; c = next) {
+    next = c->wait_next;
+    int rc = dns_resolve_nb(c->host, c->addrs, loop->dnsfd);
+    if (rc != 0) {
+      wait_remove(c);
+      if (rc < 0) {
+        close_conn(c);
+      }
+      else {
+        connect_server(c);
+      }
+    }
+  }
+}
+
+/*
+ * load_done - this function is called when the cache's readers have
+ * finished some lookups for this loop. Every connection whose lookup is
+ * over goes on with its request.
+ */
+static void load_done(struct event_loop *loop)
+{
+  uint64_t count;
+  conn *c, *next;
+  if (read(loop->diskfd, &count, sizeof(count)) < 0) {
+    return;
+  }
+  for (c = loop->loading; c != NULL; c = next) {
+    next = c->wait_next;
+    if (cache_load_done(proxy_cache, c->load, &c->hit)) {
+      c->load = NULL;
+      wait_remove(c);
+      looked_up(c, c->req);
+    }
+  }
+}
+
+/*
+ * follow_flight - this function writes to the client as much of the
+ * response of the fetch the connection follows as there is and the
+ * client will take, framed for the client by c->frame->out. When it has
+ * sent everything there is so far, the connection waits on the loop's
+ * following list. When the fetch is over, the request ends, unless the
+ * fetch failed before anything was sent, in which case the connection
+ * fetches the url itself.
+ */
+static void follow_flight(conn *c)
+{
+  char *data = c->out + HTTP_RELAY_ROOM, *piece;
+  ssize_t n;
+  size_t len;
+  int state;
+  while (1) {
+    while (c->out_off < c->out_len) {
+      n = write(c->client.fd, c->out + c->out_off, c->out_len - c->out_off);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno == EAGAIN) {
+          set_events(c, &c->client, EPOLLOUT);
+        }
+        else {
+          close_conn(c);
+        }
+        return;
+      }
+      c->out_off += n;
+    }
+    if (c->resp_done) {
+      flight_end(c, 1);
+      end_request(c, c->frame->out.coding != BODY_CLOSE);
+      return;
+    }
+    len = inflight_read(c->flight, c->flight_off, data, MAXBUF, &state);
+    if (len > 0 || state == INFLIGHT_DONE) {
+      n = len;
+      piece = follow_piece(c->flight, &c->frame->out, c->flight_off, data,
+        &len, state == INFLIGHT_DONE);
+      c->flight_off += n;
+      c->out_off = piece - c->out;
+      c->out_len = c->out_off + len;
+      c->resp_done = (state == INFLIGHT_DONE);
+      continue;
+    }
+    if (state == INFLIGHT_FAILED) {
+      flight_end(c, 0);
+      if (c->flight_off > 0) {
+        close_conn(c); //the client got part of a response
+      }
+      else {
+        fetch_server(c);
+      }
+      return;
+    }
+    if (!inflight_watch(c->flight, c->flight_off, c->loop->flightfd)) {
+      set_events(c, &c->client, 0);
+      if (c->waiting == NULL) {
+        wait_add(&c->loop->following, c);
+      }
+      return;
+    }
+  }
+}
+
+/*
+ * flight_done - this function is called when fetches followed by this
+ * loop's connections have moved on. Every follower that waits sends what
+ * there is now, and waits again if its fetch isn't over.
+ */
+static void flight_done(struct event_loop *loop)
+{
+  uint64_t count;
+  conn *c, *next;
+  if (read(loop->flightfd, &count, sizeof(count)) < 0) {
+    return;
+  }
+  for (c = loop->following; c != NULL; c = next) {
+    next = c->wait_next;
+    wait_remove(c);
+    follow_flight(c);
+  }
+}
+
+/*
+ * flight_end - this function lets go of the fetch the connection leads
+ * or follows, if any. A leader ends the fetch, which succeeded if ok is
+ * set.
+ */
+static void flight_end(conn *c, int ok)
+{
+  if (c->flight == NULL) {
+    return;
+  }
+  if (c->leader) {
+    inflight_finish(c->flight, ok);
+  }
+  else {
+    inflight_leave(c->flight, c->flight_off);
+  }
+  c->flight = NULL;
+  c->leader = 0;
+}
+
+/*
+ * wait_add - this function puts the connection at the start of list,
+ * one of its loop's resolving, connecting, following and loading lists,
+ * taking it off the one it is on, if any
+ */
+static void wait_add(conn **list, conn *c)
+{
+  //an event of the same batch may have moved it on while it waited, a
+  //follower may even have started its next request
+  wait_remove(c);
+  c->waiting = list;
+  c->wait_prev = NULL;
+  c->wait_next = *list;
+  if (c->wait_next != NULL) {
+    c->wait_next->wait_prev = c;
+  }
+  *list = c;
+}
+
+/*
+ * wait_remove - this function takes the connection off the resolving,
+ * connecting, following or loading list it is on, if any
+ */
+static void wait_remove(conn *c)
+{
+  if (c->waiting == NULL) {
+    return;
+  }
+  if (c->wait_prev != NULL) {
+    c->wait_prev->wait_next = c->wait_next;
+  }
+  else {
+    *c->waiting = c->wait_next;
+  }
+  if (c->wait_next != NULL) {
+    c->wait_next->wait_prev = c->wait_prev;
+  }
+  c->waiting = NULL;
+}
+
+/*
+ * retry_server - this function is called when the server connection
+ * fails. If it was a kept-alive connection and none of the response has
+ * arrived, the server probably closed it while it was idle, so the
+ * request is sent again on a new connection and 1 is returned.
+ * Otherwise it returns 0 and the caller gives up.
+ */
+static int retry_server(conn *c)
+{
+  if (!c->reused || c->response.size > 0) {
+    return 0;
+  }
+  //closing the socket also removes it from the epoll instance
+  close(c->server.fd);
+  c->server.fd = -1;
+  c->server.registered = 0;
+  connect_server(c);
+  return 1;
+}
+
+/*
+ * start_hit - this function starts sending the cached object c->hit to
+ * the client, framed by its length
+ */
+static void start_hit(conn *c)
+{
+  c->framing = arena_alloc(&c->mem, HTTP_FRAMING_MAX);
+  c->framing_len = hit_framing(c->hit, c->framing, c->keepalive);
+  c->hit_off = 0;
+  c->state = CONN_SEND_HIT;
+  send_hit(c);
+}
+
+/*
+ * send_hit - this function writes as much of the cached object to the
+ * client as it will take, and ends the request once all of it has been
+ * written
+ */
+static void send_hit(conn *c)
+{
+  ssize_t n;
+  while (c->hit_off < c->hit->data_size + c->framing_len) {
+    n = cache_node_send(c->client.fd, c->hit, c->hit_off, c->framing,
+      c->framing_len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN) {
+        set_events(c, &c->client, EPOLLOUT);
+      }
+      else {
+        close_conn(c);
+      }
+      return;
+    }
+    c->hit_off += n;
+  }
+  end_request(c, 1);
+}
+
+/*
+ * send_request - this function writes as much of the compiled request to
+ * the server as it will take. Once all of it has been written, the
+ * connection moves on to relaying the server's response.
+ */
+static void send_request(conn *c)
+{
+  ssize_t n;
+  while (c->request_off < c->request->len) {
+    n = gather_write(c->server.fd, c->request, c->request_off);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && !retry_server(c)) {
+        close_conn(c);
+      }
+      return;
+    }
+    c->request_off += n;
+  }
+  //this buffer holds pieces of the response on their way to the client
+  if (c->out == NULL) {
+    c->out = Malloc(HTTP_RELAY_SIZE);
+  }
+  c->out_len = 0;
+  c->out_off = 0;
+  frame_init(c->frame, c->authorized);
+  c->state = CONN_RELAY;
+  set_events(c, &c->server, EPOLLIN);
+}
+
+/*
+ * relay_read - this function reads the next chunk of the response from
+ * the server and passes it on to the client, once the head is over and
+ * framed as c->frame->out says. When the server is done, the response
+ * is added to the cache and the request ends.
+ */
+static void relay_read(conn *c)
+{
+  char *data = c->out + HTTP_RELAY_ROOM, *piece;
+  ssize_t n;
+  size_t len, body;
+  long long left;
+  int in_head;
+  if (c->out_off < c->out_len || c->piped > 0 || c->resp_done) {
+    //the client hasn't taken the previous chunk yet
+    return;
+  }
+  left = frame_passthrough(c->frame);
+  if (left != 0 && c->frame->out.coding != BODY_CHUNKED &&
+      (c->response.full ||
+      (left < 0 ? c->response.size : c->response.size + left) >
+        c->response.limit) &&
+      (c->flight == NULL || inflight_alone(c->flight)) &&
+      (c->pipefd[0] >= 0 || pipe2(c->pipefd, O_NONBLOCK | O_CLOEXEC) == 0)) {
+    //the body won't be cached and needn't be looked at, so it goes
+    //straight from the server to the client
+    n = splice(c->server.fd, NULL, c->pipefd[1], NULL, (left < 0 ||
+      left > RELAY_SPLICE_CHUNK) ? RELAY_SPLICE_CHUNK : left,
+      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+      frame_skip(c->frame, n);
+      c->resp_done = frame_complete(c->frame, 0);
+      cache_buf_skip(&c->response, n);
+      c->piped = n;
+      relay_write(c);
+      return;
+    }
+  }
+  else {
+    n = read(c->server.fd, data, MAXBUF);
+  }
+  if (n < 0) {
+    if (errno != EINTR && errno != EAGAIN && !retry_server(c)) {
+      close_conn(c);
+    }
+    return;
+  }
+  if (n == 0) {
+    if (retry_server(c)) {
+      return;
+    }
+    if (!frame_complete(c->frame, 1)) {
+      close_conn(c);
+      return;
+    }
+    //the body ended with the connection, which can't be kept. A client
+    //that gets chunks is sent the last one, the others only know the
+    //response is over when their connection closes too
+    c->frame->keepalive = 0;
+    c->resp_done = 1;
+    len = 0;
+    piece = http_out_piece(&c->frame->out, data, &len, NULL, 0, 1);
+    c->out_off = piece - c->out;
+    c->out_len = c->out_off + len;
+    relay_write(c);
+    return;
+  }
+  //only pass on the bytes that belong to the response
+  in_head = (c->frame->state == FRAME_HEAD);
+  len = frame_feed(c->frame, data, n, &body);
+  if (c->frame->state == FRAME_ERROR) {
+    close_conn(c);
+    return;
+  }
+  if (len < n) {
+    c->frame->keepalive = 0; //the server sent more than it should have
+  }
+  c->resp_done = frame_complete(c->frame, 0);
+  if (in_head && c->frame->state != FRAME_HEAD) {
+    //the head is over, it says whether the response may be cached, and
+    //the followers only get it if it may
+    if (!c->frame->cacheable) {
+      cache_buf_drop(&c->response);
+    }
+    cache_buf_append(&c->response, c->frame->head, c->frame->head_len);
+    if (c->flight != NULL) {
+      inflight_append(c->flight, c->frame->head, c->frame->head_len);
+      inflight_share(c->flight, c->frame->cacheable, c->frame->head_len,
+        c->frame->length);
+    }
+  }
+  if (c->frame->state == FRAME_HEAD) {
+    return; //nothing is relayed before the head is over
+  }
+  if (c->stale != NULL && c->frame->status == 304) {
+    //the object hasn't changed, it is sent once the 304 is over
+    if (c->resp_done) {
+      not_modified(c);
+    }
+    return;
+  }
+  //while we're reading response from the server, we need to keep
+  //storing it so that we can cache it
+  cache_buf_append(&c->response, data, body);
+  if (c->flight != NULL) {
+    inflight_append(c->flight, data, body);
+  }
+  piece = http_out_piece(&c->frame->out, data, &body,
+    in_head ? c->frame->head : NULL, c->frame->head_len, c->resp_done);
+  c->out_off = piece - c->out;
+  c->out_len = c->out_off + body;
+  relay_write(c);
+}
+
+/*
+ * relay_write - this function writes the chunk read by relay_read to the
+ * client. If the client can't take all of it, the server isn't read from
+ * until it has.
+ */
+static void relay_write(conn *c)
+{
+  ssize_t n;
+  if (c->client.fd < 0) {
+    //the client is gone, the response is only read for the followers
+    c->out_off = c->out_len;
+  }
+  while (c->out_off < c->out_len) {
+    n = write(c->client.fd, c->out + c->out_off, c->out_len - c->out_off);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN) {
+        set_events(c, &c->server, 0);
+        set_events(c, &c->client, EPOLLOUT);
+      }
+      else {
+        client_lost(c);
+      }
+      return;
+    }
+    c->out_off += n;
+  }
+  while (c->piped > 0) {
+    n = splice(c->pipefd[0], NULL, c->client.fd, NULL, c->piped,
+      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN) {
+        set_events(c, &c->server, 0);
+        set_events(c, &c->client, EPOLLOUT);
+      }
+      else {
+        close_conn(c);
+      }
+      return;
+    }
+    c->piped -= n;
+  }
+  if (c->resp_done) {
+    finish_response(c);
+    return;
+  }
+  if (c->client.fd >= 0) {
+    set_events(c, &c->client, 0);
+  }
+  set_events(c, &c->server, EPOLLIN);
+}
+
+/*
+ * finish_response - this function is called once the whole response has
+ * been written to the client. The response is added to the cache, and
+ * the server connection goes back to the upstream pool if it can be used
+ * again. The fetch ends after the response is in the cache, so that the
+ * url is never missing from both.
+ */
+static void finish_response(conn *c)
+{
+  if (c->frame->cacheable) {
+    add_to_cache(proxy_cache, c->uri, &c->response, c->frame->head_len,
+      c->frame->expires, c->frame->lifetime);
+  }
+  flight_end(c, 1);
+  if (c->frame->keepalive) {
+    //the connection leaves this loop, whoever takes it next registers
+    //it with their own epoll instance
+    epoll_ctl(c->loop->epfd, EPOLL_CTL_DEL, c->server.fd, NULL);
+    upstream_put(c->host, c->port, c->server.fd);
+    c->server.fd = -1;
+  }
+  end_request(c, c->frame->out.coding != BODY_CLOSE);
+}
+
+/*
+ * not_modified - this function is called once the server has answered
+ * the revalidation of the stale object with a 304. The object is fresh
+ * again and is sent to the client as a hit, and the server connection
+ * goes back to the upstream pool if it can be used again.
+ */
+static void not_modified(conn *c)
+{
+  refresh_object(c->stale, c->frame);
+  if (c->frame->keepalive) {
+    epoll_ctl(c->loop->epfd, EPOLL_CTL_DEL, c->server.fd, NULL);
+    upstream_put(c->host, c->port, c->server.fd);
+  }
+  else {
+    //closing the socket also removes it from the epoll instance
+    close(c->server.fd);
+  }
+  c->server.fd = -1;
+  c->server.registered = 0;
+  c->hit = c->stale;
+  c->stale = NULL;
+  start_hit(c);
+}
+
+/*
+ * end_request - this function is called once a response has been written
+ * to the client in full. framed says whether the client could tell where
+ * the response ended. If the client wants to keep the connection and
+ * hasn't used up its requests, the connection is cleaned up and goes back
+ * to reading the next request. Otherwise it is closed.
+ */
+static void end_request(conn *c, int framed)
+{
+  c->nrequests += 1;
+  if (!c->keepalive || !framed || c->nrequests >= client_max_requests ||
+      c->client.fd < 0) {
+    close_conn(c);
+    return;
+  }
+  if (c->server.fd >= 0) {
+    //closing the socket also removes it from the epoll instance
+    close(c->server.fd);
+    c->server.fd = -1;
+  }
+  c->server.registered = 0;
+  c->server.events = 0;
+  if (c->hit != NULL) {
+    release_cache_node(c->hit);
+    c->hit = NULL;
+  }
+  if (c->stale != NULL) {
+    release_cache_node(c->stale);
+    c->stale = NULL;
+  }
+  //an idle connection keeps no chunk, there may be many of them
+  arena_free(&c->mem);
+  Free(c->addrs);
+  Free(c->race);
+  cache_buf_drop(&c->response);
+  c->addrs = NULL;
+  c->race = NULL;
+  c->uri = c->host = c->path = NULL;
+  c->request = NULL;
+  c->frame = NULL;
+  c->reused = 0;
+  c->resp_done = 0;
+  c->out_len = c->out_off = 0;
+  //the request is over, the next one may already be behind it
+  next_request(c, c->head_len);
+  c->state = CONN_READ_REQUEST;
+  idle_add(c);
+  set_events(c, &c->client, EPOLLIN);
+  read_request(c);
+}
+
+/*
+ * idle_add - this function puts the connection at the end of its loop's
+ * idle list, it starts waiting for a request now
+ */
+static void idle_add(conn *c)
+{
+  struct event_loop *loop = c->loop;
+  c->idle = 1;
+  c->idle_since = time(NULL);
+  c->idle_next = NULL;
+  c->idle_prev = loop->idle_tail;
+  if (loop->idle_tail != NULL) {
+    loop->idle_tail->idle_next = c;
+  }
+  else {
+    loop->idle_head = c;
+  }
+  loop->idle_tail = c;
+}
+
+/*
+ * idle_remove - this function takes the connection off its loop's idle
+ * list, if it is on it
+ */
+static void idle_remove(conn *c)
+{
+  struct event_loop *loop = c->loop;
+  if (!c->idle) {
+    return;
+  }
+  c->idle = 0;
+  if (c->idle_prev != NULL) {
+    c->idle_prev->idle_next = c->idle_next;
+  }
+  else {
+    loop->idle_head = c->idle_next;
+  }
+  if (c->idle_next != NULL) {
+    c->idle_next->idle_prev = c->idle_prev;
+  }
+  else {
+    loop->idle_tail = c->idle_prev;
+  }
+}
+
+/*
+ * expire_idle - this function closes the connections that have waited
+ * too long for a request. The oldest ones are at the start of the list.
+ */
+static void expire_idle(struct event_loop *loop)
+{
+  time_t now = time(NULL);
+  while (loop->idle_head != NULL &&
+      now - loop->idle_head->idle_since >= client_idle_timeout) {
+    close_conn(loop->idle_head);
+  }
+}
+
+/*
+ * send_error - this function starts sending an error message to the
+ * client, like clienterror does, and closes the connection afterwards
+ */
+static void send_error(conn *c, char *cause, char *errnum,
+	char *shortmsg, char *longmsg)
+{
+  gather g;
+  build_clienterror(&g, cause, errnum, shortmsg, longmsg);
+  //the pieces may not stay put until all of it has been written
+  Free(c->out);
+  c->out = Malloc(g.len);
+  c->out_len = gather_flatten(&g, c->out);
+  c->out_off = 0;
+  c->state = CONN_SEND_ERROR;
+  send_out(c);
+}
+
+/*
+ * send_out - this function writes as much of the error message to the
+ * client as it will take, and closes the connection once it's all out
+ */
+static void send_out(conn *c)
+{
+  ssize_t n;
+  while (c->out_off < c->out_len) {
+    n = write(c->client.fd, c->out + c->out_off, c->out_len - c->out_off);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN) {
+        set_events(c, &c->client, EPOLLOUT);
+      }
+      else {
+        close_conn(c);
+      }
+      return;
+    }
+    c->out_off += n;
+  }
+  close_conn(c);
+}
+
+/*
+ * client_lost - this function is called when the client can't be written
+ * to any more. The connection is closed, unless it is relaying a fetch
+ * that others follow, in which case only the client's socket is closed
+ * and the response is still read to the end for them.
+ */
+static void client_lost(conn *c)
+{
+  if (c->state != CONN_RELAY || c->flight == NULL ||
+      inflight_alone(c->flight)) {
+    close_conn(c);
+    return;
+  }
+  //closing the socket also removes it from the epoll instance
+  close(c->client.fd);
+  c->client.fd = -1;
+  c->client.registered = 0;
+  relay_write(c); //drops what the client didn't take, and reads on
+}
+
+/*
+ * close_conn - this function closes both sockets of the connection and
+ * queues it to be freed at the end of the current batch of events
+ */
+static void close_conn(conn *c)
+{
+  if (c->state == CONN_CLOSED) {
+    return;
+  }
+  idle_remove(c);
+  wait_remove(c);
+  if (c->load != NULL) {
+    cache_load_cancel(proxy_cache, c->load);
+  }
+  if (c->race != NULL) {
+    race_cancel(c->race);
+  }
+  //the followers of a fetch this connection led see it fail
+  flight_end(c, 0);
+  c->state = CONN_CLOSED;
+  //closing a socket also removes it from the epoll instance
+  if (c->client.fd >= 0) {
+    close(c->client.fd);
+  }
+  if (c->server.fd >= 0) {
+    close(c->server.fd);
+  }
+  c->next_dead = c->loop->dead;
+  c->loop->dead = c;
+}
+
+/*
+ * free_conn - this function frees a closed connection and drops its
+ * reference to the cached object it was sending, if any
+ */
+static void free_conn(conn *c)
+{
+  if (c->hit != NULL) {
+    release_cache_node(c->hit);
+  }
+  if (c->stale != NULL) {
+    release_cache_node(c->stale);
+  }
+  Free(c->in);
+  arena_free(&c->mem);
+  Free(c->addrs);
+  Free(c->race);
+  if (c->pipefd[0] >= 0) {
+    close(c->pipefd[0]);
+    close(c->pipefd[1]);
+  }
+  Free(c->out);
+  cache_buf_drop(&c->response);
+  Free(c);
+}
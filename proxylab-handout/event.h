@@ -0,0 +1,9 @@
+/*
+ * event.h - epoll based I/O core of the proxy
+ */
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+void event_run(int *listenfds, int nlisteners, int nthreads, int pin);
+
+#endif /* __EVENT_H__ */
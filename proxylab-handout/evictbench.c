@@ -0,0 +1,258 @@
+/*
+ * evictbench.c - compares the LRU and CLOCK eviction policies on a
+ * Zipf-distributed trace of requests
+ *
+ * A trace of requests for a catalog of urls is generated, where the url
+ * of rank k is asked for with a probability proportional to 1/k^alpha.
+ * For each policy, the trace is replayed through a cache that holds a
+ * tenth of the catalog, caching every miss like the proxy does. The hit
+ * ratio comes from one thread replaying the trace once, after a warm-up
+ * that is not counted. The throughput is then measured with 1 thread and
+ * with several, each replaying the trace from its own place for about a
+ * second of wall time. Under LRU every hit relinks its node and takes the
+ * shard's lock for writing, under CLOCK hits share the lock.
+ *
+ * usage: ./evictbench [seconds] [threads] [catalog] [alpha]
+ */
+
+#include "cache.h"
+#include <math.h>
+
+/* Bytes of data in each object */
+#define BENCH_OBJECT 64
+
+/* Requests in the trace, per url of the catalog */
+#define BENCH_TRACE_FACTOR 10
+
+/* Share of the trace that warms the cache up before hits are counted,
+   in percent */
+#define BENCH_WARMUP_PERCENT 10
+
+/* Requests made between two looks at the stop flag */
+#define BENCH_BATCH 1000
+
+/* Most threads a run uses */
+#define BENCH_MAX_THREADS 64
+
+struct bench{
+  cache *c_cache;
+  char **urls; //the catalog, by rank
+  unsigned int *trace; //ranks of the urls requested, in order
+  size_t ntrace;
+  pthread_barrier_t start; //every thread begins at once
+  int stop; //set once the time is up, atomic
+  long count; //requests made by the threads, atomic
+};
+
+static char data[BENCH_OBJECT];
+
+static double wall_seconds(void);
+static char **make_urls(size_t n);
+static unsigned int *make_trace(size_t n, double alpha, size_t ntrace);
+static size_t object_charge(char *url);
+static int request(cache *c_cache, char *url);
+static double hit_ratio(struct bench *b);
+static double run(struct bench *b, int nthreads, double seconds);
+static void *replay_thread(void *vargp);
+
+/*
+ * main - this function prints the hit ratio and the throughput of each
+ * policy on the same trace
+ */
+int main(int argc, char **argv)
+{
+  double seconds = (argc > 1) ? atof(argv[1]) : 1.0;
+  int nthreads = (argc > 2) ? atoi(argv[2]) : 8;
+  size_t n = (argc > 3) ? strtoul(argv[3], NULL, 10) : 100000;
+  double alpha = (argc > 4) ? atof(argv[4]) : 0.99;
+  static const int policies[] = {CACHE_LRU, CACHE_CLOCK};
+  struct bench b;
+  size_t i, budget;
+  if (n < 10 || nthreads < 1 || nthreads > BENCH_MAX_THREADS) {
+    fprintf(stderr, "usage: %s [seconds] [threads] [catalog] [alpha]\n",
+      argv[0]);
+    exit(1);
+  }
+  b.urls = make_urls(n);
+  b.ntrace = n * BENCH_TRACE_FACTOR;
+  b.trace = make_trace(n, alpha, b.ntrace);
+  budget = n / 10 * object_charge(b.urls[0]);
+  printf("catalog %zu, alpha %.2f, cache of %zu objects\n", n, alpha,
+    n / 10);
+  printf("%-6s %9s %14s %14s\n", "policy", "hit ratio", "1 thread/s",
+    "threads/s");
+  for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+    double ratio, elapsed, one, many;
+    b.c_cache = initialize_cache(CACHE_DEFAULT_SHARDS, policies[i],
+      CACHE_ADMIT_ALL, budget, MAX_OBJECT_SIZE, NULL);
+    ratio = hit_ratio(&b);
+    elapsed = run(&b, 1, seconds);
+    one = b.count / elapsed;
+    elapsed = run(&b, nthreads, seconds);
+    many = b.count / elapsed;
+    printf("%-6s %9.4f %14.0f %14.0f\n",
+      (policies[i] == CACHE_CLOCK) ? "clock" : "lru", ratio, one, many);
+    fflush(stdout);
+  }
+  return 0;
+}
+
+/*
+ * wall_seconds - this function returns the time on a clock that only
+ * goes forward, the threads sharing the cores being what is measured
+ */
+static double wall_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * make_urls - this function returns n urls that differ by a number
+ */
+static char **make_urls(size_t n)
+{
+  char **urls = Malloc(n * sizeof(char *));
+  char url[MAXLINE];
+  size_t i;
+  for (i = 0; i < n; i++) {
+    snprintf(url, sizeof(url), "http://bench.example.com/objects/%zu", i);
+    urls[i] = Malloc(strlen(url) + 1);
+    strcpy(urls[i], url);
+  }
+  return urls;
+}
+
+/*
+ * make_trace - this function returns ntrace ranks drawn from a Zipf
+ * distribution of exponent alpha over n urls. The same arguments always
+ * give the same trace.
+ */
+static unsigned int *make_trace(size_t n, double alpha, size_t ntrace)
+{
+  double *cdf = Malloc(n * sizeof(double)), sum = 0;
+  unsigned int *trace = Malloc(ntrace * sizeof(unsigned int));
+  unsigned short seed[3] = {1, 2, 3};
+  size_t i;
+  for (i = 0; i < n; i++) {
+    sum += 1.0 / pow(i + 1, alpha);
+    cdf[i] = sum;
+  }
+  for (i = 0; i < ntrace; i++) {
+    //the first rank whose cumulative weight reaches the draw
+    double x = erand48(seed) * sum;
+    size_t lo = 0, hi = n - 1;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (cdf[mid] < x) {
+        lo = mid + 1;
+      }
+      else {
+        hi = mid;
+      }
+    }
+    trace[i] = lo;
+  }
+  Free(cdf);
+  return trace;
+}
+
+/*
+ * object_charge - this function returns the bytes one object of the
+ * bench, cached for url, is charged in a cache
+ */
+static size_t object_charge(char *url)
+{
+  cache *c_cache = initialize_cache(1, CACHE_LRU, CACHE_ADMIT_ALL,
+    MAX_CACHE_SIZE, MAX_OBJECT_SIZE, NULL);
+  size_t nobjects;
+  request(c_cache, url);
+  return cache_used(c_cache, &nobjects);
+}
+
+/*
+ * request - this function asks the cache for url, and caches an object
+ * for it if it missed. It returns 1 on a hit and 0 on a miss.
+ */
+static int request(cache *c_cache, char *url)
+{
+  cache_node *p = check_for_hit(c_cache, url);
+  cache_buf buf;
+  if (p != NULL) {
+    release_cache_node(p);
+    return 1;
+  }
+  cache_buf_init(&buf, c_cache);
+  cache_buf_append(&buf, data, sizeof(data));
+  add_to_cache(c_cache, url, &buf, 0, 0, 0);
+  return 0;
+}
+
+/*
+ * hit_ratio - this function replays the trace once and returns the share
+ * of the requests after the warm-up that hit
+ */
+static double hit_ratio(struct bench *b)
+{
+  size_t warmup = b->ntrace / 100 * BENCH_WARMUP_PERCENT, i, hits = 0;
+  for (i = 0; i < b->ntrace; i++) {
+    int hit = request(b->c_cache, b->urls[b->trace[i]]);
+    if (i >= warmup) {
+      hits += hit;
+    }
+  }
+  return (double)hits / (b->ntrace - warmup);
+}
+
+/*
+ * run - this function has nthreads threads replay the trace for about
+ * seconds, stores how many requests they made in b->count and returns how
+ * long they took
+ */
+static double run(struct bench *b, int nthreads, double seconds)
+{
+  pthread_t tids[BENCH_MAX_THREADS];
+  double start;
+  int i;
+  b->stop = 0;
+  b->count = 0;
+  pthread_barrier_init(&b->start, NULL, nthreads + 1);
+  for (i = 0; i < nthreads; i++) {
+    Pthread_create(&tids[i], NULL, replay_thread, b);
+  }
+  pthread_barrier_wait(&b->start);
+  start = wall_seconds();
+  usleep(seconds * 1e6);
+  __atomic_store_n(&b->stop, 1, __ATOMIC_RELAXED);
+  for (i = 0; i < nthreads; i++) {
+    Pthread_join(tids[i], NULL);
+  }
+  pthread_barrier_destroy(&b->start);
+  return wall_seconds() - start;
+}
+
+/*
+ * replay_thread - this is the body of a thread of a run, which replays
+ * the trace from a random place until the run's stop flag is set
+ */
+static void *replay_thread(void *vargp)
+{
+  struct bench *b = vargp;
+  unsigned int seed = (unsigned int)(size_t)pthread_self();
+  size_t next = rand_r(&seed) % b->ntrace;
+  long done = 0;
+  int i;
+  pthread_barrier_wait(&b->start);
+  while (!__atomic_load_n(&b->stop, __ATOMIC_RELAXED)) {
+    for (i = 0; i < BENCH_BATCH; i++) {
+      request(b->c_cache, b->urls[b->trace[next]]);
+      if (++next == b->ntrace) {
+        next = 0;
+      }
+    }
+    done += i;
+  }
+  __atomic_add_fetch(&b->count, done, __ATOMIC_RELAXED);
+  return NULL;
+}
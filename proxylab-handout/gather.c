@@ -0,0 +1,122 @@
+/*
+ * gather.c - messages assembled as lists of pieces of memory
+ *
+ * The proxy writes requests to servers and error pages to clients that
+ * are mostly made of strings it already has: constant headers, and the
+ * parts of the client's request where they were read. Rather than copy
+ * them together into one buffer, a gather lists where each piece is, and
+ * the list is written with one writev. The few bytes that have to be
+ * formatted, like a length, are copied into the gather itself.
+ *
+ * The pieces aren't consumed as they are written, so a message can be
+ * written again from the start, as a request is when a kept-alive
+ * connection turns out to be closed.
+ */
+
+#include "gather.h"
+
+/*
+ * gather_init - this function gets g ready for a new message
+ */
+void gather_init(gather *g)
+{
+  g->n = 0;
+  g->len = 0;
+  g->buf_len = 0;
+}
+
+/*
+ * gather_add - this function appends the len bytes at p to the message.
+ * They are not copied, and must stay where they are until the message
+ * has been written.
+ */
+void gather_add(gather *g, const void *p, size_t len)
+{
+  if (len == 0) {
+    return;
+  }
+  if (g->n == GATHER_MAX_PIECES) {
+    app_error("gather: too many pieces");
+  }
+  g->iov[g->n].iov_base = (void *)p;
+  g->iov[g->n].iov_len = len;
+  g->n++;
+  g->len += len;
+}
+
+/*
+ * gather_add_copy - this function appends a copy of the len bytes at p
+ * to the message, for bytes that won't stay where they are
+ */
+void gather_add_copy(gather *g, const void *p, size_t len)
+{
+  if (len > GATHER_BUF_SIZE - g->buf_len) {
+    app_error("gather: out of room for copies");
+  }
+  memcpy(g->buf + g->buf_len, p, len);
+  gather_add(g, g->buf + g->buf_len, len);
+  g->buf_len += len;
+}
+
+/*
+ * gather_write - this function writes the message to fd, from its byte
+ * off on, with one writev. It returns how many bytes were written, or -1
+ * with errno set, like writev.
+ */
+ssize_t gather_write(int fd, gather *g, size_t off)
+{
+  struct iovec rest[GATHER_MAX_PIECES];
+  int i = 0, n = 0;
+  if (off == 0) {
+    return writev(fd, g->iov, g->n);
+  }
+  //the pieces are left alone, the ones still to be written are copied
+  while (i < g->n && off >= g->iov[i].iov_len) {
+    off -= g->iov[i++].iov_len;
+  }
+  for (; i < g->n; i++) {
+    rest[n] = g->iov[i];
+    if (n == 0) {
+      rest[0].iov_base = (char *)rest[0].iov_base + off;
+      rest[0].iov_len -= off;
+    }
+    n++;
+  }
+  return writev(fd, rest, n);
+}
+
+/*
+ * gather_writen - this function writes the whole message to the blocking
+ * descriptor fd. It returns 0 on success and -1 on error.
+ */
+int gather_writen(int fd, gather *g)
+{
+  size_t off = 0;
+  ssize_t n;
+  while (off < g->len) {
+    if ((n = gather_write(fd, g, off)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    off += n;
+  }
+  return 0;
+}
+
+/*
+ * gather_flatten - this function copies the message into buf, which must
+ * hold g->len bytes, for when it has to outlive its pieces. It returns
+ * its length.
+ */
+size_t gather_flatten(gather *g, char *buf)
+{
+  size_t off = 0;
+  int i;
+  for (i = 0; i < g->n; i++) {
+    memcpy(buf + off, g->iov[i].iov_base, g->iov[i].iov_len);
+    off += g->iov[i].iov_len;
+  }
+  return off;
+}
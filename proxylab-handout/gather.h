@@ -0,0 +1,37 @@
+/*
+ * gather.h - messages assembled as lists of pieces of memory, written
+ * with one writev instead of being copied together first
+ */
+#ifndef __GATHER_H__
+#define __GATHER_H__
+
+#include "csapp.h"
+#include "request.h"
+#include <sys/uio.h>
+
+/* Most pieces a message has, enough for a request to a server: a few for
+   the request line and the headers the proxy sends itself, four for each
+   header of the client's request, and its validators */
+#define GATHER_MAX_PIECES (4 * REQUEST_MAX_HEADERS + 16)
+
+/* Bytes the pieces that have to be formatted can take up in all */
+#define GATHER_BUF_SIZE MAXLINE
+
+struct gather{
+  struct iovec iov[GATHER_MAX_PIECES];
+  int n; //pieces in iov
+  size_t len; //bytes in all the pieces
+  size_t buf_len; //bytes of buf taken by pieces
+  char buf[GATHER_BUF_SIZE]; //pieces that aren't kept anywhere else
+};
+
+typedef struct gather gather;
+
+void gather_init(gather *g);
+void gather_add(gather *g, const void *p, size_t len);
+void gather_add_copy(gather *g, const void *p, size_t len);
+ssize_t gather_write(int fd, gather *g, size_t off);
+int gather_writen(int fd, gather *g);
+size_t gather_flatten(gather *g, char *buf);
+
+#endif /* __GATHER_H__ */
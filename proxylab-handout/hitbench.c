@@ -0,0 +1,184 @@
+/*
+ * hitbench.c - measures how many cache hits per second threads get
+ * through together, from 1 thread to 64
+ *
+ * A cache is filled with small objects, then every thread looks up urls
+ * picked at random among them, all of which hit, for about a second of
+ * wall time. This is done for each number of threads and with 1 shard,
+ * the default number of shards and many shards, with the LRU policy where
+ * every hit takes its shard's lock for writing. With a single shard the
+ * threads queue up on the one lock, with more shards the rate should go
+ * up with the threads until the machine runs out of cores.
+ *
+ * usage: ./hitbench [seconds] [objects]
+ */
+
+#include "cache.h"
+
+/* Bytes of data in each object */
+#define BENCH_OBJECT 64
+
+/* Lookups made between two looks at the stop flag */
+#define BENCH_BATCH 1000
+
+/* Most threads a run uses */
+#define BENCH_MAX_THREADS 64
+
+static const unsigned int shard_counts[] = {1, CACHE_DEFAULT_SHARDS, 64};
+
+struct bench{
+  cache *c_cache;
+  char **urls;
+  size_t n; //number of urls, all of them cached
+  pthread_barrier_t start; //every thread begins at once
+  int stop; //set once the time is up, atomic
+  long count; //lookups made by the threads, atomic
+};
+
+static volatile size_t sink; //keeps the lookups from being optimized out
+
+static double wall_seconds(void);
+static char **make_urls(size_t n);
+static cache *fill(unsigned int nshards, char **urls, size_t n);
+static double run(struct bench *b, int nthreads, double seconds);
+static void *hit_thread(void *vargp);
+
+/*
+ * main - this function prints the hits per second of every number of
+ * threads, for each number of shards
+ */
+int main(int argc, char **argv)
+{
+  double seconds = (argc > 1) ? atof(argv[1]) : 1.0;
+  struct bench b;
+  size_t i;
+  int nthreads;
+  b.n = (argc > 2) ? strtoul(argv[2], NULL, 10) : 10000;
+  if (b.n < 1) {
+    fprintf(stderr, "usage: %s [seconds] [objects]\n", argv[0]);
+    exit(1);
+  }
+  b.urls = make_urls(b.n);
+  printf("%6s %7s %14s\n", "shards", "threads", "hits/s");
+  for (i = 0; i < sizeof(shard_counts) / sizeof(shard_counts[0]); i++) {
+    b.c_cache = fill(shard_counts[i], b.urls, b.n);
+    for (nthreads = 1; nthreads <= BENCH_MAX_THREADS; nthreads *= 2) {
+      double elapsed = run(&b, nthreads, seconds);
+      printf("%6u %7d %14.0f\n", shard_counts[i], nthreads,
+        b.count / elapsed);
+      fflush(stdout);
+    }
+  }
+  return 0;
+}
+
+/*
+ * wall_seconds - this function returns the time on a clock that only
+ * goes forward, the threads sharing the cores being what is measured
+ */
+static double wall_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * make_urls - this function returns n urls that differ by a number
+ */
+static char **make_urls(size_t n)
+{
+  char **urls = Malloc(n * sizeof(char *));
+  char url[MAXLINE];
+  size_t i;
+  for (i = 0; i < n; i++) {
+    snprintf(url, sizeof(url), "http://bench.example.com/objects/%zu", i);
+    urls[i] = Malloc(strlen(url) + 1);
+    strcpy(urls[i], url);
+  }
+  return urls;
+}
+
+/*
+ * fill - this function returns a new LRU cache of nshards shards holding
+ * the n urls, with room for all of them. It exits if some didn't make it
+ * in.
+ */
+static cache *fill(unsigned int nshards, char **urls, size_t n)
+{
+  static char data[BENCH_OBJECT];
+  //the shards get equal shares of the budget but not equal numbers of
+  //urls, so each is given room for all of them
+  cache *c_cache = initialize_cache(nshards, CACHE_LRU, CACHE_ADMIT_ALL,
+    (n + 64) * 1024 * nshards, MAX_OBJECT_SIZE, NULL);
+  cache_buf b;
+  size_t i, nobjects;
+  for (i = 0; i < n; i++) {
+    cache_buf_init(&b, c_cache);
+    cache_buf_append(&b, data, sizeof(data));
+    add_to_cache(c_cache, urls[i], &b, 0, 0, 0);
+  }
+  cache_used(c_cache, &nobjects);
+  if (nobjects != n) {
+    fprintf(stderr, "only %zu of %zu objects were cached\n", nobjects, n);
+    exit(1);
+  }
+  return c_cache;
+}
+
+/*
+ * run - this function has nthreads threads look up urls for about
+ * seconds, stores how many lookups they made in b->count and returns how
+ * long they took
+ */
+static double run(struct bench *b, int nthreads, double seconds)
+{
+  pthread_t tids[BENCH_MAX_THREADS];
+  double start;
+  int i;
+  b->stop = 0;
+  b->count = 0;
+  pthread_barrier_init(&b->start, NULL, nthreads + 1);
+  for (i = 0; i < nthreads; i++) {
+    Pthread_create(&tids[i], NULL, hit_thread, b);
+  }
+  pthread_barrier_wait(&b->start);
+  start = wall_seconds();
+  usleep(seconds * 1e6);
+  __atomic_store_n(&b->stop, 1, __ATOMIC_RELAXED);
+  for (i = 0; i < nthreads; i++) {
+    Pthread_join(tids[i], NULL);
+  }
+  pthread_barrier_destroy(&b->start);
+  return wall_seconds() - start;
+}
+
+/*
+ * hit_thread - this is the body of a thread of a run, which looks up
+ * random urls until the run's stop flag is set
+ */
+static void *hit_thread(void *vargp)
+{
+  struct bench *b = vargp;
+  unsigned int seed = (unsigned int)(size_t)pthread_self();
+  long done = 0;
+  size_t bytes = 0;
+  int i;
+  pthread_barrier_wait(&b->start);
+  while (!__atomic_load_n(&b->stop, __ATOMIC_RELAXED)) {
+    for (i = 0; i < BENCH_BATCH; i++) {
+      char *url = b->urls[rand_r(&seed) % b->n];
+      cache_node *p = check_for_hit(b->c_cache, url);
+      if (p == NULL) {
+        fprintf(stderr, "lookup missed\n");
+        exit(1);
+      }
+      bytes += p->data_size;
+      release_cache_node(p);
+    }
+    done += i;
+  }
+  sink += bytes;
+  __atomic_add_fetch(&b->count, done, __ATOMIC_RELAXED);
+  return NULL;
+}
@@ -0,0 +1,802 @@
+/*
+ * http.c - framing of HTTP/1.x responses
+ *
+ * Once the proxy keeps connections to servers open, it can no longer
+ * wait for the server to close in order to know that a response is
+ * over. frame_feed looks at the response as it is read, in pieces of any
+ * size, and works out where it ends from its head, as RFC 9112 section
+ * 6.3 says:
+ *   - 1xx (except 101), 204 and 304 responses have no body
+ *   - a chunked body ends with the zero-size chunk and its trailer
+ *   - otherwise a Content-Length body ends after that many bytes
+ *   - otherwise the body ends when the server closes the connection
+ * The connection can only be used for another request if the response
+ * was framed by length or chunks and the server didn't ask to close it.
+ *
+ * Lines (the head, chunk sizes and trailers) are collected in f->line,
+ * so they may be split across reads. Anything that can't be framed, like
+ * a line longer than MAXLINE or a malformed chunk size, is an error that
+ * fails the fetch.
+ *
+ * The proxy speaks HTTP/1.1 to servers, whatever its clients speak, so
+ * what it relays is not what the server sent. The frame keeps the head
+ * in f->head as it goes to clients: an HTTP/1.1 status line and the
+ * end-to-end headers, without the hop-by-hop ones (RFC 9110 section
+ * 7.6.1) and without Content-Length, and frame_feed takes the chunked
+ * coding off the body. That is also what is cached and what followers
+ * of the fetch get. Each client then has the response framed for it by
+ * an http_out: Content-Length if the length is known, the chunked
+ * coding for HTTP/1.1 clients otherwise, and closing the connection for
+ * HTTP/1.0 ones, with a Connection header of the proxy's own.
+ *
+ * The head is also where a response says whether it may be cached and
+ * for how long, so the frame keeps what matters for that as the header
+ * lines go by, and works it out once the head is over, as RFC 9111 does
+ * for a shared cache:
+ *   - no-store, private, Set-Cookie and Vary on anything but the headers
+ *     the proxy always sends itself keep a response out of the cache
+ *   - s-maxage, then max-age, then Expires minus Date say how long it is
+ *     fresh for, counted from the Date it was sent (Age is taken off)
+ *   - otherwise a tenth of the time since Last-Modified is guessed, at
+ *     most HTTP_MAX_HEURISTIC, or http_default_ttl if there is none,
+ *     but only for the status codes that may be cached by default
+ *   - no-cache responses are cached, but are stale at once
+ *   - responses to requests with Authorization are only cached if they
+ *     say public, must-revalidate or s-maxage (section 3.5)
+ * Stale objects are revalidated with the If-None-Match and
+ * If-Modified-Since headers that http_validators makes from their head.
+ */
+
+#define _GNU_SOURCE
+#include "http.h"
+#include "scan.h"
+
+static void frame_line(http_frame *f);
+static void frame_header(http_frame *f);
+static void frame_end_head(http_frame *f);
+static void frame_give_up(http_frame *f);
+static void frame_head_add(http_frame *f, const char *p, size_t len);
+static int frame_hop_by_hop(const char *name, size_t len);
+static void frame_options(http_frame *f, char *value);
+static void frame_strip_options(http_frame *f);
+static int option_is(const char *options, const char *name, size_t len);
+static void frame_cache_control(http_frame *f, char *value);
+static void frame_vary(http_frame *f, char *value);
+static void frame_freshness(http_frame *f);
+static time_t parse_date(char *s);
+static int name_is(const char *name, size_t len, const char *want);
+
+int http_default_ttl = HTTP_DEFAULT_TTL;
+
+/*
+ * frame_init - this function gets f ready for a new response, to a
+ * request that carried Authorization if authorized is set. f->out, the
+ * client the response goes to, is left as it is.
+ */
+void frame_init(http_frame *f, int authorized)
+{
+  f->state = FRAME_HEAD;
+  f->status = 0;
+  f->keepalive = 0;
+  f->chunked = 0;
+  f->length = -1;
+  f->remaining = 0;
+  f->head_len = 0;
+  f->options_len = 0;
+  f->line_len = 0;
+  f->no_store = f->no_cache = f->validator = 0;
+  f->authorized = authorized;
+  f->shared = 0;
+  f->max_age = f->s_maxage = -1;
+  f->age = 0;
+  f->date = f->expires_at = f->last_modified = -1;
+  f->cacheable = f->explicit_fresh = 0;
+  f->lifetime = 0;
+  f->expires = 0;
+}
+
+/*
+ * frame_feed - this function passes the next len bytes of the response
+ * in buf through the frame. It returns how many of them belong to the
+ * response, which is less than len only if the response ended inside buf
+ * or can't be relayed. The head goes to f->head, and the bytes of body
+ * among them, without the chunked coding, are moved to the start of buf
+ * and their number is stored at *body.
+ */
+size_t frame_feed(http_frame *f, char *buf, size_t len, size_t *body)
+{
+  size_t off = 0, out = 0;
+  while (off < len && f->state != FRAME_DONE && f->state != FRAME_ERROR) {
+    size_t n = len - off;
+    if (f->state == FRAME_LENGTH || f->state == FRAME_CHUNK_DATA ||
+        f->state == FRAME_UNTIL_EOF) {
+      if (f->state != FRAME_UNTIL_EOF && (long long)n > f->remaining) {
+        n = f->remaining;
+      }
+      if (out != off) {
+        memmove(buf + out, buf + off, n);
+      }
+      out += n;
+      off += n;
+      if (f->state == FRAME_UNTIL_EOF) {
+        continue;
+      }
+      f->remaining -= n;
+      if (f->remaining == 0) {
+        f->state = (f->state == FRAME_LENGTH) ? FRAME_DONE : FRAME_CHUNK_END;
+      }
+      continue;
+    }
+    //every other state reads lines
+    char *eol = memchr(buf + off, '\n', n);
+    if (eol != NULL) {
+      n = eol - (buf + off) + 1;
+    }
+    if (f->line_len + n > MAXLINE - 1) {
+      frame_give_up(f);
+      continue;
+    }
+    memcpy(f->line + f->line_len, buf + off, n);
+    f->line_len += n;
+    off += n;
+    if (eol != NULL) {
+      f->line[f->line_len] = '\0';
+      frame_line(f);
+      f->line_len = 0;
+    }
+  }
+  *body = out;
+  return off;
+}
+
+/*
+ * frame_complete - this function returns whether the whole response has
+ * been seen, given whether the server has closed the connection (eof)
+ */
+int frame_complete(http_frame *f, int eof)
+{
+  return f->state == FRAME_DONE || (eof && f->state == FRAME_UNTIL_EOF);
+}
+
+/*
+ * frame_passthrough - this function returns how many of the next bytes
+ * of the response are body that frame_feed doesn't need to look at, so
+ * that callers may relay them without reading them (with splice, say).
+ * It returns -1 if that goes for everything up to end of file, and 0 if
+ * the next bytes must go through frame_feed.
+ */
+long long frame_passthrough(http_frame *f)
+{
+  if (f->state == FRAME_LENGTH) {
+    return f->remaining;
+  }
+  return f->state == FRAME_UNTIL_EOF ? -1 : 0;
+}
+
+/*
+ * frame_skip - this function accounts for len bytes of the response that
+ * were relayed without going through frame_feed. len must not be more
+ * than frame_passthrough allowed.
+ */
+void frame_skip(http_frame *f, size_t len)
+{
+  if (f->state == FRAME_LENGTH) {
+    f->remaining -= len;
+    if (f->remaining == 0) {
+      f->state = FRAME_DONE;
+    }
+  }
+}
+
+/*
+ * frame_line - this function handles one complete line in f->line
+ */
+static void frame_line(http_frame *f)
+{
+  int major, minor;
+  char *p;
+  //strip the line ending, both CRLF and a bare LF are accepted
+  while (f->line_len > 0 && (f->line[f->line_len - 1] == '\n' ||
+      f->line[f->line_len - 1] == '\r')) {
+    f->line[--f->line_len] = '\0';
+  }
+  switch (f->state) {
+  case FRAME_HEAD:
+    if (f->status == 0) { //the status line
+      if (sscanf(f->line, "HTTP/%d.%d %d", &major, &minor, &f->status) != 3) {
+        frame_give_up(f);
+        return;
+      }
+      //HTTP/1.1 connections are persistent unless they say otherwise
+      f->keepalive = (major == 1 && minor >= 1);
+      //the response is relayed as HTTP/1.1, which the proxy speaks
+      p = f->line + strcspn(f->line, " \t");
+      frame_head_add(f, "HTTP/1.1", 8);
+      frame_head_add(f, p, f->line + f->line_len - p);
+      frame_head_add(f, "\r\n", 2);
+    }
+    else if (f->line_len == 0) {
+      frame_end_head(f);
+    }
+    else {
+      frame_header(f);
+    }
+    break;
+  case FRAME_CHUNK_SIZE:
+    //chunk extensions after the size are ignored
+    f->remaining = strtoll(f->line, &p, 16);
+    if (p == f->line || f->remaining < 0) {
+      frame_give_up(f);
+    }
+    else {
+      f->state = (f->remaining == 0) ? FRAME_TRAILER : FRAME_CHUNK_DATA;
+    }
+    break;
+  case FRAME_CHUNK_END:
+    f->state = FRAME_CHUNK_SIZE;
+    break;
+  case FRAME_TRAILER:
+    if (f->line_len == 0) {
+      f->state = FRAME_DONE;
+    }
+    break;
+  }
+}
+
+/*
+ * frame_header - this function takes in the header line in f->line. Only
+ * the headers that say how the response is framed or cached matter, the
+ * others are passed over once their name is found. The end-to-end ones
+ * go to f->head.
+ */
+static void frame_header(http_frame *f)
+{
+  char *end = f->line + f->line_len;
+  char *value = (char *)scan_token(f->line, end);
+  size_t len = value - f->line;
+  char *p;
+  if (value == f->line) {
+    //a folded line, RFC 9112 section 5.2 has proxies reject those
+    frame_give_up(f);
+    return;
+  }
+  if (value == end || *value != ':') {
+    return;
+  }
+  if (!frame_hop_by_hop(f->line, len)) {
+    frame_head_add(f, f->line, f->line_len);
+    frame_head_add(f, "\r\n", 2);
+  }
+  value++;
+  if (name_is(f->line, len, "Content-Length")) {
+    f->length = strtoll(value, &p, 10);
+    if (p == value || f->length < 0) {
+      frame_give_up(f);
+    }
+  }
+  else if (name_is(f->line, len, "Transfer-Encoding")) {
+    //the body can only be decoded if chunked is the one coding
+    value += strspn(value, " \t");
+    p = (char *)scan_token(value, end);
+    f->chunked = (p - value == 7 && strncasecmp(value, "chunked", 7) == 0 &&
+      p + strspn(p, " \t") == end);
+    if (!f->chunked) {
+      frame_give_up(f);
+    }
+  }
+  else if (name_is(f->line, len, "Connection")) {
+    if (strcasestr(value, "close") != NULL) {
+      f->keepalive = 0;
+    }
+    else if (strcasestr(value, "keep-alive") != NULL) {
+      f->keepalive = 1;
+    }
+    frame_options(f, value);
+  }
+  else if (name_is(f->line, len, "Cache-Control")) {
+    frame_cache_control(f, value);
+  }
+  else if (name_is(f->line, len, "Pragma")) {
+    if (strcasestr(value, "no-cache") != NULL) {
+      f->no_cache = 1;
+    }
+  }
+  else if (name_is(f->line, len, "Expires")) {
+    //an invalid date means the response has already expired
+    f->expires_at = parse_date(value);
+    if (f->expires_at < 0) {
+      f->expires_at = 0;
+    }
+  }
+  else if (name_is(f->line, len, "Date")) {
+    f->date = parse_date(value);
+  }
+  else if (name_is(f->line, len, "Age")) {
+    f->age = strtol(value, NULL, 10);
+  }
+  else if (name_is(f->line, len, "Last-Modified")) {
+    f->last_modified = parse_date(value);
+    f->validator = 1;
+  }
+  else if (name_is(f->line, len, "ETag")) {
+    f->validator = 1;
+  }
+  else if (name_is(f->line, len, "Set-Cookie")) {
+    f->no_store = 1;
+  }
+  else if (name_is(f->line, len, "Vary")) {
+    frame_vary(f, value);
+  }
+}
+
+/*
+ * frame_end_head - this function decides how the body is framed once the
+ * blank line that ends the head has been seen
+ */
+static void frame_end_head(http_frame *f)
+{
+  if (f->status == 101) {
+    //the connection switches to some other protocol
+    frame_give_up(f);
+    return;
+  }
+  if (f->status >= 100 && f->status < 200) {
+    //an interim response, the real one follows on the same connection
+    int keepalive = f->keepalive;
+    frame_init(f, f->authorized);
+    f->keepalive = keepalive;
+    return;
+  }
+  frame_freshness(f);
+  if (f->status == 204 || f->status == 304) {
+    f->state = FRAME_DONE;
+  }
+  else if (f->chunked) {
+    f->length = -1; //the chunks say how long the body is
+    f->state = FRAME_CHUNK_SIZE;
+  }
+  else if (f->length >= 0) {
+    f->remaining = f->length;
+    f->state = (f->length == 0) ? FRAME_DONE : FRAME_LENGTH;
+  }
+  else {
+    f->keepalive = 0;
+    f->state = FRAME_UNTIL_EOF;
+  }
+  if (f->options_len > 0) {
+    frame_strip_options(f);
+  }
+  frame_head_add(f, "\r\n", 2);
+  http_out_frame(&f->out, f->status, f->length);
+}
+
+/*
+ * frame_give_up - this function stops framing the response, which can't
+ * be relayed: the fetch fails and the connection is not reused
+ */
+static void frame_give_up(http_frame *f)
+{
+  f->keepalive = 0;
+  f->state = FRAME_ERROR;
+}
+
+/*
+ * frame_head_add - this function adds the len bytes at p to the head
+ * relayed to the client, and gives up if the head gets too long
+ */
+static void frame_head_add(http_frame *f, const char *p, size_t len)
+{
+  if (f->head_len + len > HTTP_HEAD_MAX) {
+    frame_give_up(f);
+    return;
+  }
+  memcpy(f->head + f->head_len, p, len);
+  f->head_len += len;
+}
+
+/*
+ * frame_hop_by_hop - this function returns whether the header named by
+ * the len bytes at name is only meant for the connection it came on, or
+ * is about the framing of the body, which the proxy does anew
+ */
+static int frame_hop_by_hop(const char *name, size_t len)
+{
+  //most headers are told apart by their length alone
+  switch (len) {
+  case 2:
+    return name_is(name, len, "TE");
+  case 7:
+    return name_is(name, len, "Trailer") || name_is(name, len, "Upgrade");
+  case 10:
+    return name_is(name, len, "Connection") ||
+      name_is(name, len, "Keep-Alive");
+  case 14:
+    return name_is(name, len, "Content-Length");
+  case 16:
+    return name_is(name, len, "Proxy-Connection");
+  case 17:
+    return name_is(name, len, "Transfer-Encoding");
+  }
+  return 0;
+}
+
+/*
+ * frame_options - this function keeps the options of one Connection
+ * header, whose value is in value, the names of headers that are
+ * hop-by-hop too. close and keep-alive name none the proxy relays, and
+ * are left out, so that most responses have none.
+ */
+static void frame_options(http_frame *f, char *value)
+{
+  char *d = value;
+  size_t n;
+  while (*d != '\0') {
+    d += strspn(d, " \t,");
+    n = strcspn(d, " \t,");
+    if (n > 0 && !name_is(d, n, "close") && !name_is(d, n, "keep-alive")) {
+      if (f->options_len + n + 2 > HTTP_OPTIONS_MAX) {
+        frame_give_up(f);
+        return;
+      }
+      memcpy(f->options + f->options_len, d, n);
+      f->options_len += n;
+      f->options[f->options_len++] = ',';
+      f->options[f->options_len] = '\0';
+    }
+    d += n;
+  }
+}
+
+/*
+ * frame_strip_options - this function takes the headers the Connection
+ * headers named out of f->head, once all of them have been seen
+ */
+static void frame_strip_options(http_frame *f)
+{
+  char *line = memchr(f->head, '\n', f->head_len) + 1;
+  char *end = f->head + f->head_len, *to = line, *eol;
+  size_t n;
+  for (; line < end; line = eol) {
+    eol = (char *)memchr(line, '\n', end - line) + 1;
+    n = eol - line;
+    if (!option_is(f->options, line, scan_token(line, eol) - line)) {
+      memmove(to, line, n);
+      to += n;
+    }
+  }
+  f->head_len = to - f->head;
+}
+
+/*
+ * option_is - this function returns whether the header name of len bytes
+ * at name is one of the comma-separated options
+ */
+static int option_is(const char *options, const char *name, size_t len)
+{
+  const char *d = options;
+  size_t n;
+  while (*d != '\0') {
+    d += strspn(d, " \t,");
+    n = strcspn(d, " \t,");
+    if (n == len && strncasecmp(d, name, n) == 0) {
+      return 1;
+    }
+    d += n;
+  }
+  return 0;
+}
+
+/*
+ * frame_cache_control - this function takes in the directives of one
+ * Cache-Control header, whose value is in value
+ */
+static void frame_cache_control(http_frame *f, char *value)
+{
+  char *d = value;
+  while (*d != '\0') {
+    d += strspn(d, " \t,");
+    if (strncasecmp(d, "no-store", 8) == 0 ||
+        strncasecmp(d, "private", 7) == 0) {
+      //private responses are for one user, and we're a shared cache
+      f->no_store = 1;
+    }
+    else if (strncasecmp(d, "no-cache", 8) == 0) {
+      f->no_cache = 1;
+    }
+    else if (strncasecmp(d, "public", 6) == 0 ||
+        strncasecmp(d, "must-revalidate", 15) == 0) {
+      //the server lets a shared cache keep what it answered with
+      //credentials
+      f->shared = 1;
+    }
+    else if (strncasecmp(d, "max-age=", 8) == 0) {
+      f->max_age = strtol(d + 8, NULL, 10);
+    }
+    else if (strncasecmp(d, "s-maxage=", 9) == 0) {
+      f->s_maxage = strtol(d + 9, NULL, 10);
+    }
+    //on to the next directive, skipping over quoted strings
+    while (*d != '\0' && *d != ',') {
+      if (*d == '"' && (d = strchr(d + 1, '"')) == NULL) {
+        return;
+      }
+      d++;
+    }
+  }
+}
+
+/*
+ * frame_vary - this function takes in the header names of one Vary
+ * header, whose value is in value. The cache keys objects by url alone,
+ * so a response can only be cached if it varies on headers that are the
+ * same in every request the proxy sends.
+ */
+static void frame_vary(http_frame *f, char *value)
+{
+  char *d = value;
+  size_t n;
+  while (*d != '\0') {
+    d += strspn(d, " \t,");
+    n = strcspn(d, " \t,");
+    if (n > 0 &&
+        !(n == 15 && strncasecmp(d, "Accept-Encoding", n) == 0) &&
+        !(n == 10 && strncasecmp(d, "User-Agent", n) == 0) &&
+        !(n == 6 && strncasecmp(d, "Accept", n) == 0)) {
+      f->no_store = 1;
+    }
+    d += n;
+  }
+}
+
+/*
+ * frame_freshness - this function works out, once the head is over,
+ * whether the response may be cached, how long it is fresh for and when
+ * it stops being fresh
+ */
+static void frame_freshness(http_frame *f)
+{
+  time_t now = time(NULL);
+  time_t date = (f->date >= 0 && f->date < now) ? f->date : now;
+  //the response is already as old as the time since it was sent, or
+  //as its Age says if some cache held it on the way
+  long age = (f->age > now - date) ? f->age : now - date;
+  int heuristic;
+  f->explicit_fresh = 1;
+  if (f->s_maxage >= 0) {
+    f->lifetime = f->s_maxage;
+  }
+  else if (f->max_age >= 0) {
+    f->lifetime = f->max_age;
+  }
+  else if (f->expires_at >= 0) {
+    f->lifetime = (f->expires_at > date) ? f->expires_at - date : 0;
+  }
+  else {
+    f->explicit_fresh = 0;
+    if (f->last_modified >= 0 && f->last_modified < date) {
+      f->lifetime = (date - f->last_modified) / 10;
+      if (f->lifetime > HTTP_MAX_HEURISTIC) {
+        f->lifetime = HTTP_MAX_HEURISTIC;
+      }
+    }
+    else {
+      f->lifetime = http_default_ttl;
+    }
+  }
+  if (f->no_cache) {
+    f->lifetime = 0;
+  }
+  f->expires = now + f->lifetime - age;
+  //the status codes RFC 9110 says may be cached without being told so
+  heuristic = f->status == 200 || f->status == 203 || f->status == 204 ||
+    f->status == 300 || f->status == 301 || f->status == 308 ||
+    f->status == 404 || f->status == 405 || f->status == 410 ||
+    f->status == 414 || f->status == 501;
+  //a no-cache response without a validator would be fetched in full
+  //every time anyway. Partial and 304 responses aren't whole objects.
+  //a response to one user's credentials isn't for everybody else,
+  //unless the server says it is
+  f->cacheable = !f->no_store && !(f->no_cache && !f->validator) &&
+    !(f->authorized && !f->shared && f->s_maxage < 0) &&
+    f->status >= 200 && f->status != 206 && f->status != 304 &&
+    (heuristic || f->explicit_fresh);
+}
+
+/*
+ * parse_date - this function returns the time in the HTTP date s, in any
+ * of the three formats RFC 9110 says must be accepted, or -1 if s isn't
+ * a date
+ */
+static time_t parse_date(char *s)
+{
+  static const char *formats[] = {
+    "%a, %d %b %Y %H:%M:%S", //IMF-fixdate, Sun, 06 Nov 1994 08:49:37 GMT
+    "%A, %d-%b-%y %H:%M:%S", //RFC 850, Sunday, 06-Nov-94 08:49:37 GMT
+    "%a %b %e %H:%M:%S %Y" //asctime, Sun Nov  6 08:49:37 1994
+  };
+  struct tm tm;
+  size_t i;
+  s += strspn(s, " \t");
+  for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(s, formats[i], &tm) != NULL) {
+      return timegm(&tm);
+    }
+  }
+  return -1;
+}
+
+/*
+ * http_validators - this function writes to buf, which has room for size
+ * bytes, the If-None-Match and If-Modified-Since headers that ask whether
+ * the response whose head is in the len bytes at head has changed. It
+ * returns their length, or 0 if the response has no ETag or Last-Modified
+ * or the headers don't fit.
+ */
+size_t http_validators(char *head, size_t len, char *buf, size_t size)
+{
+  char *line = head, *end = head + len, *eol;
+  size_t out = 0, n, name;
+  //the status line goes first
+  if ((eol = memchr(line, '\n', end - line)) == NULL) {
+    return 0;
+  }
+  line = eol + 1;
+  while (line < end && (eol = memchr(line, '\n', end - line)) != NULL) {
+    n = eol - line;
+    if (n > 0 && line[n - 1] == '\r') {
+      n--;
+    }
+    if (n == 0) {
+      return out; //the end of the head
+    }
+    if (n > 5 && strncasecmp(line, "ETag:", 5) == 0) {
+      name = 5;
+      if (out + n + 16 > size) {
+        return 0;
+      }
+      out += sprintf(buf + out, "If-None-Match:%.*s\r\n", (int)(n - name),
+        line + name);
+    }
+    else if (n > 14 && strncasecmp(line, "Last-Modified:", 14) == 0) {
+      name = 14;
+      if (out + n + 20 > size) {
+        return 0;
+      }
+      out += sprintf(buf + out, "If-Modified-Since:%.*s\r\n",
+        (int)(n - name), line + name);
+    }
+    line = eol + 1;
+  }
+  //the head didn't end within len bytes
+  return 0;
+}
+
+/*
+ * http_status - this function returns the status code of the response
+ * whose head starts with the len bytes at head, or 0 if they don't have
+ * it
+ */
+int http_status(const char *head, size_t len)
+{
+  char line[16];
+  int major, minor, status;
+  if (len > sizeof(line) - 1) {
+    len = sizeof(line) - 1;
+  }
+  memcpy(line, head, len);
+  line[len] = '\0';
+  if (sscanf(line, "HTTP/%d.%d %d", &major, &minor, &status) != 3) {
+    return 0;
+  }
+  return status;
+}
+
+/*
+ * http_out_init - this function gets o ready to frame a response for a
+ * client that sent an HTTP/1.version request, and wants the connection
+ * kept open if keepalive is set
+ */
+void http_out_init(http_out *o, int version, int keepalive)
+{
+  o->version = version;
+  o->keepalive = keepalive;
+  o->coding = BODY_CLOSE;
+  o->length = -1;
+}
+
+/*
+ * http_out_frame - this function decides how o frames a response with
+ * the given status, whose body is length bytes long, or of a length
+ * that isn't known yet if length is -1. An HTTP/1.0 client can't be
+ * sent chunks, so the end of such a body is the end of the connection.
+ */
+void http_out_frame(http_out *o, int status, long long length)
+{
+  o->length = length;
+  if ((status >= 100 && status < 200) || status == 204 || status == 304) {
+    o->coding = BODY_NONE;
+  }
+  else if (length >= 0) {
+    o->coding = BODY_LENGTH;
+  }
+  else if (o->version >= 1) {
+    o->coding = BODY_CHUNKED;
+  }
+  else {
+    o->coding = BODY_CLOSE;
+    o->keepalive = 0;
+  }
+}
+
+/*
+ * http_framing - this function writes to buf, which has room for
+ * HTTP_FRAMING_MAX bytes, the headers that tell the client how o frames
+ * the response and whether the connection stays open. It returns their
+ * length.
+ */
+size_t http_framing(http_out *o, char *buf)
+{
+  size_t n = 0;
+  if (o->coding == BODY_LENGTH) {
+    n += sprintf(buf, "Content-Length: %lld\r\n", o->length);
+  }
+  else if (o->coding == BODY_CHUNKED) {
+    n += sprintf(buf, "Transfer-Encoding: chunked\r\n");
+  }
+  n += sprintf(buf + n, "Connection: %s\r\n",
+    o->keepalive ? "keep-alive" : "close");
+  return n;
+}
+
+/*
+ * http_out_piece - this function makes the *len bytes of body at body
+ * into the next piece of the response that goes to the client, framed
+ * as o says. If head isn't NULL, the head_len bytes there are the head
+ * of the response, which goes first, with the framing headers. If last
+ * is set, these are the last bytes of the body. The piece is built
+ * around body, which must have HTTP_RELAY_ROOM bytes of room before it
+ * (where head may lie) and HTTP_RELAY_TAIL after it. It returns where
+ * the piece starts and stores its length at *len.
+ */
+char *http_out_piece(http_out *o, char *body, size_t *len, const char *head,
+  size_t head_len, int last)
+{
+  char framing[HTTP_FRAMING_MAX], size[HTTP_CHUNK_ROOM + 1];
+  size_t n = *len, size_len = 0, framing_len;
+  char *p;
+  if (o->coding == BODY_CHUNKED) {
+    //an empty chunk would be the last one
+    if (n > 0) {
+      size_len = sprintf(size, "%zx\r\n", n);
+      memcpy(body + n, "\r\n", 2);
+      n += 2;
+    }
+    if (last) {
+      memcpy(body + n, "0\r\n\r\n", 5);
+      n += 5;
+    }
+  }
+  p = body - size_len;
+  if (head != NULL) {
+    //the head moves first, it may lie where the rest goes. The framing
+    //headers go before the blank line that ends it
+    framing_len = http_framing(o, framing);
+    p -= head_len + framing_len;
+    memmove(p, head, head_len - 2);
+    memcpy(p + head_len - 2, framing, framing_len);
+    memcpy(p + head_len - 2 + framing_len, "\r\n", 2);
+  }
+  memcpy(body - size_len, size, size_len);
+  *len = n + (body - p);
+  return p;
+}
+
+/*
+ * name_is - this function returns whether the header name of len bytes
+ * at name is want, without regard to case
+ */
+static int name_is(const char *name, size_t len, const char *want)
+{
+  return strlen(want) == len && strncasecmp(name, want, len) == 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * http.h - framing of HTTP/1.x responses, used to find out where a
+ * response read from a server ends, whether and for how long it may be
+ * cached, and how it is framed again for the client it is relayed to
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "csapp.h"
+
+/* States of the framing of one response */
+#define FRAME_HEAD 0 //reading the status line and the headers
+#define FRAME_LENGTH 1 //reading a body of known length
+#define FRAME_CHUNK_SIZE 2 //reading the size line of a chunk
+#define FRAME_CHUNK_DATA 3 //reading the data of a chunk
+#define FRAME_CHUNK_END 4 //reading the CRLF after the data of a chunk
+#define FRAME_TRAILER 5 //reading the trailer after the last chunk
+#define FRAME_UNTIL_EOF 6 //the body ends when the server closes
+#define FRAME_DONE 7 //the whole response has been seen
+#define FRAME_ERROR 8 //the response can't be relayed, the fetch fails
+
+/* How the body of a response is framed for the client it is sent to */
+#define BODY_NONE 0 //there is no body, 1xx, 204 and 304 responses
+#define BODY_LENGTH 1 //Content-Length, when the length is known
+#define BODY_CHUNKED 2 //the chunked transfer coding, for HTTP/1.1 clients
+#define BODY_CLOSE 3 //the body ends when the connection closes
+
+/* Most bytes of the head of a response as it is relayed, the status line
+   and the end-to-end headers */
+#define HTTP_HEAD_MAX MAXBUF
+
+/* Most bytes of the Connection options of a response */
+#define HTTP_OPTIONS_MAX 256
+
+/* Most bytes of the headers the proxy adds to frame a response */
+#define HTTP_FRAMING_MAX 80
+
+/* Room for the size line of a chunk */
+#define HTTP_CHUNK_ROOM 18
+
+/* Bytes a relay buffer keeps free before the body bytes read into it,
+   for the head and the chunk size line that go before them, and after
+   them, for the CRLF of the chunk and the last chunk */
+#define HTTP_RELAY_ROOM (HTTP_HEAD_MAX + HTTP_FRAMING_MAX + HTTP_CHUNK_ROOM)
+#define HTTP_RELAY_TAIL 8
+
+/* Size of a relay buffer that takes reads of up to MAXBUF bytes */
+#define HTTP_RELAY_SIZE (HTTP_RELAY_ROOM + MAXBUF + HTTP_RELAY_TAIL)
+
+/* Freshness of responses that don't say how long they are fresh for and
+   have no Last-Modified, unless the proxy is told otherwise */
+#define HTTP_DEFAULT_TTL 300
+
+/* Longest freshness guessed from Last-Modified, in seconds */
+#define HTTP_MAX_HEURISTIC 86400
+
+/* How a response is framed for the client it is sent to */
+struct http_out{
+  int version; //minor version of the client's request
+  int keepalive; //the client is told the connection stays open
+  int coding; //one of the BODY_ values, once the status is known
+  long long length; //bytes of body, for BODY_LENGTH
+};
+
+typedef struct http_out http_out;
+
+struct http_frame{
+  int state; //one of the FRAME_ states
+  int status; //status code of the response
+  int keepalive; //the server keeps the connection open after it
+  int chunked; //the body uses the chunked transfer coding
+  long long length; //bytes of body, -1 if the head doesn't say
+  long long remaining; //bytes left in the body or the current chunk
+  //what the head says about caching the response, see RFC 9111. The
+  //last four fields are only set once the head is over
+  int no_store; //no-store, private, Set-Cookie or a Vary we can't honour
+  int no_cache; //no-cache, the response must be revalidated on every use
+  int authorized; //the request it answers carried Authorization
+  int shared; //public or must-revalidate, may be cached despite that
+  int validator; //the response has an ETag or a Last-Modified
+  long max_age; //Cache-Control max-age, -1 if there was none
+  long s_maxage; //Cache-Control s-maxage, -1 if there was none
+  long age; //Age, 0 if there was none
+  time_t date; //Date, -1 if there was none
+  time_t expires_at; //Expires, -1 if there was none, 0 if it was invalid
+  time_t last_modified; //Last-Modified, -1 if there was none
+  int cacheable; //the response may be cached
+  int explicit_fresh; //the response says how long it is fresh for
+  long lifetime; //how long it is fresh for, from when it was sent
+  time_t expires; //when it stops being fresh
+  http_out out; //how the response is framed for the client, set up
+                //with http_out_init, the frame does the rest
+  size_t head_len; //bytes of head
+  char head[HTTP_HEAD_MAX]; //the head as it is relayed: the status line
+                            //and the end-to-end headers, with CRLFs
+  size_t options_len; //bytes of options
+  char options[HTTP_OPTIONS_MAX]; //the Connection options, the names of
+                                  //more hop-by-hop headers
+  size_t line_len; //bytes of the current line collected in line
+  char line[MAXLINE]; //current header, chunk size or trailer line
+};
+
+typedef struct http_frame http_frame;
+
+extern int http_default_ttl; //freshness of responses that say nothing
+
+void frame_init(http_frame *f, int authorized);
+size_t frame_feed(http_frame *f, char *buf, size_t len, size_t *body);
+int frame_complete(http_frame *f, int eof);
+long long frame_passthrough(http_frame *f);
+void frame_skip(http_frame *f, size_t len);
+size_t http_validators(char *head, size_t len, char *buf, size_t size);
+int http_status(const char *head, size_t len);
+void http_out_init(http_out *o, int version, int keepalive);
+void http_out_frame(http_out *o, int status, long long length);
+size_t http_framing(http_out *o, char *buf);
+char *http_out_piece(http_out *o, char *body, size_t *len, const char *head,
+	size_t head_len, int last);
+
+#endif /* __HTTP_H__ */
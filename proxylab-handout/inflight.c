@@ -0,0 +1,460 @@
+/*
+ * inflight.c - table of the responses being fetched from servers
+ *
+ * Without it, clients that ask for the same cold url at the same time
+ * all miss, each one fetches the url from the server on a connection of
+ * its own, and each one adds its own copy to the cache. Here the first
+ * miss for a url becomes the leader of an entry in the table and fetches
+ * the response. Misses that come while the entry is in the table become
+ * its followers: they don't talk to the server at all, they copy the
+ * bytes the leader has kept so far to their clients, and then the ones
+ * that keep arriving, until the response is complete. Only the leader
+ * adds the response to the cache.
+ *
+ * The leader appends the response to the entry as the cache keeps it,
+ * the head it relays and the body without the chunked coding, in blocks
+ * of INFLIGHT_BLOCK bytes that never move, so a follower that joins late
+ * starts from the first byte like the others. Each follower frames the
+ * response for its own client, with the length of the head and of the
+ * body that the leader gives inflight_share. Threads of the threaded
+ * proxy wait for more bytes on the entry's condition variable. Event
+ * loops can't wait, so they leave an eventfd with the entry, which the
+ * leader writes once when more bytes (or the end) arrive.
+ *
+ * An entry leaves the table when the fetch is over, and the leader adds
+ * the response to the cache before that, so a request for the url never
+ * misses both. It also leaves the table early once the response grows
+ * past the limit given by the leader, the biggest object the cache keeps
+ * in memory. If nobody follows it then, the leader stops keeping bytes,
+ * and is free to splice the rest of the body.
+ *
+ * Once nobody can join, the entry only keeps the blocks some follower
+ * still has to read: each block counts the followers whose next byte is
+ * in it, and blocks are freed from the front as the slowest follower
+ * leaves them. So that a follower whose client reads slowly can't make
+ * the entry keep the whole response, at most INFLIGHT_MAX_BEHIND bytes
+ * are kept. The blocks before that are freed anyway, and followers that
+ * haven't read them yet see the fetch fail.
+ *
+ * Followers only get a response that may be cached: one that may not,
+ * because of a Set-Cookie say, could be meant for the leader's client
+ * alone. So followers see no bytes until the leader has read the head of
+ * the response and called inflight_share, which either lets them have
+ * the response or fails the fetch for them.
+ *
+ * If the fetch fails, followers see INFLIGHT_FAILED. One that hasn't
+ * sent anything to its client yet can still fetch the url on its own.
+ * A leader whose own client goes away asks inflight_alone whether it
+ * can give up, and keeps fetching for its followers if it can't.
+ *
+ * The table has its own lock, and each entry has a lock for its bytes,
+ * state and references, always taken after the table's.
+ */
+
+#include "inflight.h"
+
+struct inflight{
+  char *url;
+  pthread_mutex_t lock; //protects everything below
+  pthread_cond_t cond; //signalled when bytes arrive or the fetch ends
+  char **blocks; //the bytes of the response so far, NULL once freed
+  size_t nblocks;
+  size_t base; //blocks before this one were freed
+  size_t size; //bytes appended, freed or not
+  int *readers; //followers whose next byte is in each block, and the
+                //one after the last
+  size_t limit; //past this, the entry is closed to new followers
+  int state; //INFLIGHT_RUNNING, INFLIGHT_DONE or INFLIGHT_FAILED
+  size_t head_len; //bytes of the head the response starts with
+  long long length; //bytes of body, -1 if the head doesn't say
+  int in_table; //followers can still join
+  int keep; //bytes are still kept, for followers present or to come
+  int shared; //followers may have the bytes, the head said so
+  int nfollowers;
+  int refcnt; //the leader, the followers and the table
+  int *notify; //eventfds to write when something happens
+  int nnotify;
+  struct inflight *next; //next entry in the same bucket
+};
+
+static inflight *table[INFLIGHT_BUCKETS];
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inflight **find_entry(char *url);
+static void close_entry(inflight *e);
+static void wake(inflight *e);
+static void trim(inflight *e);
+static void free_blocks(inflight *e);
+static void release(inflight *e);
+
+/*
+ * inflight_join - this function returns the entry of the fetch of url.
+ * If there was none, a new one is made and *leader is set: the caller
+ * must fetch the response, pass its bytes to inflight_append, call
+ * inflight_share once the head is over and end with inflight_finish.
+ * Past limit bytes, the entry can't be joined any more. Otherwise
+ * *leader is cleared, and the caller follows the fetch with
+ * inflight_read and ends with inflight_leave.
+ */
+inflight *inflight_join(char *url, size_t limit, int *leader)
+{
+  pthread_mutex_lock(&table_lock);
+  inflight **ep = find_entry(url);
+  inflight *e = *ep;
+  if (e != NULL) {
+    pthread_mutex_lock(&e->lock);
+    e->nfollowers += 1;
+    e->refcnt += 1;
+    //nothing was freed yet, it starts from the first byte
+    e->readers[0] += 1;
+    pthread_mutex_unlock(&e->lock);
+    pthread_mutex_unlock(&table_lock);
+    *leader = 0;
+    return e;
+  }
+  e = Calloc(1, sizeof(inflight));
+  e->url = Malloc(strlen(url) + 1);
+  strcpy(e->url, url);
+  pthread_mutex_init(&e->lock, NULL);
+  pthread_cond_init(&e->cond, NULL);
+  e->readers = Calloc(1, sizeof(int));
+  e->limit = limit;
+  e->state = INFLIGHT_RUNNING;
+  e->in_table = 1;
+  e->keep = 1;
+  e->refcnt = 2; //the leader's and the table's
+  *ep = e;
+  pthread_mutex_unlock(&table_lock);
+  *leader = 1;
+  return e;
+}
+
+/*
+ * inflight_append - this function adds the next len bytes of the
+ * response to e and wakes up its followers. It is called by the leader.
+ */
+void inflight_append(inflight *e, char *data, size_t len)
+{
+  int close = 0;
+  pthread_mutex_lock(&e->lock);
+  if (e->keep) {
+    while (len > 0) {
+      size_t at = e->size % INFLIGHT_BLOCK;
+      size_t n = INFLIGHT_BLOCK - at;
+      n = (n < len) ? n : len;
+      if (at == 0) {
+        e->blocks = Realloc(e->blocks, (e->nblocks + 1) * sizeof(char *));
+        e->readers = Realloc(e->readers, (e->nblocks + 2) * sizeof(int));
+        e->readers[e->nblocks + 1] = 0;
+        e->blocks[e->nblocks++] = Malloc(INFLIGHT_BLOCK);
+      }
+      memcpy(e->blocks[e->size / INFLIGHT_BLOCK] + at, data, n);
+      e->size += n;
+      data += n;
+      len -= n;
+    }
+    close = (e->size > e->limit && e->in_table);
+    trim(e);
+    if (e->shared) {
+      wake(e);
+    }
+  }
+  pthread_mutex_unlock(&e->lock);
+  if (close) {
+    //whoever joined now would need the bytes that are about to be freed
+    pthread_mutex_lock(&table_lock);
+    close_entry(e);
+    pthread_mutex_unlock(&table_lock);
+    //and with nobody following, they needn't be kept at all
+    inflight_alone(e);
+  }
+}
+
+/*
+ * inflight_alone - this function returns 1 if nobody follows e, in which
+ * case e is closed to new followers and stops keeping bytes, and 0 if it
+ * has followers. It is called by the leader, which may only relay bytes
+ * without passing them to inflight_append once this returned 1.
+ */
+int inflight_alone(inflight *e)
+{
+  int alone;
+  pthread_mutex_lock(&table_lock);
+  pthread_mutex_lock(&e->lock);
+  //a refused fetch is nobody else's either
+  alone = (e->nfollowers == 0 || !e->keep);
+  if (alone && e->keep) {
+    e->keep = 0;
+    free_blocks(e);
+  }
+  pthread_mutex_unlock(&e->lock);
+  if (alone) {
+    close_entry(e);
+  }
+  pthread_mutex_unlock(&table_lock);
+  return alone;
+}
+
+/*
+ * inflight_share - this function is called by the leader once the head
+ * of the response is over and has been appended. If ok is set, the
+ * followers get the response, whose head is head_len bytes long and
+ * whose body is length bytes long, or -1 if it doesn't say. Otherwise
+ * the fetch fails for them, before they have sent anything.
+ */
+void inflight_share(inflight *e, int ok, size_t head_len, long long length)
+{
+  if (!ok) {
+    //nobody may join a fetch whose response is the leader's alone
+    pthread_mutex_lock(&table_lock);
+    close_entry(e);
+    pthread_mutex_unlock(&table_lock);
+  }
+  pthread_mutex_lock(&e->lock);
+  if (ok) {
+    e->shared = 1;
+    e->head_len = head_len;
+    e->length = length;
+  }
+  else {
+    e->keep = 0;
+    e->state = INFLIGHT_FAILED;
+    free_blocks(e);
+    e->size = 0;
+  }
+  wake(e);
+  pthread_mutex_unlock(&e->lock);
+}
+
+/*
+ * inflight_finish - this function ends the fetch of e, which succeeded
+ * if ok is set, and drops the leader's reference
+ */
+void inflight_finish(inflight *e, int ok)
+{
+  pthread_mutex_lock(&table_lock);
+  close_entry(e);
+  pthread_mutex_unlock(&table_lock);
+  pthread_mutex_lock(&e->lock);
+  //a response that was never shared can't be had by the followers
+  e->state = (ok && e->shared) ? INFLIGHT_DONE : INFLIGHT_FAILED;
+  wake(e);
+  pthread_mutex_unlock(&e->lock);
+  release(e);
+}
+
+/*
+ * inflight_read - this function copies to buf at most len bytes of the
+ * response, from offset off on, and returns how many it copied. The
+ * state of the fetch is stored at *state. Nothing is copied when there
+ * is nothing new, in which case a follower of a running fetch should
+ * wait for more. A follower calls it with the offsets it reached, which
+ * tells the entry which bytes it can free.
+ */
+size_t inflight_read(inflight *e, size_t off, char *buf, size_t len,
+    int *state)
+{
+  size_t n = 0, size;
+  pthread_mutex_lock(&e->lock);
+  size = e->shared ? e->size : 0;
+  if (off < size && off / INFLIGHT_BLOCK < e->base) {
+    //it fell too far behind, its bytes are gone
+    *state = INFLIGHT_FAILED;
+    pthread_mutex_unlock(&e->lock);
+    return 0;
+  }
+  if (off < size) {
+    size_t at = off % INFLIGHT_BLOCK;
+    n = INFLIGHT_BLOCK - at;
+    n = (n < len) ? n : len;
+    n = (n < size - off) ? n : size - off;
+    memcpy(buf, e->blocks[off / INFLIGHT_BLOCK] + at, n);
+    if (at + n == INFLIGHT_BLOCK) {
+      //it is done with this block
+      e->readers[off / INFLIGHT_BLOCK] -= 1;
+      e->readers[off / INFLIGHT_BLOCK + 1] += 1;
+      trim(e);
+    }
+  }
+  *state = (off + n < size) ? INFLIGHT_RUNNING : e->state;
+  pthread_mutex_unlock(&e->lock);
+  return n;
+}
+
+/*
+ * inflight_head - this function returns the length of the head of the
+ * response of e, and stores the length of its body at *length, -1 if the
+ * head doesn't say. A follower may only ask once it has read some bytes.
+ */
+size_t inflight_head(inflight *e, long long *length)
+{
+  size_t head_len;
+  pthread_mutex_lock(&e->lock);
+  head_len = e->head_len;
+  *length = e->length;
+  pthread_mutex_unlock(&e->lock);
+  return head_len;
+}
+
+/*
+ * inflight_wait - this function blocks until e has more than off bytes
+ * or its fetch is over
+ */
+void inflight_wait(inflight *e, size_t off)
+{
+  pthread_mutex_lock(&e->lock);
+  while ((!e->shared || e->size <= off) && e->state == INFLIGHT_RUNNING) {
+    pthread_cond_wait(&e->cond, &e->lock);
+  }
+  pthread_mutex_unlock(&e->lock);
+}
+
+/*
+ * inflight_watch - this function is how an event loop waits. It returns
+ * 1 if e already has more than off bytes or its fetch is over. Otherwise
+ * it returns 0, and notify_fd, an eventfd, is written once that changes.
+ */
+int inflight_watch(inflight *e, size_t off, int notify_fd)
+{
+  int i, ready;
+  pthread_mutex_lock(&e->lock);
+  ready = ((e->shared && e->size > off) || e->state != INFLIGHT_RUNNING);
+  if (!ready) {
+    //one write wakes up every follower of the same loop
+    for (i = 0; i < e->nnotify && e->notify[i] != notify_fd; i++)
+      ;
+    if (i == e->nnotify) {
+      e->notify = Realloc(e->notify, (e->nnotify + 1) * sizeof(int));
+      e->notify[e->nnotify++] = notify_fd;
+    }
+  }
+  pthread_mutex_unlock(&e->lock);
+  return ready;
+}
+
+/*
+ * inflight_leave - this function drops a follower's reference to e. off
+ * is the offset it had read up to.
+ */
+void inflight_leave(inflight *e, size_t off)
+{
+  pthread_mutex_lock(&e->lock);
+  e->nfollowers -= 1;
+  e->readers[off / INFLIGHT_BLOCK] -= 1;
+  trim(e);
+  pthread_mutex_unlock(&e->lock);
+  release(e);
+}
+
+/*
+ * find_entry - this function returns the link that points to the entry
+ * of url in the table, which is NULL if there is no such entry. The
+ * caller must hold table_lock.
+ */
+static inflight **find_entry(char *url)
+{
+  unsigned int h = 2166136261u; //FNV-1a, as for urls in the cache
+  unsigned char *c;
+  for (c = (unsigned char *)url; *c != '\0'; c++) {
+    h ^= *c;
+    h *= 16777619u;
+  }
+  inflight **ep = &table[h % INFLIGHT_BUCKETS];
+  while (*ep != NULL && strcmp((*ep)->url, url) != 0) {
+    ep = &(*ep)->next;
+  }
+  return ep;
+}
+
+/*
+ * close_entry - this function takes e out of the table, if it is still
+ * in it, and drops the table's reference. The caller must hold
+ * table_lock, so a closed entry is never joined.
+ */
+static void close_entry(inflight *e)
+{
+  if (!e->in_table) {
+    return;
+  }
+  inflight **ep = find_entry(e->url);
+  *ep = e->next;
+  //the leader still holds a reference, this can't be the last one
+  pthread_mutex_lock(&e->lock);
+  e->in_table = 0;
+  e->refcnt -= 1;
+  trim(e);
+  pthread_mutex_unlock(&e->lock);
+}
+
+/*
+ * wake - this function wakes up the followers of e, those that wait on
+ * its condition variable and those of the event loops that left an
+ * eventfd. The caller must hold e's lock.
+ */
+static void wake(inflight *e)
+{
+  uint64_t one = 1;
+  int i;
+  pthread_cond_broadcast(&e->cond);
+  for (i = 0; i < e->nnotify; i++) {
+    if (write(e->notify[i], &one, sizeof(one)) < 0) {
+      //the counter is already set, the loop will look anyway
+    }
+  }
+  e->nnotify = 0;
+}
+
+/*
+ * trim - this function frees the blocks at the front of e that no
+ * follower has left to read, and those too far behind the last byte,
+ * once e can't be joined any more. The block being filled is kept. The
+ * caller must hold e's lock.
+ */
+static void trim(inflight *e)
+{
+  size_t full = e->size / INFLIGHT_BLOCK;
+  if (e->in_table) {
+    return;
+  }
+  while (e->base < full && e->base < e->nblocks &&
+      (e->readers[e->base] == 0 ||
+      e->size - e->base * INFLIGHT_BLOCK > INFLIGHT_MAX_BEHIND)) {
+    Free(e->blocks[e->base]);
+    e->blocks[e->base++] = NULL;
+  }
+}
+
+/*
+ * free_blocks - this function frees every block of e that is left. The
+ * caller must hold e's lock, unless it holds the last reference.
+ */
+static void free_blocks(inflight *e)
+{
+  while (e->base < e->nblocks) {
+    Free(e->blocks[e->base]);
+    e->blocks[e->base++] = NULL;
+  }
+}
+
+/*
+ * release - this function drops one reference to e and frees it when
+ * the last one goes away
+ */
+static void release(inflight *e)
+{
+  int last;
+  pthread_mutex_lock(&e->lock);
+  last = (--e->refcnt == 0);
+  pthread_mutex_unlock(&e->lock);
+  if (!last) {
+    return;
+  }
+  free_blocks(e);
+  Free(e->blocks);
+  Free(e->readers);
+  Free(e->notify);
+  Free(e->url);
+  pthread_mutex_destroy(&e->lock);
+  pthread_cond_destroy(&e->cond);
+  Free(e);
+}
@@ -0,0 +1,39 @@
+/*
+ * inflight.h - table of the responses being fetched from servers, so
+ * that concurrent misses for one url share a single fetch
+ */
+#ifndef __INFLIGHT_H__
+#define __INFLIGHT_H__
+
+#include "csapp.h"
+
+/* The bytes of a response are kept in blocks of this size */
+#define INFLIGHT_BLOCK 65536
+
+/* Most bytes kept for the followers of a fetch that can't be joined any
+   more. A follower that falls further behind than that fails */
+#define INFLIGHT_MAX_BEHIND (4 * 1024 * 1024)
+
+/* Size of the table of urls */
+#define INFLIGHT_BUCKETS 256
+
+/* States of a fetch, as seen by its followers */
+#define INFLIGHT_RUNNING 0 //more bytes may come
+#define INFLIGHT_DONE 1 //the response is complete
+#define INFLIGHT_FAILED 2 //the fetch gave up, the response is cut short
+
+typedef struct inflight inflight;
+
+inflight *inflight_join(char *url, size_t limit, int *leader);
+void inflight_append(inflight *e, char *data, size_t len);
+void inflight_share(inflight *e, int ok, size_t head_len, long long length);
+int inflight_alone(inflight *e);
+void inflight_finish(inflight *e, int ok);
+size_t inflight_read(inflight *e, size_t off, char *buf, size_t len,
+	int *state);
+size_t inflight_head(inflight *e, long long *length);
+void inflight_wait(inflight *e, size_t off);
+int inflight_watch(inflight *e, size_t off, int notify_fd);
+void inflight_leave(inflight *e, size_t off);
+
+#endif /* __INFLIGHT_H__ */
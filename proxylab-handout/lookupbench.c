@@ -0,0 +1,147 @@
+/*
+ * lookupbench.c - measures how long a lookup in the cache takes as the
+ * number of cached objects grows
+ *
+ * For each size, a cache is filled with that many small objects and the
+ * lookups run for about a second of CPU time each: hits on the same
+ * BENCH_HOT urls whatever the size, hits on urls picked at random among
+ * all the cached ones, and misses on urls that were never cached. The
+ * urls are made up front so only the lookups are timed. With the hash
+ * table, hot hits should take about the same time from 100 objects to a
+ * million. Random hits and misses get slower as the objects stop fitting
+ * in the CPU's caches, which is the memory and not the table.
+ *
+ * usage: ./lookupbench [seconds]
+ */
+
+#include "cache.h"
+
+/* Bytes of data in each object */
+#define BENCH_OBJECT 64
+
+/* Number of urls the hot hits are picked from */
+#define BENCH_HOT 100
+
+/* Lookups made between two reads of the clock */
+#define BENCH_BATCH 1000
+
+static const size_t sizes[] = {100, 1000, 10000, 100000, 1000000};
+
+static volatile size_t sink; //keeps the lookups from being optimized out
+
+static double cpu_seconds(void);
+static char **make_urls(const char *prefix, size_t n);
+static cache *fill(char **urls, size_t n);
+static double run(cache *c_cache, char **urls, size_t n, int hits,
+	double seconds, long *count);
+
+/*
+ * main - this function fills a cache of each size and prints the time
+ * hits and misses take in it
+ */
+int main(int argc, char **argv)
+{
+  double seconds = (argc > 1) ? atof(argv[1]) : 1.0;
+  size_t i, n = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+  char **urls = make_urls("http://bench.example.com/objects/", n);
+  char **missing = make_urls("http://bench.example.com/missing/", n);
+  long count;
+  double elapsed;
+  printf("%8s %12s %12s %12s\n", "objects", "hot hit ns", "hit ns",
+    "miss ns");
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    cache *c_cache = fill(urls, sizes[i]);
+    printf("%8zu", sizes[i]);
+    elapsed = run(c_cache, urls, BENCH_HOT, 1, seconds, &count);
+    printf(" %12.1f", elapsed / count * 1e9);
+    elapsed = run(c_cache, urls, sizes[i], 1, seconds, &count);
+    printf(" %12.1f", elapsed / count * 1e9);
+    elapsed = run(c_cache, missing, sizes[i], 0, seconds, &count);
+    printf(" %12.1f\n", elapsed / count * 1e9);
+    fflush(stdout);
+  }
+  return 0;
+}
+
+/*
+ * cpu_seconds - this function returns the CPU time the calling thread has
+ * used, so that the times are per core whatever else the machine is doing
+ */
+static double cpu_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * make_urls - this function returns n urls, prefix followed by a number
+ */
+static char **make_urls(const char *prefix, size_t n)
+{
+  char **urls = Malloc(n * sizeof(char *));
+  char url[MAXLINE];
+  size_t i;
+  for (i = 0; i < n; i++) {
+    snprintf(url, sizeof(url), "%s%zu", prefix, i);
+    urls[i] = Malloc(strlen(url) + 1);
+    strcpy(urls[i], url);
+  }
+  return urls;
+}
+
+/*
+ * fill - this function returns a new LRU cache holding the first n urls,
+ * with room for all of them. It exits if some didn't make it in.
+ */
+static cache *fill(char **urls, size_t n)
+{
+  static char data[BENCH_OBJECT];
+  cache *c_cache = initialize_cache(CACHE_DEFAULT_SHARDS, CACHE_LRU,
+    CACHE_ADMIT_ALL, (n + 64) * 1024, MAX_OBJECT_SIZE, NULL);
+  cache_buf b;
+  size_t i, nobjects;
+  for (i = 0; i < n; i++) {
+    cache_buf_init(&b, c_cache);
+    cache_buf_append(&b, data, sizeof(data));
+    add_to_cache(c_cache, urls[i], &b, 0, 0, 0);
+  }
+  cache_used(c_cache, &nobjects);
+  if (nobjects != n) {
+    fprintf(stderr, "only %zu of %zu objects were cached\n", nobjects, n);
+    exit(1);
+  }
+  return c_cache;
+}
+
+/*
+ * run - this function looks up urls picked at random among the first n
+ * for about seconds of CPU time. hits says whether they are all expected
+ * to be found, or all expected to be missing. It stores how many lookups
+ * were made in *count and returns how long they took.
+ */
+static double run(cache *c_cache, char **urls, size_t n, int hits,
+  double seconds, long *count)
+{
+  unsigned int seed = 1;
+  double start = cpu_seconds(), elapsed;
+  long done = 0;
+  int i;
+  do {
+    for (i = 0; i < BENCH_BATCH; i++) {
+      cache_node *p = cache_lookup(c_cache, urls[rand_r(&seed) % n]);
+      if ((p != NULL) != hits) {
+        fprintf(stderr, "lookup %s\n", hits ? "missed" : "hit");
+        exit(1);
+      }
+      if (p != NULL) {
+        sink += p->data_size;
+        release_cache_node(p);
+      }
+    }
+    done += i;
+    elapsed = cpu_seconds() - start;
+  } while (elapsed < seconds);
+  *count = done;
+  return elapsed;
+}
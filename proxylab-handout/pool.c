@@ -0,0 +1,296 @@
+/*
+ * pool.c - fixed pool of worker threads for the threaded proxy
+ *
+ * Instead of creating (and detaching) a thread for every connection,
+ * the proxy starts nworkers threads once. The accepting thread puts each
+ * connected descriptor into a bounded queue, the sbuf described in the
+ * CS:APP text: a ring buffer guarded by a mutex semaphore, with a slots
+ * semaphore counting free slots and an items semaphore counting queued
+ * connections. Idle workers sleep in P(items), take the next connection,
+ * hand it to the handler and close it.
+ *
+ * A worker serves a connection for as long as the client sends requests
+ * back to back. A kept-alive client that is idle after a response would
+ * hold the worker until it sends its next request, or for up to
+ * client_idle_timeout seconds, so the handler returns POOL_IDLE instead
+ * of waiting, and the connection is parked: a parking thread watches
+ * every parked connection with one epoll instance, and queues it again
+ * for the workers once bytes arrive, or closes it once it has been idle
+ * for client_idle_timeout seconds. The parking thread never waits for a
+ * slot: under POOL_BLOCK, a connection that finds the queue full is
+ * closed.
+ *
+ * When every slot is taken the pool applies its overload policy:
+ *   POOL_BLOCK - the accepting thread waits in P(slots), new connections
+ *                pile up in the listen backlog of the kernel
+ *   POOL_SHED  - the connection is answered with 503 Service Unavailable
+ *                and closed right away
+ *   POOL_QUEUE - the ring buffer is doubled, so nothing is refused and
+ *                nothing waits, at the cost of unbounded memory
+ */
+
+#include "pool.h"
+#include "proxy.h"
+#include <sys/epoll.h>
+
+static int queue_conn(conn_pool *pool, int connfd, int nrequests, int wait);
+static void *pool_worker(void *vargp);
+static void pool_park(conn_pool *pool, int connfd, int nrequests);
+static void *park_thread(void *vargp);
+static void park_unlink(conn_pool *pool, struct pool_parked *p);
+static void pool_grow(conn_pool *pool);
+static void pool_shed(int connfd);
+
+/*
+ * pool_start - this function creates the queue with qsize slots and
+ * starts nworkers detached threads that serve connections from it with
+ * handler, and the parking thread. handler is given the number of
+ * requests served on the connection so far, which it updates, and
+ * returns POOL_CLOSE or POOL_IDLE. The threads never exit.
+ */
+conn_pool *pool_start(int nworkers, int qsize, int overload,
+	int (*handler)(int fd, int *nrequests))
+{
+  pthread_t tid;
+  int i;
+  conn_pool *pool = Calloc(1, sizeof(conn_pool));
+  pool->buf = Calloc(qsize, sizeof(struct pool_conn));
+  pool->n = qsize;
+  pool->front = pool->rear = 0;
+  pool->count = 0;
+  Sem_init(&pool->mutex, 0, 1);
+  Sem_init(&pool->slots, 0, qsize);
+  Sem_init(&pool->items, 0, 0);
+  pool->overload = overload;
+  pool->handler = handler;
+  if ((pool->epfd = epoll_create1(0)) < 0) {
+    unix_error("epoll_create1 error");
+  }
+  pthread_mutex_init(&pool->park_lock, NULL);
+  pool->parked_head = pool->parked_tail = NULL;
+  for (i = 0; i < nworkers; i++) {
+    Pthread_create(&tid, NULL, pool_worker, pool);
+  }
+  Pthread_create(&tid, NULL, park_thread, pool);
+  return pool;
+}
+
+/*
+ * pool_submit - this function queues the connected descriptor connfd
+ * for the next idle worker. If the queue is full, what happens depends
+ * on the pool's overload policy.
+ */
+void pool_submit(conn_pool *pool, int connfd)
+{
+  queue_conn(pool, connfd, 0, 1);
+}
+
+/*
+ * queue_conn - this function is pool_submit for a connection that was
+ * already served nrequests requests. Under POOL_BLOCK it only waits for
+ * a slot if wait is set. Otherwise it returns -1 if there is none, and
+ * the connection is left to the caller. It returns 0 if the connection
+ * was queued, or turned away.
+ */
+static int queue_conn(conn_pool *pool, int connfd, int nrequests, int wait)
+{
+  if (pool->overload == POOL_BLOCK && wait) {
+    P(&pool->slots); //wait for an available slot
+  }
+  else {
+    while (sem_trywait(&pool->slots) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (pool->overload == POOL_BLOCK) {
+        return -1;
+      }
+      if (pool->overload == POOL_SHED) {
+        pool_shed(connfd);
+        return 0;
+      }
+      pool_grow(pool);
+    }
+  }
+  P(&pool->mutex);
+  pool->rear = (pool->rear + 1) % pool->n;
+  pool->buf[pool->rear].fd = connfd;
+  pool->buf[pool->rear].nrequests = nrequests;
+  pool->count += 1;
+  V(&pool->mutex);
+  V(&pool->items); //announce the connection to the workers
+  return 0;
+}
+
+/*
+ * pool_worker - this is the body of one worker thread. It serves the
+ * queued connections one after the other, for good.
+ */
+static void *pool_worker(void *vargp)
+{
+  conn_pool *pool = vargp;
+  int connfd, nrequests;
+  Pthread_detach(pthread_self());
+  while (1) {
+    P(&pool->items); //wait for a connection
+    P(&pool->mutex);
+    pool->front = (pool->front + 1) % pool->n;
+    connfd = pool->buf[pool->front].fd;
+    nrequests = pool->buf[pool->front].nrequests;
+    pool->count -= 1;
+    V(&pool->mutex);
+    V(&pool->slots); //the slot can be reused
+    if (pool->handler(connfd, &nrequests) == POOL_IDLE) {
+      //a parked connection holds no worker, so it is parked whether or
+      //not others are queued
+      pool_park(pool, connfd, nrequests);
+      continue;
+    }
+    Close(connfd);
+  }
+  return NULL;
+}
+
+/*
+ * pool_park - this function hands the idle connection connfd, which was
+ * served nrequests requests, to the parking thread
+ */
+static void pool_park(conn_pool *pool, int connfd, int nrequests)
+{
+  struct epoll_event ev;
+  struct pool_parked *p = Malloc(sizeof(struct pool_parked));
+  p->fd = connfd;
+  p->nrequests = nrequests;
+  p->since = time(NULL);
+  p->next = NULL;
+  pthread_mutex_lock(&pool->park_lock);
+  p->prev = pool->parked_tail;
+  if (pool->parked_tail != NULL) {
+    pool->parked_tail->next = p;
+  }
+  else {
+    pool->parked_head = p;
+  }
+  pool->parked_tail = p;
+  //one event is enough, the connection goes back to the workers
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+  ev.data.ptr = p;
+  if (epoll_ctl(pool->epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+    park_unlink(pool, p);
+    pthread_mutex_unlock(&pool->park_lock);
+    Close(connfd);
+    Free(p);
+    return;
+  }
+  pthread_mutex_unlock(&pool->park_lock);
+}
+
+/*
+ * park_thread - this is the body of the parking thread. Parked
+ * connections whose client sent something are queued for the workers,
+ * and those idle for client_idle_timeout seconds are closed.
+ */
+static void *park_thread(void *vargp)
+{
+  conn_pool *pool = vargp;
+  struct epoll_event events[POOL_MAX_EVENTS];
+  struct pool_parked *p;
+  time_t now;
+  int i, n;
+  Pthread_detach(pthread_self());
+  while (1) {
+    //wake up every second to close the connections that have been idle
+    //for too long
+    n = epoll_wait(pool->epfd, events, POOL_MAX_EVENTS, 1000);
+    for (i = 0; i < n; i++) {
+      p = events[i].data.ptr;
+      pthread_mutex_lock(&pool->park_lock);
+      park_unlink(pool, p);
+      pthread_mutex_unlock(&pool->park_lock);
+      //removed before a worker can close it and the number is reused
+      epoll_ctl(pool->epfd, EPOLL_CTL_DEL, p->fd, NULL);
+      //waiting for a slot here would hold up every parked connection,
+      //and their timeouts
+      if (queue_conn(pool, p->fd, p->nrequests, 0) < 0) {
+        //the workers are swamped, the client has to ask again on a new
+        //connection, like after any idle keep-alive connection is closed
+        Close(p->fd);
+      }
+      Free(p);
+    }
+    now = time(NULL);
+    while (1) {
+      pthread_mutex_lock(&pool->park_lock);
+      p = pool->parked_head;
+      if (p == NULL || now - p->since < client_idle_timeout) {
+        pthread_mutex_unlock(&pool->park_lock);
+        break;
+      }
+      park_unlink(pool, p);
+      pthread_mutex_unlock(&pool->park_lock);
+      //closing it also takes it out of the epoll instance
+      Close(p->fd);
+      Free(p);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * park_unlink - this function takes p off the list of parked
+ * connections. The caller must hold park_lock.
+ */
+static void park_unlink(conn_pool *pool, struct pool_parked *p)
+{
+  if (p->prev != NULL) {
+    p->prev->next = p->next;
+  }
+  else {
+    pool->parked_head = p->next;
+  }
+  if (p->next != NULL) {
+    p->next->prev = p->prev;
+  }
+  else {
+    pool->parked_tail = p->prev;
+  }
+}
+
+/*
+ * pool_grow - this function doubles the number of slots in the queue,
+ * keeping the queued connections in order, and posts the new slots
+ */
+static void pool_grow(conn_pool *pool)
+{
+  int i, old_n;
+  P(&pool->mutex);
+  old_n = pool->n;
+  struct pool_conn *buf = Calloc(2 * old_n, sizeof(struct pool_conn));
+  for (i = 1; i <= pool->count; i++) {
+    buf[i] = pool->buf[(pool->front + i) % old_n];
+  }
+  Free(pool->buf);
+  pool->buf = buf;
+  pool->n = 2 * old_n;
+  pool->front = 0;
+  pool->rear = pool->count;
+  V(&pool->mutex);
+  //every slot added is a free one
+  for (i = 0; i < old_n; i++) {
+    V(&pool->slots);
+  }
+}
+
+/*
+ * pool_shed - this function turns a connection away because every
+ * worker is busy and the queue is full
+ */
+static void pool_shed(int connfd)
+{
+  gather g;
+  build_clienterror(&g, "proxy", "503", "Service Unavailable",
+    "Proxy is overloaded, try again later");
+  //a client that doesn't take the error is simply dropped
+  gather_writen(connfd, &g);
+  Close(connfd);
+}
@@ -0,0 +1,65 @@
+/*
+ * pool.h - fixed pool of worker threads fed by a bounded queue of
+ * accepted connections, used by the threaded proxy
+ */
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include "csapp.h"
+
+/* Sizes used unless the proxy is told otherwise */
+#define POOL_DEFAULT_WORKERS 64
+#define POOL_DEFAULT_QUEUE 256
+
+/* What pool_submit does when every slot of the queue is taken */
+#define POOL_BLOCK 0 //wait for a worker to take a connection
+#define POOL_SHED 1 //answer 503 Service Unavailable and close
+#define POOL_QUEUE 2 //grow the queue and keep the connection
+
+/* What the handler returns when it is done with a connection */
+#define POOL_CLOSE 0 //the connection is over
+#define POOL_IDLE 1 //the client may send another request, later
+
+/* Most events the parking thread handles per epoll_wait */
+#define POOL_MAX_EVENTS 64
+
+/* A queued connection */
+struct pool_conn{
+  int fd; //the connected descriptor
+  int nrequests; //requests it was served before it was parked
+};
+
+/* A connection parked while its client is idle, see pool_park */
+struct pool_parked{
+  int fd;
+  int nrequests;
+  time_t since; //when it was parked
+  struct pool_parked *prev; //links in the list of parked connections,
+  struct pool_parked *next; //oldest first
+};
+
+/* Queue of accepted connections, the sbuf of the CS:APP text */
+struct conn_pool{
+  struct pool_conn *buf; //ring buffer of connections
+  int n; //number of slots in buf
+  int front; //buf[(front+1)%n] is the first connection
+  int rear; //buf[rear] is the last connection
+  int count; //number of queued connections
+  sem_t mutex; //protects buf, n, front, rear and count
+  sem_t slots; //counts free slots
+  sem_t items; //counts queued connections
+  int overload; //POOL_BLOCK, POOL_SHED or POOL_QUEUE
+  int (*handler)(int fd, int *nrequests); //serves one connection
+  int epfd; //epoll instance the parked connections are watched with
+  pthread_mutex_t park_lock; //protects the list of parked connections
+  struct pool_parked *parked_head;
+  struct pool_parked *parked_tail;
+};
+
+typedef struct conn_pool conn_pool;
+
+conn_pool *pool_start(int nworkers, int qsize, int overload,
+	int (*handler)(int fd, int *nrequests));
+void pool_submit(conn_pool *pool, int connfd);
+
+#endif /* __POOL_H__ */
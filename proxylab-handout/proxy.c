@@ -1,391 +1,1347 @@
+/*
+ * proxy.c
+ * dsgoel - Druhin Sagar Goel
+ * abist - Aditya Bist
+ *
+ * Proxy Lab - In this lab, we made a web proxy in 3 total steps.
+               We started out with making a sequential proxy server,
+               which simply makes a contact to the web via our server,
+               and then forwards the client's request to the web server,
+               reads the server's response and then forwards the response
+               to the client. This web server only looks at static requests.
+
+               The next part of this lab converts out sequential proxy to
+               a concurrent one. This is done by using the pthread library,
+               and usage of threads to divide the work parallely instead
+               of sequential methods.
+
+               The last part of the proxy lab, enhances the proxy using
+               caches to save visited pages to reload them. This was similar
+               to the cache lab, where caches were hit according to the url
+               visited.
+ */
+
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <limits.h>
 #include "csapp.h"
-
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+#include "cache.h"
+#include "proxy.h"
+#include "event.h"
+#include "pool.h"
+#include "http.h"
+#include "upstream.h"
+#include "dns.h"
+#include "snapshot.h"
+#include "inflight.h"
+#include "request.h"
+#include "scan.h"
+#include "gather.h"
+#include "arena.h"
 
 /* You won't lose style points for including these long lines in your code */
-static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
-static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
-
-void doit(int fd);
-void read_requesthdrs(rio_t *rp, char *host_header, char *remaining_headers);
-int parse_uri(char *uri, char *hostname, char *path, char *port);
-void clienterror(int fd, char *cause, char *errnum, 
+#define USER_AGENT_HDR "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n"
+#define ACCEPT_HDR "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+#define ACCEPT_ENCODING_HDR "Accept-Encoding: gzip, deflate\r\n"
+
+/* The parts of the requests to servers and of the error pages that never
+   change, put together once here rather than for every message */
+static const char keepalive_version[] = " HTTP/1.1\r\nHost: ";
+static const char close_version[] = " HTTP/1.0\r\nHost: ";
+static const char keepalive_headers[] = "\r\n" USER_AGENT_HDR ACCEPT_HDR
+  ACCEPT_ENCODING_HDR "Connection: keep-alive\r\n";
+static const char close_headers[] = "\r\n" USER_AGENT_HDR ACCEPT_HDR
+  ACCEPT_ENCODING_HDR "Connection: close\r\nProxy-Connection: close\r\n";
+static const char error_head[] = "\r\nContent-type: text/html\r\n"
+  "Content-length: ";
+static const char error_body_start[] = "<html><title>Tiny Error</title>"
+  "<body bgcolor=ffffff>\r\n";
+static const char error_body_end[] = "\r\n<hr><em>The Tiny Web server</em>\r\n";
+
+int serve_client(int fd, int *nrequests);
+int doit(int fd, rio_t *rp);
+int fetch_response(int fd, char *hostname, int port, gather *request,
+	int authorized, cache_buf *response, inflight *flight,
+	cache_node *stale, http_frame *frame);
+int follow_flight(int fd, inflight *flight, int version, int keepalive,
+	int *framed);
+int send_hit(int fd, cache_node *p, int keepalive);
+ssize_t splice_chunk(int from, int to, int *pipefd, size_t len);
+int read_request(rio_t *rp, http_request *r);
+int forward_header(const request_header *h);
+void clienterror(int fd, char *cause, char *errnum,
 		 char *shortmsg, char *longmsg);
-void compile_request(char * request, char *host_header, char* path, 
-	char *remaining_headers);
-void *doit_thread(void *vargp);
+void *accept_thread(void *vargp);
+void *stats_thread(void *vargp);
+void *snapshot_thread(void *vargp);
+size_t parse_size(char *s);
+size_t resident_bytes(void);
+void usage(char *prog);
+
 
-/* Locking */
-pthread_rwlock_t lock;
+/* Global variables */
 
-/* Cache data structures */
+cache *proxy_cache; //cache to be used by the proxy
+conn_pool *pool; //worker pool of the threaded proxy
+static __thread arena request_arena; //memory of the request a worker serves
+int client_idle_timeout = CLIENT_DEFAULT_IDLE_TIMEOUT;
+int client_max_requests = CLIENT_DEFAULT_MAX_REQUESTS;
+size_t client_buffer_size = RIO_BUFSIZE;
 
-struct cache_node{
-	char *url;
-	char *data;
-	unsigned int data_size;
-	struct cache_node *prev;
-	struct cache_node *next;
+/* What an accept thread of the threaded proxy is started with */
+struct accept_args{
+  int listenfd; //listening socket the thread accepts from
+  int cpu; //CPU to run the thread on, -1 to let it run anywhere
 };
 
-typedef struct cache_node cache_node;
 
-struct cache{
-	unsigned int cache_size;
-	struct cache_node *start;
-	struct cache_node *end;
-};
+/* Proxy implementation */
 
-typedef struct cache cache;
+/*
+ * usage - prints the command line options and exits
+ */
+void usage(char *prog)
+{
+  fprintf(stderr, "usage: %s [-m threads|epoll] [-t threads] [-q slots] "
+    "[-o block|shed|queue] [-s shards] [-e lru|clock] [-a all|tinylfu] "
+    "[-r] [-c] [-i seconds] [-x requests] [-b bytes] [-k seconds] "
+    "[-n conns] "
+    "[-d system|hosts|ip[:port]] [-C bytes] [-O bytes] [-D dir] "
+    "[-B bytes] [-W file] [-S seconds] [-T seconds] <port>\n",
+    prog);
+  fprintf(stderr, "  -m model   I/O model (default threads)\n");
+  fprintf(stderr, "  -t threads number of worker threads (default %d), or of "
+    "event loop threads in epoll mode (default: one per CPU)\n",
+    POOL_DEFAULT_WORKERS);
+  fprintf(stderr, "  -q slots   connections queued for the workers "
+    "(default %d)\n", POOL_DEFAULT_QUEUE);
+  fprintf(stderr, "  -o policy  what to do with connections when the queue "
+    "is full (default block)\n");
+  fprintf(stderr, "  -r         one SO_REUSEPORT listening socket per "
+    "accept thread (one per CPU) or event loop\n");
+  fprintf(stderr, "  -c         pin accept threads or event loops to CPUs\n");
+  fprintf(stderr, "  -i seconds time a client connection may wait for "
+    "its next request (default %d)\n", CLIENT_DEFAULT_IDLE_TIMEOUT);
+  fprintf(stderr, "  -x requests requests served per client connection, "
+    "1 turns keep-alive off (default %d)\n", CLIENT_DEFAULT_MAX_REQUESTS);
+  fprintf(stderr, "  -b bytes   read buffer of each client connection, "
+    "the most a request head may take (default %d)\n", RIO_BUFSIZE);
+  fprintf(stderr, "  -k seconds idle time of kept-alive server connections, "
+    "0 closes them after every response (default %d)\n",
+    UPSTREAM_DEFAULT_IDLE_TIMEOUT);
+  fprintf(stderr, "  -n conns   idle connections kept per server "
+    "(default %d)\n", UPSTREAM_DEFAULT_MAX_IDLE);
+  fprintf(stderr, "  -d source  where server names are looked up: the "
+    "system's nameservers, the hosts file only, or the nameserver at "
+    "ip:port (default system)\n");
+  fprintf(stderr, "  -s shards  number of cache shards (default %d)\n",
+    CACHE_DEFAULT_SHARDS);
+  fprintf(stderr, "  -e policy  cache eviction policy (default lru)\n");
+  fprintf(stderr, "  -a policy  cache admission policy (default all)\n");
+  fprintf(stderr, "  -C bytes   memory the cache may use, k, m and g "
+    "suffixes allowed (default %d)\n", MAX_CACHE_SIZE);
+  fprintf(stderr, "  -O bytes   biggest response that is kept in memory "
+    "(default %d)\n", MAX_OBJECT_SIZE);
+  fprintf(stderr, "  -D dir     keep a second tier of the cache on disk, in "
+    "dir (default: none)\n");
+  fprintf(stderr, "  -B bytes   disk space the second tier may use "
+    "(default %ld)\n", DISK_DEFAULT_SIZE);
+  fprintf(stderr, "  -W file    save the cache to file on SIGTERM or SIGINT, "
+    "and load it from there at startup (default: none)\n");
+  fprintf(stderr, "  -S seconds print the cache's memory use against the "
+    "proxy's RSS this often (default: never)\n");
+  fprintf(stderr, "  -T seconds how long responses that don't say are fresh "
+    "for, unless they have a Last-Modified (default %d)\n",
+    HTTP_DEFAULT_TTL);
+  exit(1);
+}
 
-cache *proxy_cache;
+int main(int argc, char **argv)
+{
+  int port, opt, i;
+  int nshards = CACHE_DEFAULT_SHARDS;
+  int policy = CACHE_LRU;
+  int admission = CACHE_ADMIT_ALL;
+  int model = PROXY_THREADS;
+  int nthreads = 0;
+  int qsize = POOL_DEFAULT_QUEUE;
+  int overload = POOL_BLOCK;
+  int reuseport = 0;
+  int pin = 0;
+  int nlisteners = 1;
+  int *listenfds;
+  int idle_timeout = UPSTREAM_DEFAULT_IDLE_TIMEOUT;
+  int max_idle = UPSTREAM_DEFAULT_MAX_IDLE;
+  int dns_mode = DNS_SYSTEM;
+  char *dns_server = NULL;
+  size_t cache_bytes = MAX_CACHE_SIZE;
+  size_t object_bytes = MAX_OBJECT_SIZE;
+  char *disk_dir = NULL;
+  size_t disk_bytes = DISK_DEFAULT_SIZE;
+  int stats_interval = 0;
+  char *snapshot_path = NULL;
+  sigset_t stop_signals;
 
-/* Cache functions */
+  /* Check command line args */
+  while ((opt = getopt(argc, argv, "m:t:q:o:rci:x:b:k:n:d:s:e:a:C:O:D:B:W:S:T:")) != -1) {
+    switch (opt) {
+    case 'm':
+      if (strcmp(optarg, "threads") == 0) {
+        model = PROXY_THREADS;
+      }
+      else if (strcmp(optarg, "epoll") == 0) {
+        model = PROXY_EPOLL;
+      }
+      else {
+        usage(argv[0]);
+      }
+      break;
+    case 't':
+      nthreads = atoi(optarg);
+      if (nthreads < 1) {
+        usage(argv[0]);
+      }
+      break;
+    case 'q':
+      qsize = atoi(optarg);
+      if (qsize < 1) {
+        usage(argv[0]);
+      }
+      break;
+    case 'o':
+      if (strcmp(optarg, "block") == 0) {
+        overload = POOL_BLOCK;
+      }
+      else if (strcmp(optarg, "shed") == 0) {
+        overload = POOL_SHED;
+      }
+      else if (strcmp(optarg, "queue") == 0) {
+        overload = POOL_QUEUE;
+      }
+      else {
+        usage(argv[0]);
+      }
+      break;
+    case 'r':
+      reuseport = 1;
+      break;
+    case 'c':
+      pin = 1;
+      break;
+    case 'i':
+      client_idle_timeout = atoi(optarg);
+      if (client_idle_timeout < 1) {
+        usage(argv[0]);
+      }
+      break;
+    case 'x':
+      client_max_requests = atoi(optarg);
+      if (client_max_requests < 1) {
+        usage(argv[0]);
+      }
+      break;
+    case 'b':
+      client_buffer_size = parse_size(optarg);
+      if (client_buffer_size == 0 || client_buffer_size > INT_MAX) {
+        usage(argv[0]);
+      }
+      break;
+    case 'k':
+      idle_timeout = atoi(optarg);
+      if (idle_timeout < 0) {
+        usage(argv[0]);
+      }
+      break;
+    case 'n':
+      max_idle = atoi(optarg);
+      if (max_idle < 1) {
+        usage(argv[0]);
+      }
+      break;
+    case 'd':
+      if (strcmp(optarg, "system") == 0) {
+        dns_mode = DNS_SYSTEM;
+      }
+      else if (strcmp(optarg, "hosts") == 0) {
+        dns_mode = DNS_HOSTS;
+      }
+      else {
+        dns_mode = DNS_SERVER;
+        dns_server = optarg;
+      }
+      break;
+    case 's':
+      nshards = atoi(optarg);
+      if (nshards < 1 || nshards > CACHE_MAX_SHARDS) {
+        usage(argv[0]);
+      }
+      break;
+    case 'e':
+      if (strcmp(optarg, "lru") == 0) {
+        policy = CACHE_LRU;
+      }
+      else if (strcmp(optarg, "clock") == 0) {
+        policy = CACHE_CLOCK;
+      }
+      else {
+        usage(argv[0]);
+      }
+      break;
+    case 'a':
+      if (strcmp(optarg, "all") == 0) {
+        admission = CACHE_ADMIT_ALL;
+      }
+      else if (strcmp(optarg, "tinylfu") == 0) {
+        admission = CACHE_ADMIT_TINYLFU;
+      }
+      else {
+        usage(argv[0]);
+      }
+      break;
+    case 'C':
+      cache_bytes = parse_size(optarg);
+      if (cache_bytes == 0) {
+        usage(argv[0]);
+      }
+      break;
+    case 'O':
+      object_bytes = parse_size(optarg);
+      if (object_bytes == 0) {
+        usage(argv[0]);
+      }
+      break;
+    case 'D':
+      disk_dir = optarg;
+      break;
+    case 'B':
+      disk_bytes = parse_size(optarg);
+      if (disk_bytes == 0) {
+        usage(argv[0]);
+      }
+      break;
+    case 'W':
+      snapshot_path = optarg;
+      break;
+    case 'S':
+      stats_interval = atoi(optarg);
+      if (stats_interval < 1) {
+        usage(argv[0]);
+      }
+      break;
+    case 'T':
+      http_default_ttl = atoi(optarg);
+      if (http_default_ttl < 0) {
+        usage(argv[0]);
+      }
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+  }
+  //handling the SIGPIPE signal
+  Signal(SIGPIPE, SIG_IGN); //ignore the SIGPIPE
+  port = atoi(argv[optind]);
+  if (snapshot_path != NULL) {
+    //blocked before any thread is started, so that only the snapshot
+    //thread ever sees them
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+  }
+  proxy_cache = initialize_cache(nshards, policy, admission, cache_bytes,
+    object_bytes, disk_dir != NULL ? disk_open(disk_dir, disk_bytes) :
+    NULL); //intitialize cache
+  if (snapshot_path != NULL) {
+    pthread_t tid;
+    long loaded = snapshot_load(proxy_cache, snapshot_path);
+    if (loaded >= 0) {
+      fprintf(stderr, "snapshot: loaded %ld objects from %s\n", loaded,
+        snapshot_path);
+    }
+    Pthread_create(&tid, NULL, snapshot_thread, snapshot_path);
+  }
+  if (stats_interval > 0) {
+    pthread_t tid;
+    Pthread_create(&tid, NULL, stats_thread, (void *)(long)stats_interval);
+  }
+  upstream_init(idle_timeout, max_idle);
+  dns_init(dns_mode, dns_server);
+  if (model == PROXY_EPOLL && nthreads == 0) {
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (reuseport) {
+    //one listening socket per event loop, or per CPU for the accept
+    //threads, and the kernel spreads the connections across them
+    nlisteners = (model == PROXY_EPOLL) ? nthreads :
+      sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  listenfds = Malloc(nlisteners * sizeof(int));
+  for (i = 0; i < nlisteners; i++) {
+    listenfds[i] = reuseport ? Open_listenfd_reuseport(port) :
+      Open_listenfd(port);
+  }
+  if (model == PROXY_EPOLL) {
+    event_run(listenfds, nlisteners, nthreads, pin); //never returns
+  }
+  if (nthreads == 0) {
+    nthreads = POOL_DEFAULT_WORKERS;
+  }
+  //the workers are started once, accepted connections are queued for
+  //them and each one is served by whichever worker takes it
+  pool = pool_start(nthreads, qsize, overload, serve_client);
+  //every listening socket gets its own accept loop, the last one runs
+  //in this thread
+  for (i = 0; i < nlisteners; i++) {
+    pthread_t tid;
+    struct accept_args *args = Malloc(sizeof(struct accept_args));
+    args->listenfd = listenfds[i];
+    args->cpu = pin ? i % sysconf(_SC_NPROCESSORS_ONLN) : -1;
+    if (i < nlisteners - 1) {
+      Pthread_create(&tid, NULL, accept_thread, args);
+    }
+    else {
+      accept_thread(args);
+    }
+  }
+  return 0;
+}
 
-void fix_linking(cache_node *p, cache *c_cache);
-cache_node *check_for_hit(cache *c_cache, char *query);
-void add_to_cache(cache *c_cache, char *query, char *q_data, 
-	unsigned int q_size);
-void delete_from_cache(cache *c_cache);
-cache *initialize_cache();
+/*
+ * accept_thread - this is one accept loop of the threaded proxy. It
+ * accepts connections on its listening socket and queues them for the
+ * worker pool, for good.
+ */
+void *accept_thread(void *vargp)
+{
+  struct accept_args *args = vargp;
+  int listenfd = args->listenfd;
+  int clientlen;
+  struct sockaddr_in clientaddr;
+  if (args->cpu >= 0) {
+    pin_to_cpu(args->cpu);
+  }
+  Free(vargp);
+  while (1) {
+    clientlen = sizeof(clientaddr);
+    int connfd = Accept(listenfd, (SA *)&clientaddr, (socklen_t *)&clientlen);
+    pool_submit(pool, connfd);
+  }
+  return NULL;
+}
 
+/*
+ * stats_thread - this thread prints a line to stderr every interval
+ * seconds with the memory the cache accounts for, its budget, and the
+ * resident size of the whole proxy, to check the accounting against
+ */
+void *stats_thread(void *vargp)
+{
+  int interval = (long)vargp;
+  size_t nobjects, used;
+  Pthread_detach(pthread_self());
+  while (1) {
+    sleep(interval);
+    used = cache_used(proxy_cache, &nobjects);
+    fprintf(stderr, "stats: %zu objects, %zu bytes accounted of %zu, "
+      "rss %zu bytes\n", nobjects, used, proxy_cache->max_size,
+      resident_bytes());
+  }
+  return NULL;
+}
 
-cache *initialize_cache(){
-	cache *proxy_cache = Calloc(1, sizeof(cache));
-	proxy_cache->start = NULL;
-	proxy_cache->end = NULL;
-	proxy_cache->cache_size = 0;
-	return proxy_cache;
+/*
+ * snapshot_thread - this thread waits for SIGTERM or SIGINT, which every
+ * thread has blocked, saves the cache to the file vargp and ends the
+ * proxy
+ */
+void *snapshot_thread(void *vargp)
+{
+  char *path = vargp;
+  sigset_t set;
+  int sig;
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGINT);
+  Pthread_detach(pthread_self());
+  sigwait(&set, &sig);
+  if (snapshot_save(proxy_cache, path) < 0) {
+    fprintf(stderr, "snapshot: could not save the cache to %s\n", path);
+    exit(1);
+  }
+  exit(0);
 }
 
-void fix_linking(cache_node *p, cache *c_cache){
-	if (p->prev != NULL){
-		if (p->next == NULL){
-			p->prev->next = NULL;
-			c_cache->end = p->prev;
-		}
-		else {
-			p->prev->next = p->next;
-			p->next->prev = p->prev;
-		}
-		p->next = c_cache->start;
-		c_cache->start->prev = p;
-		p->prev = NULL;
-		c_cache->start = p;
-	}
+/*
+ * resident_bytes - this function returns the resident set size of the
+ * proxy, or 0 if it can't be read
+ */
+size_t resident_bytes(void)
+{
+  unsigned long size, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f != NULL) {
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2) {
+      resident = 0;
+    }
+    fclose(f);
+  }
+  return resident * getpagesize();
 }
 
-cache_node *check_for_hit(cache *c_cache, char *query){
-	pthread_rwlock_wrlock(&lock);
-	// printf("%s:%s\n", "Checking for hit in cache", query);
-	cache_node *p = c_cache->start;
-	while (p != NULL){
-		if (strcmp(p->url, query) == 0){
-			// printf("Hit! : %s\n", p->url);
-			fix_linking(p, c_cache);
-			break;
-		}
-		p = p->next;
-	}
-	// pthread_rwlock_unlock(&lock);
-	return p;
+/*
+ * parse_size - this function returns the number of bytes s stands for,
+ * a number optionally followed by k, m or g, or 0 if s isn't one
+ */
+size_t parse_size(char *s)
+{
+  char *end;
+  unsigned long long n = strtoull(s, &end, 10);
+  switch (*end) {
+  case 'g': case 'G':
+    n <<= 10;
+    /* fall through */
+  case 'm': case 'M':
+    n <<= 10;
+    /* fall through */
+  case 'k': case 'K':
+    n <<= 10;
+    end++;
+    break;
+  }
+  if (end == s || *end != '\0') {
+    return 0;
+  }
+  return n;
 }
 
-void add_to_cache(cache *c_cache, char *query, char *q_data, unsigned int q_size){
-	if (!(q_size > MAX_OBJECT_SIZE)){
-		pthread_rwlock_wrlock(&lock);
-		// printf("%s:%s\n", "Adding to cache", query);
-		cache_node *to_add = Calloc(1, sizeof(cache_node));
-		to_add->url = Calloc(strlen(query) + 1, sizeof(char));
-		strcpy(to_add->url, query);
-		to_add->data = Malloc(q_size);
-		memcpy(to_add->data, q_data, q_size);
-		to_add->data_size = q_size;
-		if (c_cache->start == NULL){
-			to_add->prev = NULL;
-			to_add->next = NULL;
-			c_cache->start = to_add;
-			c_cache->end = to_add;
-		}
-		else {
-			to_add->prev = NULL;
-			to_add->next = c_cache->start;
-			c_cache->start->prev = to_add;
-			c_cache->start = to_add;
-		}
-		c_cache->cache_size += q_size;
-		while (c_cache->cache_size > MAX_CACHE_SIZE){
-			delete_from_cache(c_cache);
-		}
-		pthread_rwlock_unlock(&lock);
-	}
+/*
+ * pin_to_cpu - this function restricts the calling thread to run on the
+ * given CPU only. Failing to do so is not fatal, the thread just keeps
+ * running wherever the scheduler puts it.
+ */
+void pin_to_cpu(int cpu)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
 }
 
-void delete_from_cache(cache *c_cache){
-	if (c_cache->end != NULL){
-		// printf("%s\n", "Deleting from cache");
-		// pthread_rwlock_wrlock(&lock);
-		c_cache->cache_size -= c_cache->end->data_size;
-		if (c_cache->end->prev != NULL){
-			c_cache->end->prev->next = NULL;
-		}
-		cache_node *temp = c_cache->end;
-		Free(temp->url);
-		Free(temp->data);
-		c_cache->end = c_cache->end->prev;
-		Free(temp);
-		// pthread_rwlock_unlock(&lock);
-	}
-	
-	
-	
+
+
+/*
+ * serve_client - this function serves the requests of one client
+ * connection, one after the other, for as long as the client sends them
+ * back to back. Since they are all read through the same rio buffer,
+ * requests the client pipelined behind the current one are not lost, and
+ * they are answered in order. *nrequests counts the requests served on
+ * the connection. It returns POOL_IDLE if the client may send another
+ * request but hasn't yet, for the pool to wait for it without tying up
+ * the worker, and POOL_CLOSE if the connection is over.
+ */
+
+int serve_client(int fd, int *nrequests)
+{
+  rio_t rio;
+  char *buf = NULL;
+  int rc = POOL_CLOSE;
+  struct timeval timeout;
+  //a client that doesn't send its next request in time is dropped,
+  //reads from it fail with EAGAIN
+  timeout.tv_sec = client_idle_timeout;
+  timeout.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  //the request heads are parsed in the read buffer, so its size is the
+  //most a head may take
+  if (client_buffer_size == RIO_BUFSIZE) {
+    Rio_readinitb(&rio, fd);
+  }
+  else {
+    buf = Malloc(client_buffer_size);
+    rio_readinitbuf(&rio, fd, buf, client_buffer_size);
+  }
+  while (doit(fd, &rio)) {
+    *nrequests += 1;
+    if (*nrequests >= client_max_requests) {
+      break;
+    }
+    if (rio.rio_cnt == 0) {
+      //nothing was pipelined, so no byte is lost with the buffer
+      rc = POOL_IDLE;
+      break;
+    }
+  }
+  Free(buf);
+  return rc;
 }
 
+/*
+ * doit -  The doit function handles the requests of the client.
+ * It first reads the request from the client and then checks whether
+ * the request has been cached in the proxy server's cache. If so, 
+ * the data associated with the request is written to the client without
+ * opening a connection with the server. Otherwise, a connection to the 
+ * server is opened, a request to be sent to the server is compiled, 
+ * the request is written to the server, the server's response is read,
+ * and this response is then written to the client. Also this response 
+ * is cached in the proxy server's cache. 
+ * It returns 1 if the connection can be used for another request, that
+ * is if the client asked for that and the response told the client where
+ * it ends, and 0 if the connection has to be closed.
+ */
 
-/* Proxy implementation */
+int doit(int fd, rio_t *rp)
+{
+  char *uri, *hostname, *path, *port;
+  gather *request;
+  http_request *req;
+  int keepalive, framed, head_len;
 
-int main(int argc, char **argv) 
+  //what the last request took from the worker's arena is reused for
+  //this one, rather than being on the stack
+  arena_reset(&request_arena);
+  req = arena_alloc(&request_arena, sizeof(http_request));
+  //read the head of the request, which is parsed where it was read.
+  //End of file or a timeout here simply means the client is done with
+  //the connection
+  if ((head_len = read_request(rp, req)) <= 0) {
+    if (head_len == REQUEST_BAD) {
+      clienterror(fd, "request", "400", "Bad Request",
+        "Proxy could not read the request header");
+    }
+    return 0;
+  }
+  //the head was read whole, so the next request starts in the right
+  //place even on a hit. The request is checked to be a GET request
+  if (req->method_len != 3 || strncasecmp(req->method, "GET", 3) != 0) {
+    clienterror(fd, arena_strndup(&request_arena, req->method,
+      req->method_len), "501", "Not Implemented",
+      "Proxy does not implement this method");
+    return 0;
+  }
+  //the uri is the key into the cache
+  uri = arena_strndup(&request_arena, req->uri, req->uri_len);
+  keepalive = request_keepalive(req);
+  //we first check if the given request has been cached. An object that
+  //is no longer fresh can only be sent once the server says it hasn't
+  //changed
+  cache_node *cache_hit = check_for_hit(proxy_cache, uri);
+  cache_node *stale = NULL;
+  if (cache_hit != NULL && !cache_node_fresh(cache_hit)){
+    stale = cache_hit;
+    cache_hit = NULL;
+  }
+  if (cache_hit != NULL){
+    //we found it in the cache, so we simply write the associated
+    //data to the client. No lock is held here, other threads can use
+    //the cache while we write, our reference keeps the node alive
+    if (send_hit(fd, cache_hit, keepalive) < 0){
+      //if the write failed we simply close the connection
+      keepalive = 0;
+    }
+    release_cache_node(cache_hit);
+    return keepalive;
+  }
+
+ /* the data we're looking for hasn't been cached, so we now need to
+  * compile a request, connect with the server, write the request to the
+  * server, read a response from the server, write that response to the
+  * client and store the response in the cache
+  */
+  //parse the uri to get the hostname, path and port number, none of
+  //which is longer than the uri or the defaults "/" and "80"
+  hostname = arena_alloc(&request_arena, req->uri_len + 3);
+  path = arena_alloc(&request_arena, req->uri_len + 3);
+  port = arena_alloc(&request_arena, req->uri_len + 3);
+  if (parse_uri(uri, hostname, path, port) < 0) {
+    if (stale != NULL) {
+      release_cache_node(stale);
+    }
+    return 0;
+  }
+  //lists the pieces of the request to be sent to the server, most of
+  //them are where the client's request was read
+  request = arena_alloc(&request_arena, sizeof(gather));
+  compile_request(request, req, hostname, path);
+  //a stale object is revalidated with a conditional request, if it has
+  //what it takes, and fetched again like a miss otherwise
+  if (stale != NULL &&
+      revalidate_request(&request_arena, request, req, stale) < 0) {
+    release_cache_node(stale);
+    stale = NULL;
+  }
+
+  //if another client is already fetching this url, we relay its
+  //response as it arrives rather than fetching it a second time.
+  //Revalidations aren't shared, they don't bring a body back
+  int leader = 1;
+  inflight *flight = NULL;
+  if (stale == NULL) {
+    flight = inflight_join(uri, proxy_cache->max_object, &leader);
+  }
+  if (!leader) {
+    int rc = follow_flight(fd, flight, req->version, keepalive, &framed);
+    if (rc < 0) {
+      return 0;
+    }
+    if (rc == 0) {
+      return keepalive && framed;
+    }
+    //the fetch failed before we sent anything, so we do it ourselves
+    flight = NULL;
+  }
+
+  //this is for storing the response, and for what its head says and
+  //how it is framed for the client
+  cache_buf response;
+  http_frame *frame = arena_alloc(&request_arena, sizeof(http_frame));
+  cache_buf_init(&response, proxy_cache);
+  http_out_init(&frame->out, req->version, keepalive);
+  //send the request and relay the response, whose bytes we keep in
+  //response so that we can cache them
+  int rc = fetch_response(fd, hostname, atoi(port), request,
+    request_find(req, "Authorization") != NULL, &response, flight, stale,
+    frame);
+  if (rc == 1) {
+    //the stale object hasn't changed, it is fresh again and is sent
+    //as a hit
+    cache_buf_drop(&response);
+    refresh_object(stale, frame);
+    if (send_hit(fd, stale, keepalive) < 0) {
+      keepalive = 0;
+    }
+    release_cache_node(stale);
+    return keepalive;
+  }
+  if (stale != NULL) {
+    release_cache_node(stale);
+  }
+  if (rc < 0) {
+    cache_buf_drop(&response);
+    if (flight != NULL) {
+      inflight_finish(flight, 0);
+    }
+    return 0;
+  }
+  //now we have the data associated with request, and so we add it
+  //to the cache, which copies response and frees its chunks, if its
+  //head allows it. This comes before the fetch ends, so that the url
+  //is never missing from both the cache and the fetches in flight
+  if (frame->cacheable) {
+    add_to_cache(proxy_cache, uri, &response, frame->head_len,
+      frame->expires, frame->lifetime);
+  }
+  else {
+    cache_buf_drop(&response);
+  }
+  if (flight != NULL) {
+    inflight_finish(flight, 1);
+  }
+  //the client can only tell where the response ends if it wasn't told
+  //the connection closes
+  framed = (frame->out.coding != BODY_CLOSE);
+  return keepalive && framed;
+}
+
+/*
+ * fetch_response - this function sends request to the server at
+ * hostname:port and relays the server's response to the client fd,
+ * collecting it in response as it goes. An idle kept-alive
+ * connection to the server is used if there is one, and the connection
+ * is kept for later once the response has ended. If a kept-alive
+ * connection turns out to have been closed by the server before any of
+ * the response arrived, the request is sent again on a new connection.
+ * Returns 0 if the whole response was relayed, -1 otherwise. frame is
+ * left with what the head of the response says: where it ends, and
+ * whether and for how long it may be cached, which it may not be if
+ * authorized says the request carried credentials and the response
+ * doesn't allow it.
+ * Nothing is relayed until the head is over. The client gets the head
+ * without the hop-by-hop headers, and the body framed as frame->out,
+ * which the caller has set up for the client, says. response collects
+ * the head and the body as they are cached, without the chunked coding.
+ * Once the response is known to be too big for the cache, response
+ * stops collecting it, and the rest of its body is spliced from the
+ * server to the client and never copied into user space, unless the
+ * client gets it in chunks.
+ * If flight isn't NULL, the caller leads that fetch, and the response
+ * is passed on to its followers too, as response collects it. It is
+ * spliced only if there are no followers, and if the client goes away
+ * while there are some, the response is still read to the end for them.
+ * If stale isn't NULL, request is a revalidation of that cached object.
+ * A 304 isn't relayed at all, and 1 is returned for it once it is over:
+ * the caller sends the object instead.
+ */
+int fetch_response(int fd, char *hostname, int port, gather *request,
+  int authorized, cache_buf *response, inflight *flight, cache_node *stale,
+  http_frame *frame)
 {
-    int listenfd, port, clientlen;
-    struct sockaddr_in clientaddr;
+  char *server_buf, *piece;
+  ssize_t len;
+  size_t n, body;
+  int server_fd, reused, eof, failed, in_head;
+  int client_gone = 0;
+  dns_result addrs;
+  int resolved = 0;
+  int pipefd[2] = {-1, -1};
 
-    /* Check command line args */
-    if (argc != 2) {
-		fprintf(stderr, "usage: %s <port>\n", argv[0]);
-		exit(1);
+  //the buffer comes from the worker's arena, which the request is in.
+  //The server is read into it after the room for what the client gets
+  //before the body
+  server_buf = (char *)arena_alloc(&request_arena, HTTP_RELAY_SIZE) +
+    HTTP_RELAY_ROOM;
+  while (1) {
+    //open a connection with the server, or take one that's already open
+    server_fd = upstream_get(hostname, port);
+    reused = (server_fd >= 0);
+    if (reused) {
+      set_nonblocking(server_fd, 0); //it may come from an event loop
     }
-    Signal(SIGPIPE, SIG_IGN);
-    pthread_rwlock_init(&lock, 0);
-    port = atoi(argv[1]);
-    pthread_t tid;
-    proxy_cache = initialize_cache();
-    listenfd = Open_listenfd(port);
-    while (1) {
-		clientlen = sizeof(clientaddr);
-		int *connfdp = Malloc(sizeof(int));
-		*connfdp = Accept(listenfd, (SA *)&clientaddr, (socklen_t *)&clientlen);
-		Pthread_create(&tid, NULL, doit_thread, connfdp);
+    else {
+      //the server's addresses usually come from the resolver's cache
+      if (!resolved && dns_resolve(hostname, &addrs) < 0) {
+        return -1;
+      }
+      resolved = 1;
+      server_fd = upstream_connect(&addrs, port);
+    }
+    if (server_fd < 0){
+      //on failing to connect with the server, we effectively close
+      //the connection with the client as well by returning
+      return -1;
+    }
+    //write the request to the server, all its pieces at once
+    if (gather_writen(server_fd, request) < 0){
+      //if writing request to the server fails, we close the
+      //connection with the server and retry or give up
+      Close(server_fd);
+      if (reused) {
+        continue;
+      }
+      return -1;
+    }
+
+    frame_init(frame, authorized);
+    eof = failed = 0;
+    len = 0;
+    while (!frame_complete(frame, 0)){
+      long long left = frame_passthrough(frame);
+      if (left != 0 && frame->out.coding != BODY_CHUNKED &&
+          (response->full ||
+          (left < 0 ? response->size : response->size + left) >
+            response->limit) &&
+          (flight == NULL || inflight_alone(flight)) &&
+          (pipefd[0] >= 0 || pipe(pipefd) == 0)){
+        //the body won't be cached and needn't be looked at, so it goes
+        //straight from the server to the client
+        len = splice_chunk(server_fd, fd, pipefd, (left < 0 ||
+          left > RELAY_SPLICE_CHUNK) ? RELAY_SPLICE_CHUNK : left);
+        if (len == -2){
+          break; //the client is gone, failed is left for the check below
+        }
+        if (len < 0){
+          failed = 1;
+          break;
+        }
+        if (len == 0){
+          eof = 1;
+          break;
+        }
+        frame_skip(frame, len);
+        cache_buf_skip(response, len);
+        continue;
+      }
+      //read the response from the server and then write to the client
+      if ((len = read(server_fd, server_buf, MAXBUF)) < 0){
+        if (errno == EINTR) {
+          continue;
+        }
+        failed = 1;
+        break;
+      }
+      if (len == 0){
+        eof = 1;
+        break;
+      }
+      //only pass on the bytes that belong to the response
+      in_head = (frame->state == FRAME_HEAD);
+      n = frame_feed(frame, server_buf, len, &body);
+      if (frame->state == FRAME_ERROR){
+        failed = 1;
+        break;
+      }
+      if (n < len){
+        frame->keepalive = 0; //the server sent more than it should have
+      }
+      if (in_head && frame->state != FRAME_HEAD){
+        //the head is over, it says whether the response may be cached,
+        //and the followers only get it if it may
+        if (!frame->cacheable){
+          cache_buf_drop(response);
+        }
+        cache_buf_append(response, frame->head, frame->head_len);
+        if (flight != NULL){
+          inflight_append(flight, frame->head, frame->head_len);
+          inflight_share(flight, frame->cacheable, frame->head_len,
+            frame->length);
+        }
+      }
+      if (frame->state == FRAME_HEAD ||
+          (stale != NULL && frame->status == 304)){
+        //the head isn't over yet, or the object hasn't changed and the
+        //caller sends it
+        continue;
+      }
+      //while we're reading response from the server, we need to keep
+      //storing it so that we can cache it
+      cache_buf_append(response, server_buf, body);
+      if (flight != NULL) {
+        inflight_append(flight, server_buf, body);
+      }
+      piece = http_out_piece(&frame->out, server_buf, &body,
+        in_head ? frame->head : NULL, frame->head_len,
+        frame->state == FRAME_DONE);
+      if (!client_gone && rio_writen(fd, piece, body) < 0){
+        //if write to client fails, close connection with server and
+        //return, thereby closing connection with client. Followers
+        //still need the rest of the response, though
+        if (flight == NULL || inflight_alone(flight)){
+          len = -2;
+          break;
+        }
+        client_gone = 1;
+      }
+    }
+    if (len == -2){
+      break;
+    }
+    if ((eof || failed) && reused && response->size == 0){
+      //the server had closed the kept-alive connection, try a new one
+      Close(server_fd);
+      continue;
+    }
+    break;
+  }
+
+  if (pipefd[0] >= 0){
+    Close(pipefd[0]);
+    Close(pipefd[1]);
+  }
+  if (len != -2 && frame_complete(frame, eof) && !failed){
+    if (!eof && frame->keepalive){
+      upstream_put(hostname, port, server_fd);
+    }
+    else {
+      Close(server_fd);
     }
+    if (eof && frame->out.coding == BODY_CHUNKED && !client_gone){
+      //the server closed to end the body, the client is sent the last
+      //chunk instead. If it is gone, its next read fails
+      body = 0;
+      piece = http_out_piece(&frame->out, server_buf, &body, NULL, 0, 1);
+      rio_writen(fd, piece, body);
+    }
+    return (stale != NULL && frame->status == 304) ? 1 : 0;
+  }
+  Close(server_fd);
+  return -1;
 }
 
-void *doit_thread(void *vargp){
-	int connfd = *((int *)vargp);
-	Pthread_detach(pthread_self());
-	Free(vargp);
-	doit(connfd);
-	Close(connfd);
-	return NULL;
+/*
+ * follow_flight - this function relays to the client fd the response of
+ * a fetch led by another client, as its bytes arrive, and then leaves
+ * the fetch. The response is framed for a client that sent an
+ * HTTP/1.version request and wants the connection kept open if
+ * keepalive is set. It returns 0 once the whole response was relayed,
+ * with *framed set if the client was told where the response ends. It
+ * returns 1 if the fetch failed before any byte was relayed, in which
+ * case the caller can still fetch the response itself, and -1 if the
+ * response was cut short or the client couldn't be written to.
+ */
+int follow_flight(int fd, inflight *flight, int version, int keepalive,
+  int *framed)
+{
+  char *data = (char *)arena_alloc(&request_arena, HTTP_RELAY_SIZE) +
+    HTTP_RELAY_ROOM;
+  char *piece;
+  size_t off = 0, n, len;
+  http_out out;
+  int state;
+
+  http_out_init(&out, version, keepalive);
+  while (1) {
+    n = inflight_read(flight, off, data, MAXBUF, &state);
+    if (n > 0 || state == INFLIGHT_DONE) {
+      len = n;
+      piece = follow_piece(flight, &out, off, data, &len,
+        state == INFLIGHT_DONE);
+      off += n;
+      if (len > 0 && rio_writen(fd, piece, len) < 0) {
+        inflight_leave(flight, off);
+        return -1;
+      }
+    }
+    if (state == INFLIGHT_DONE) {
+      *framed = (out.coding != BODY_CLOSE);
+      inflight_leave(flight, off);
+      return 0;
+    }
+    if (state == INFLIGHT_FAILED) {
+      inflight_leave(flight, off);
+      return (off == 0) ? 1 : -1;
+    }
+    if (n == 0) {
+      inflight_wait(flight, off);
+    }
+  }
 }
 
+/*
+ * follow_piece - this function frames for the client of a follower of
+ * flight the *len bytes of the response that it read into data, from
+ * offset off on. data must lie in a relay buffer, HTTP_RELAY_ROOM bytes
+ * after its start. The head comes first, and says how o frames the
+ * rest. last says whether these are the last bytes of the response. It
+ * returns where the piece that goes to the client starts, and stores
+ * its length at *len.
+ */
+char *follow_piece(inflight *flight, http_out *o, size_t off, char *data,
+  size_t *len, int last)
+{
+  long long length;
+  size_t head_len;
+  if (off > 0 || *len == 0) {
+    return http_out_piece(o, data, len, NULL, 0, last);
+  }
+  //the leader appended the whole head before sharing the response, and
+  //it is no longer than a read
+  head_len = inflight_head(flight, &length);
+  http_out_frame(o, http_status(data, head_len), length);
+  *len -= head_len;
+  return http_out_piece(o, data + head_len, len, data, head_len, last);
+}
 
 /*
- * doit - handle one HTTP request/response transaction
+ * send_hit - this function writes the cached object p to the client fd,
+ * framed by its length, for a client that wants the connection kept
+ * open if keepalive is set. Big objects are sent with sendfile, straight
+ * from the cache's memfd. Returns 0 on success and -1 if the client
+ * couldn't be written to.
  */
+int send_hit(int fd, cache_node *p, int keepalive)
+{
+  char framing[HTTP_FRAMING_MAX];
+  size_t len = hit_framing(p, framing, keepalive), off = 0;
+  ssize_t n;
+  while (off < p->data_size + len) {
+    if ((n = cache_node_send(fd, p, off, framing, len)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    off += n;
+  }
+  return 0;
+}
 
-void doit(int fd) 
+/*
+ * hit_framing - this function writes to buf, which has room for
+ * HTTP_FRAMING_MAX bytes, the headers that frame the cached object p for
+ * a client that wants the connection kept open if keepalive is set, and
+ * returns their length. The length of the body is known, so every client
+ * gets Content-Length.
+ */
+size_t hit_framing(cache_node *p, char *buf, int keepalive)
 {
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char hostname[MAXLINE], path[MAXLINE], port[MAXLINE];
-    char host_header[MAXLINE], remaining_headers[MAXLINE];
-    char request[MAXLINE], server_buf[MAXLINE];
-    rio_t rio;
-    rio_t server_rio;
-    memset(buf, 0, MAXLINE);
-    memset(method, 0, MAXLINE);
-    memset(uri, 0, MAXLINE);
-    memset(version, 0, MAXLINE);
-    memset(hostname, 0, MAXLINE);
-    memset(path, 0, MAXLINE);
-    memset(port, 0, MAXLINE);
-    memset(host_header, 0, MAXLINE);
-    memset(remaining_headers, 0, MAXLINE);
-    memset(request, 0, MAXLINE);
-    memset(server_buf, 0, MAXLINE);
-    
-  	
-    /* Read request line and headers */
-    Rio_readinitb(&rio, fd);
-    Rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%s %s %s", method, uri, version);
-    if (strcasecmp(method, "GET")) { 
-       clienterror(fd, method, "501", "Not Implemented",
-                "Tiny does not implement this method");
-        return;
-    }
-
-    cache_node *cache_hit = check_for_hit(proxy_cache, uri);
-    if (cache_hit != NULL){
-    	if(rio_writen(fd, cache_hit->data, cache_hit->data_size) < 0){
-   		    pthread_rwlock_unlock(&lock);
-    		return;
-    	}
-    }
-	pthread_rwlock_unlock(&lock);
-
-    if (cache_hit == NULL) {
-    	char *response_data = Malloc(sizeof(char));
-    	unsigned int data_size = 0;
-    	read_requesthdrs(&rio, host_header, remaining_headers);
-    	/* Parse URI from GET request */
-   		if (parse_uri(uri, hostname, path, port) < 0) {
-   			return;
-   		}
-   		if (strncmp(host_header, "Host: ", strlen("Host: ")) != 0){
-   			sprintf(host_header, "Host: %s\r\n", hostname);
-   		}
-   		// printf("%s %s %s\n", hostname, path, port);
-   		compile_request(request, host_header, path, remaining_headers);
-    	int port_num = atoi(port);
-
-    	int server_fd = Open_clientfd_r(hostname, port_num);
-    	if (rio_writen(server_fd, request, strlen(request)) < 0){
-    		return;
-    	}
-    
-    	Rio_readinitb(&server_rio, server_fd);
-    	int len;
-    	while ((len = rio_readnb(&server_rio, server_buf, MAXLINE)) > 0){
-    		if (rio_writen(fd, server_buf, len) < 0){
-    			return;
-    		}
-    		response_data = Realloc(response_data, data_size + len);
-    		memcpy(response_data + data_size, server_buf, len);
-    		data_size += len;
-    	}
-
-    	add_to_cache(proxy_cache, uri, response_data, data_size);
-    
-    	Close(server_fd);
-    	Free(response_data);
-    	return; 
-    } 
+  http_out out;
+  char head[16];
+  int status = 200;
+  if (p->data_size == p->head_len) {
+    //only an empty body needs the status, a 204 has no Content-Length
+    status = http_status(head, cache_node_head(p, head, sizeof(head)));
+  }
+  http_out_init(&out, 1, keepalive);
+  http_out_frame(&out, status, p->data_size - p->head_len);
+  return http_framing(&out, buf);
 }
 
-void compile_request(char *request, char *host_header, char* path, 
-	char *remaining_headers){
-	sprintf(request, "GET %s HTTP/1.0\r\n", path);
-	sprintf(request, "%s%s", request, host_header);
-	sprintf(request, "%s%s", request, user_agent_hdr);
-	sprintf(request, "%s%s", request, accept_hdr);
-	sprintf(request, "%s%s", request, accept_encoding_hdr);
-	sprintf(request, "%sConnection: close\r\n", request);
-	sprintf(request, "%sProxy-Connection: close\r\n", request);
-	sprintf(request, "%s%s", request, remaining_headers);
-	sprintf(request, "%s\r\n", request);
+/*
+ * splice_chunk - this function moves at most len bytes from the socket
+ * from to the socket to through the pipe pipefd, so that they are never
+ * copied into user space. It waits for the bytes like read does. Returns
+ * the number of bytes moved, 0 at end of file, -1 if reading failed and
+ * -2 if writing failed.
+ */
+ssize_t splice_chunk(int from, int to, int *pipefd, size_t len)
+{
+  ssize_t n, m;
+  size_t moved = 0;
+  while ((n = splice(from, NULL, pipefd[1], NULL, len, SPLICE_F_MOVE)) < 0 &&
+      errno == EINTR)
+    ;
+  if (n <= 0) {
+    return n < 0 ? -1 : 0;
+  }
+  //the pipe must be empty again before the next chunk
+  while (moved < (size_t)n) {
+    m = splice(pipefd[0], NULL, to, NULL, n - moved, SPLICE_F_MOVE);
+    if (m < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -2;
+    }
+    moved += m;
+  }
+  return n;
+}
 
-	return;
+/*
+ * compile_request - this function compiles the request to be sent to
+ * the server according to the format given in the handout. A GET 
+ * request is compiled with the relevant path, the client's host header
+ * (or one naming hostname if it sent none) and the other headers of the
+ * client's request r. In addition, some other request headers that are
+ * always sent to the server (as mentioned in the handout) are also added
+ * to the request. The request is listed in g as pieces that are not
+ * copied: the headers the proxy always sends, path, hostname and the
+ * parts of r where the client's request was read, which must all stay
+ * put until it has been written. When connections to servers are kept
+ * alive, the request is an HTTP/1.1 one that asks for the connection to
+ * stay open instead.
+ */
 
+void compile_request(gather *g, const http_request *r, char *hostname,
+  char *path){
+  const request_header *host = request_find(r, "Host");
+  size_t i;
+  gather_init(g);
+  gather_add(g, "GET ", 4);
+  gather_add(g, path, strlen(path));
+  //ask for a persistent connection if we can keep it, the response is
+  //then framed by http.c and the connection goes back to the pool
+  if (upstream_enabled()){
+    gather_add(g, keepalive_version, sizeof(keepalive_version) - 1);
+  }
+  else {
+    gather_add(g, close_version, sizeof(close_version) - 1);
+  }
+  if (host != NULL){
+    gather_add(g, host->value, host->value_len);
+  }
+  else {
+    gather_add(g, hostname, strlen(hostname));
+  }
+  if (upstream_enabled()){
+    gather_add(g, keepalive_headers, sizeof(keepalive_headers) - 1);
+  }
+  else {
+    gather_add(g, close_headers, sizeof(close_headers) - 1);
+  }
+  for (i = 0; i < r->nheaders; i++){
+    const request_header *h = &r->headers[i];
+    if (forward_header(h)){
+      gather_add(g, h->name, h->name_len);
+      gather_add(g, ": ", 2);
+      gather_add(g, h->value, h->value_len);
+      gather_add(g, "\r\n", 2);
+    }
+  }
+  //the request ends with a blank line
+  gather_add(g, "\r\n", 2);
+}
+
+/*
+ * forward_header - this function returns whether the header h of the
+ * client's request goes on to the server. The ones mentioned in the
+ * handout, and the host header, are sent by the proxy itself.
+ */
+int forward_header(const request_header *h)
+{
+  return !request_header_is(h, "Host") &&
+    !request_header_is(h, "User-Agent") &&
+    !request_header_is(h, "Accept") &&
+    !request_header_is(h, "Accept-Encoding") &&
+    !request_header_is(h, "Connection") &&
+    !request_header_is(h, "Proxy-Connection");
 }
 
 
 /*
- * read_requesthdrs - read and parse HTTP request headers
+ * read_request - this function reads the head of the next request from
+ * the client into the buffer of rp and parses it into r, where it lies.
+ * The head is taken out of the buffer, so that what the client pipelined
+ * behind it is read next, but it stays in place, and r with it, until rp
+ * is read again. It returns the length of the head, 0 if the client
+ * closed the connection or timed out before the end of the head, and
+ * REQUEST_BAD if the head is malformed or doesn't fit in the buffer.
  */
 
-void read_requesthdrs(rio_t *rp, char *host_header, char *remaining_headers) 
+int read_request(rio_t *rp, http_request *r)
 {
-    char buf[MAXLINE];
-    Rio_readlineb(rp, buf, MAXLINE);
-    while(strcmp(buf, "\r\n")) {
-    	Rio_readlineb(rp, buf, MAXLINE);
-		if (strncmp(buf, "Host: ", strlen("Host: ")) == 0){
-			strcpy(host_header, buf);
-		}
-		if ((strncmp(buf, "User-Agent: ", strlen("User-Agent: ")) != 0) &&
-			(strncmp(buf, "Accept: ", strlen("Accept: ")) != 0) &&
-			(strncmp(buf, "Accept-Encoding: ", 
-				strlen("Accept-Encoding: ")) != 0) &&
-			(strncmp(buf, "Connection: ", strlen("Connection: ")) != 0) &&
-			(strncmp(buf, "Proxy-Connection: ", 
-				strlen("Proxy-Connection: ")) != 0)){
-			sprintf(remaining_headers, "%s%s", remaining_headers, buf);
-		}
-		
-    }
-    return;
+  size_t scanned = 0;
+  ssize_t n;
+  char *buf;
+  int head_len;
+  if ((n = rio_peekb(rp, &buf)) <= 0) {
+    return 0;
+  }
+  while ((head_len = request_parse(buf, n, &scanned, r)) ==
+      REQUEST_PARTIAL) {
+    //the head has to be whole in the buffer, what there is of it is
+    //moved to the front to make room for the rest
+    if ((n = rio_fillb(rp)) <= 0) {
+      return (n < 0 && errno == ENOBUFS) ? REQUEST_BAD : 0;
+    }
+    n = rio_peekb(rp, &buf);
+  }
+  if (head_len > 0) {
+    rio_consumeb(rp, head_len);
+  }
+  return head_len;
+}
+
+/*
+ * revalidate_request - this function turns the request compiled into g
+ * into a conditional one, which asks the server whether the stale object
+ * p has changed. It returns 0 on success, and -1 if p can't be
+ * revalidated: it has no ETag or Last-Modified, or the client's request
+ * r has conditional headers of its own. The headers it adds are taken
+ * from mem, the arena of the request.
+ */
+int revalidate_request(arena *mem, gather *g, const http_request *r,
+  cache_node *p)
+{
+  char *head = arena_alloc(mem, MAXBUF);
+  char *validators = arena_alloc(mem, MAXLINE);
+  size_t n = http_validators(head, cache_node_head(p, head, MAXBUF),
+    validators, MAXLINE);
+  if (n == 0 || request_find(r, "If-None-Match") != NULL ||
+      request_find(r, "If-Modified-Since") != NULL){
+    return -1;
+  }
+  //the headers go before the blank line that ends the request, which is
+  //its last piece, and stay in mem with the rest of the request
+  g->n--;
+  g->len -= 2;
+  gather_add(g, validators, n);
+  gather_add(g, "\r\n", 2);
+  return 0;
+}
+
+/*
+ * refresh_object - this function makes the stale object p fresh again
+ * once the server answered its revalidation with a 304, whose head is in
+ * f. The 304 may say how long the object is fresh for now; if it doesn't,
+ * the object is fresh for as long as it was when it was stored.
+ */
+void refresh_object(cache_node *p, http_frame *f)
+{
+  if (f->explicit_fresh || f->no_cache){
+    cache_refresh(proxy_cache, p, f->expires, f->lifetime);
+  }
+  else {
+    cache_refresh(proxy_cache, p, time(NULL) + p->lifetime, p->lifetime);
+  }
 }
 
 
 /*
- * parse_uri - 
- *             
+ * parse_uri - this function parses the uri received from the client
+ * request and stores the hostname provided in "hostname" argument,
+ * the path provided in the "path" argument and if there is a port
+ * provided it stores that in the "port" argument otherwise it stores  
+ * the default port (80) in the "port" argument. 
  */
 
-int parse_uri(char *uri, char *hostname, char *path, char *port) 
+int parse_uri(char *uri, char *hostname, char *path, char *port)
 {
-    int i = 0;
-    char *is_uri = strstr(uri, "http://");
-    if (is_uri != NULL){
-    	while (uri[i] != '/'){
-    		i += 1;
-    	}
-    	i += 2;
-    	int j = 0;
-    	while (uri[i] != '\0' && uri[i] != '/' && uri[i] != ':'){
-    		hostname[j] = uri[i];
-    		j += 1;
-    		i += 1;
-    	}
-    	hostname[j] = '\0';
-    	int k = 0;
-    	if (uri[i] == ':'){
-    		i += 1;
-    		while (uri[i] != '/'){
-    			port[k] = uri[i];
-    			i += 1;
-    			k += 1;
-    		}
-    		port[k] = '\0';
-    	}
-    	else {
-    		strcpy(port, "80\0");
-    	}
-    	int n = 0;
-    	while (uri[i] != '\0'){
-    		path[n] = uri[i];
-    		i += 1;
-    		n += 1;
-    	}
-    	path[n] = '\0';
-    	return 0;
-    }
-    else {
-    	return -1;
+  char *end = uri + strlen(uri);
+  char *host, *p;
+  if (strstr(uri, "http://") == NULL) {
+    return -1;
+  }
+  //This part strips off the http:// part
+  host = (char *)memchr(uri, '/', end - uri) + 2;
+  //the host name ends where the port or the path starts, or with the url
+  p = (char *)scan_host(host, end);
+  memcpy(hostname, host, p - host);
+  hostname[p - host] = '\0';
+  //if there's a port, store it, otherwise default to 80
+  if (p < end && *p == ':') {
+    char *port_end = memchr(p, '/', end - p);
+    if (port_end == NULL) {
+      port_end = end;
     }
-    
+    memcpy(port, p + 1, port_end - p - 1);
+    port[port_end - p - 1] = '\0';
+    p = port_end;
+  }
+  else {
+    strcpy(port, "80");
+  }
+  //remaining path of the url, the root if there is none
+  if (p == end) {
+    strcpy(path, "/");
+  }
+  else {
+    memcpy(path, p, end - p + 1);
+  }
+  return 0;
 }
 
 
 /*
- * clienterror - returns an error message to the client
+ * clienterror - returns an error message to the client. The list of its
+ * pieces is taken from the worker's arena, like the request's.
  */
-/* $begin clienterror */
-void clienterror(int fd, char *cause, char *errnum, 
-		 char *shortmsg, char *longmsg) 
+void clienterror(int fd, char *cause, char *errnum,
+		 char *shortmsg, char *longmsg)
 {
-    char buf[MAXLINE], body[MAXBUF];
-
-    /* Build the HTTP response body */
-    sprintf(body, "<html><title>Tiny Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
-
-    /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+  gather *g = arena_alloc(&request_arena, sizeof(gather));
+  build_clienterror(g, cause, errnum, shortmsg, longmsg);
+  gather_writen(fd, g);
 }
 
+/*
+ * build_clienterror - lists the pieces of the error message returned by
+ * clienterror in g. Only its length is copied, the other pieces must
+ * stay put until it has been written.
+ */
+void build_clienterror(gather *g, char *cause, char *errnum,
+		 char *shortmsg, char *longmsg)
+{
+  char length[32];
+  size_t errnum_len = strlen(errnum), shortmsg_len = strlen(shortmsg);
+  size_t longmsg_len = strlen(longmsg), cause_len = strlen(cause);
+  size_t body_len = sizeof(error_body_start) - 1 + errnum_len + 2 +
+    shortmsg_len + 5 + longmsg_len + 2 + cause_len +
+    sizeof(error_body_end) - 1;
+  int n = sprintf(length, "%d", (int)body_len);
 
+  /* The HTTP response head */
+  gather_init(g);
+  gather_add(g, "HTTP/1.0 ", 9);
+  gather_add(g, errnum, errnum_len);
+  gather_add(g, " ", 1);
+  gather_add(g, shortmsg, shortmsg_len);
+  gather_add(g, error_head, sizeof(error_head) - 1);
+  gather_add_copy(g, length, n);
+  gather_add(g, "\r\n\r\n", 4);
 
-
+  /* The HTTP response body */
+  gather_add(g, error_body_start, sizeof(error_body_start) - 1);
+  gather_add(g, errnum, errnum_len);
+  gather_add(g, ": ", 2);
+  gather_add(g, shortmsg, shortmsg_len);
+  gather_add(g, "\r\n<p>", 5);
+  gather_add(g, longmsg, longmsg_len);
+  gather_add(g, ": ", 2);
+  gather_add(g, cause, cause_len);
+  gather_add(g, error_body_end, sizeof(error_body_end) - 1);
+}
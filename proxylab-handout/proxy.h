@@ -0,0 +1,53 @@
+/*
+ * proxy.h - pieces of the proxy shared by the thread-per-connection
+ * handler in proxy.c and the epoll event loop in event.c
+ */
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "http.h"
+#include "request.h"
+#include "gather.h"
+#include "arena.h"
+#include "inflight.h"
+
+/* I/O models the proxy can run with */
+#define PROXY_THREADS 0 //one blocking thread per connection
+#define PROXY_EPOLL 1 //a few event loop threads with non-blocking sockets
+
+/* Client connections are kept alive this long and for this many requests */
+#define CLIENT_DEFAULT_IDLE_TIMEOUT 15 //seconds to wait for the next request
+#define CLIENT_DEFAULT_MAX_REQUESTS 100
+
+/* Most bytes moved by one splice when a response is relayed without being
+   copied into user space */
+#define RELAY_SPLICE_CHUNK 65536
+
+/* Global variables */
+
+extern cache *proxy_cache; //cache to be used by the proxy
+extern int client_idle_timeout; //seconds a client may take to send a request
+extern int client_max_requests; //requests served per client connection
+extern size_t client_buffer_size; //read buffer of a client connection
+
+/* Request handling helpers */
+
+int parse_uri(char *uri, char *hostname, char *path, char *port);
+void compile_request(gather *g, const http_request *r, char *hostname,
+	char *path);
+int revalidate_request(arena *mem, gather *g, const http_request *r,
+	cache_node *p);
+void refresh_object(cache_node *p, http_frame *f);
+char *follow_piece(inflight *flight, http_out *o, size_t off, char *data,
+	size_t *len, int last);
+size_t hit_framing(cache_node *p, char *buf, int keepalive);
+void build_clienterror(gather *g, char *cause, char *errnum,
+		 char *shortmsg, char *longmsg);
+
+/* Thread helpers */
+
+void pin_to_cpu(int cpu);
+
+#endif /* __PROXY_H__ */
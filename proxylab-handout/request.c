@@ -0,0 +1,293 @@
+/*
+ * request.c - parsing of the request heads clients send
+ *
+ * The head of a request is parsed where it was read, in the client's
+ * buffer, without copying it: request_parse fills an http_request with
+ * the method, the uri and the name and value of each header as pointers
+ * into the buffer and lengths. Nothing is allocated, and nothing is
+ * terminated or otherwise written to, so the slices are only good for as
+ * long as the buffer isn't read into again.
+ *
+ * A head may take several reads to arrive. Until its blank line is in,
+ * request_parse only looks for it, from where its previous call stopped
+ * (*scanned), so every byte is looked at once however the head is split.
+ * The head is parsed in one pass once it is whole. Empty lines before
+ * the request line are skipped. Lines may end with CRLF or a bare LF, as
+ * RFC 9112 section 2.2 allows; a bare CR, a header folded over several
+ * lines, or bytes a request line or header name can't have make the
+ * request bad. The ends of the method, the uri and
+ * each header name and value are found with the vectorized searches of
+ * scan.c.
+ */
+
+#include "request.h"
+#include "scan.h"
+
+static const char *skip_empty_lines(const char *p, const char *end);
+static const char *head_end(const char *buf, size_t len, size_t *scanned);
+static const char *line_end(const char *p, const char *end);
+static const char *parse_request_line(const char *p, const char *end,
+	http_request *r);
+static const char *parse_header(const char *p, const char *end,
+	request_header *h);
+static int slice_is(const char *s, size_t len, const char *name);
+
+/*
+ * request_parse - this function parses the head of the request at the
+ * start of the len bytes of buf into r. *scanned is how much of buf
+ * earlier calls have looked at without finding the end of the head, and
+ * has to be 0 for a new request. It returns the length of the head,
+ * empty lines before it included, or REQUEST_PARTIAL if it isn't over
+ * yet, or REQUEST_BAD if it is malformed.
+ */
+int request_parse(const char *buf, size_t len, size_t *scanned,
+  http_request *r)
+{
+  const char *start = skip_empty_lines(buf, buf + len);
+  const char *end, *p;
+  size_t skipped, rest;
+  if (start == NULL) {
+    return REQUEST_PARTIAL;
+  }
+  skipped = start - buf;
+  //the search for the end of the head starts after the empty lines,
+  //which are the same on every call
+  rest = (*scanned > skipped) ? *scanned - skipped : 0;
+  end = head_end(start, len - skipped, &rest);
+  *scanned = skipped + rest;
+  if (end == NULL) {
+    return REQUEST_PARTIAL;
+  }
+  if ((p = parse_request_line(start, end, r)) == NULL) {
+    return REQUEST_BAD;
+  }
+  r->nheaders = 0;
+  //the head ends with a blank line, which head_end made sure of
+  while (*p != '\r' && *p != '\n') {
+    if (r->nheaders == REQUEST_MAX_HEADERS ||
+        (p = parse_header(p, end, &r->headers[r->nheaders])) == NULL) {
+      return REQUEST_BAD;
+    }
+    r->nheaders++;
+  }
+  return end - buf;
+}
+
+/*
+ * request_find - this function returns the first header of r called name,
+ * or NULL if there is none
+ */
+const request_header *request_find(const http_request *r, const char *name)
+{
+  size_t i;
+  for (i = 0; i < r->nheaders; i++) {
+    if (request_header_is(&r->headers[i], name)) {
+      return &r->headers[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * request_header_is - this function returns whether the header h is
+ * called name, which header names are compared without regard to case
+ */
+int request_header_is(const request_header *h, const char *name)
+{
+  return slice_is(h->name, h->name_len, name);
+}
+
+/*
+ * request_value_has - this function returns whether token is one of the
+ * comma separated elements of the value of h, like "close" in
+ * "Connection: close"
+ */
+int request_value_has(const request_header *h, const char *token)
+{
+  const char *p = h->value, *end = h->value + h->value_len;
+  while (p < end) {
+    const char *comma = memchr(p, ',', end - p);
+    const char *e = (comma != NULL) ? comma : end;
+    const char *s = p;
+    while (s < e && (*s == ' ' || *s == '\t')) {
+      s++;
+    }
+    while (e > s && (e[-1] == ' ' || e[-1] == '\t')) {
+      e--;
+    }
+    if (slice_is(s, e - s, token)) {
+      return 1;
+    }
+    p = (comma != NULL) ? comma + 1 : end;
+  }
+  return 0;
+}
+
+/*
+ * request_keepalive - this function returns whether the client wants the
+ * connection kept open after the request r. HTTP/1.1 connections are
+ * persistent unless the client says otherwise, and the last Connection or
+ * Proxy-Connection header that says either way wins.
+ */
+int request_keepalive(const http_request *r)
+{
+  int keepalive = (r->version == 1);
+  size_t i;
+  for (i = 0; i < r->nheaders; i++) {
+    const request_header *h = &r->headers[i];
+    if (!request_header_is(h, "Connection") &&
+        !request_header_is(h, "Proxy-Connection")) {
+      continue;
+    }
+    if (request_value_has(h, "close")) {
+      keepalive = 0;
+    }
+    else if (request_value_has(h, "keep-alive")) {
+      keepalive = 1;
+    }
+  }
+  return keepalive;
+}
+
+/*
+ * skip_empty_lines - this function returns where the request line starts
+ * in the bytes from p to end, after any empty lines, or NULL if only
+ * empty lines, or part of one, have come in so far. RFC 9112 section 2.2
+ * has servers ignore them, a client may send one after the body of a
+ * POST. A bare CR isn't skipped, the request line is left to reject it.
+ */
+static const char *skip_empty_lines(const char *p, const char *end)
+{
+  while (p < end) {
+    if (*p == '\n') {
+      p++;
+    }
+    else if (*p != '\r') {
+      return p;
+    }
+    else if (p + 1 == end) {
+      return NULL;
+    }
+    else if (p[1] == '\n') {
+      p += 2;
+    }
+    else {
+      return p;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * head_end - this function looks for the blank line that ends the head at
+ * the start of the len bytes of buf, from *scanned on. It returns where
+ * the head ends, or NULL if it isn't in buf yet, in which case *scanned
+ * is moved up to where the next call has to look from.
+ */
+static const char *head_end(const char *buf, size_t len, size_t *scanned)
+{
+  const char *p = buf + *scanned, *end = buf + len;
+  while ((p = memchr(p, '\n', end - p)) != NULL) {
+    //a line ends at p, the head ends if the next one is empty. Whether
+    //it is can't be told until the bytes after p are in
+    if (p + 1 == end || (p[1] == '\r' && p + 2 == end)) {
+      *scanned = p - buf;
+      return NULL;
+    }
+    if (p[1] == '\n') {
+      return p + 2;
+    }
+    if (p[1] == '\r' && p[2] == '\n') {
+      return p + 3;
+    }
+    p++;
+  }
+  *scanned = len;
+  return NULL;
+}
+
+/*
+ * line_end - this function checks that the line ending at p ends
+ * properly, with CRLF or LF, and returns where the next line starts, or
+ * NULL if it doesn't
+ */
+static const char *line_end(const char *p, const char *end)
+{
+  if (p < end && *p == '\n') {
+    return p + 1;
+  }
+  if (p + 1 < end && p[0] == '\r' && p[1] == '\n') {
+    return p + 2;
+  }
+  return NULL;
+}
+
+/*
+ * parse_request_line - this function parses the request line at p into
+ * the method, uri and version of r, and returns where the headers start,
+ * or NULL if the line is malformed
+ */
+static const char *parse_request_line(const char *p, const char *end,
+  http_request *r)
+{
+  r->method = p;
+  p = scan_token(p, end);
+  r->method_len = p - r->method;
+  if (r->method_len == 0 || p == end || *p++ != ' ') {
+    return NULL;
+  }
+  //anything visible goes in a uri, it is checked by parse_uri later
+  r->uri = p;
+  p = scan_uri(p, end);
+  r->uri_len = p - r->uri;
+  if (r->uri_len == 0 || p == end || *p++ != ' ') {
+    return NULL;
+  }
+  if (end - p < 8 || memcmp(p, "HTTP/1.", 7) != 0 ||
+      p[7] < '0' || p[7] > '9') {
+    return NULL;
+  }
+  r->version = p[7] - '0';
+  return line_end(p + 8, end);
+}
+
+/*
+ * parse_header - this function parses the header line at p into h, and
+ * returns where the next line starts, or NULL if the line is malformed
+ */
+static const char *parse_header(const char *p, const char *end,
+  request_header *h)
+{
+  const char *value_end;
+  h->name = p;
+  p = scan_token(p, end);
+  h->name_len = p - h->name;
+  //no whitespace is allowed before the colon, and a line starting with
+  //whitespace would continue the previous one, which RFC 9112 lets us
+  //refuse
+  if (h->name_len == 0 || p == end || *p++ != ':') {
+    return NULL;
+  }
+  while (p < end && (*p == ' ' || *p == '\t')) {
+    p++;
+  }
+  h->value = p;
+  //control characters other than tab don't belong in a value
+  p = scan_value(p, end);
+  value_end = p;
+  while (value_end > h->value &&
+         (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+    value_end--;
+  }
+  h->value_len = value_end - h->value;
+  return line_end(p, end);
+}
+
+/*
+ * slice_is - this function returns whether the len bytes at s are name,
+ * without regard to case
+ */
+static int slice_is(const char *s, size_t len, const char *name)
+{
+  return strlen(name) == len && strncasecmp(s, name, len) == 0;
+}
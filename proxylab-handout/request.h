@@ -0,0 +1,46 @@
+/*
+ * request.h - parsing of the request heads clients send, in place in the
+ * buffer they were read into
+ */
+#ifndef __REQUEST_H__
+#define __REQUEST_H__
+
+#include "csapp.h"
+
+/* Most headers a request may have */
+#define REQUEST_MAX_HEADERS 64
+
+/* What request_parse returns when it doesn't return the head's length */
+#define REQUEST_BAD -1 //the head is malformed or has too many headers
+#define REQUEST_PARTIAL -2 //the head isn't over yet, read more
+
+/* A header of the request, both parts point into the buffer it was read
+   into and are not terminated */
+struct request_header{
+  const char *name;
+  size_t name_len;
+  const char *value; //without the whitespace around it
+  size_t value_len;
+};
+
+struct http_request{
+  const char *method;
+  size_t method_len;
+  const char *uri;
+  size_t uri_len;
+  int version; //minor version, 0 for HTTP/1.0 and 1 for HTTP/1.1
+  size_t nheaders;
+  struct request_header headers[REQUEST_MAX_HEADERS];
+};
+
+typedef struct request_header request_header;
+typedef struct http_request http_request;
+
+int request_parse(const char *buf, size_t len, size_t *scanned,
+	http_request *r);
+const request_header *request_find(const http_request *r, const char *name);
+int request_header_is(const request_header *h, const char *name);
+int request_value_has(const request_header *h, const char *token);
+int request_keepalive(const http_request *r);
+
+#endif /* __REQUEST_H__ */
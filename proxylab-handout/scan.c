@@ -0,0 +1,421 @@
+/*
+ * scan.c - vectorized searches for the bytes that end the parts of
+ * requests, responses and uris
+ *
+ * Every search is the same one: find the first byte of a class, like the
+ * control characters that end a header value or the separators that end
+ * a header name. There are three kernels for it, and which one runs is
+ * decided the first time a search is made, from what the CPU has; the
+ * rest of the proxy is built for any x86-64, only the kernels use the
+ * newer instructions.
+ *   - scalar looks each byte up in a table of the class
+ *   - SSE4.2 compares 16 bytes at a time against up to eight ranges of
+ *     bytes at once, with PCMPESTRI
+ *   - AVX2 looks up 32 bytes at a time in two 16 entry tables, one for
+ *     the low and one for the high half of each byte, with VPSHUFB. Each
+ *     bit of an entry stands for a group of bytes of the class, and a byte
+ *     is in the class if the entries for both its halves share a bit. The
+ *     tables are made from the class when the kernel is picked.
+ * The ranges given to PCMPESTRI may take in a few bytes that aren't in
+ * the class, to fit in eight; those matches are checked against the table
+ * and passed over. Spans too short for a block are done a byte at a time,
+ * and the last block of a span is read overlapping the one before it
+ * rather than past its end.
+ *
+ * Single bytes, like the LF that ends a line, are found with memchr,
+ * which the C library already vectorizes the same way.
+ */
+
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+/* Classes of bytes the searches look for */
+#define CLASS_TOKEN_END 0 //anything but a tchar
+#define CLASS_VALUE_END 1 //control characters but tab, and DEL
+#define CLASS_URI_END 2 //whitespace, control characters and DEL
+#define CLASS_HOST_END 3 //':' and '/'
+#define NCLASSES 4
+
+struct scan_class{
+  const char *ranges; //first and last byte of each range, for PCMPESTRI
+  int nranges; //at most 8
+  unsigned char stop[256]; //whether each byte is in the class
+  int nibbles; //the class fits in lo and hi
+  unsigned char lo[16]; //groups each low half of a byte is in
+  unsigned char hi[16]; //group of each high half of a byte
+};
+
+typedef const char *(*scan_fn)(const char *p, const char *end,
+	const struct scan_class *c);
+
+static const char *scan(const char *p, const char *end, int cls);
+static const char *scan_resolve(const char *p, const char *end,
+	const struct scan_class *c);
+static void scan_init(void);
+static void class_init(struct scan_class *c, const char *ranges,
+	int nranges);
+static void class_nibbles(struct scan_class *c);
+static int kernel_supported(int kernel);
+static const char *kernel_scalar(const char *p, const char *end,
+	const struct scan_class *c);
+#ifdef SCAN_X86
+static const char *kernel_sse42(const char *p, const char *end,
+	const struct scan_class *c) __attribute__((target("sse4.2")));
+static const char *kernel_avx2(const char *p, const char *end,
+	const struct scan_class *c) __attribute__((target("avx2")));
+#endif
+
+static struct scan_class classes[NCLASSES];
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+static scan_fn kernels[] = {
+  kernel_scalar,
+#ifdef SCAN_X86
+  kernel_sse42,
+  kernel_avx2,
+#endif
+};
+
+static const char *kernel_names[] = {"scalar", "sse4.2", "avx2"};
+
+//the kernel in use, scan_resolve until the first search picks one
+static scan_fn scan_impl = scan_resolve;
+static int scan_current = -1;
+
+const char scan_token_char[256] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0, //  ! " # $ % & ' ( ) * + , - . /
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, // 0-9 : ; < = > ?
+  0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // @ A-O
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1, // P-Z [ \ ] ^ _
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // ` a-o
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0, // p-z { | } ~ DEL
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/*
+ * scan_token - this function returns the first of the bytes from p to
+ * end that can't be in a method or header name, or end
+ */
+const char *scan_token(const char *p, const char *end)
+{
+  return scan(p, end, CLASS_TOKEN_END);
+}
+
+/*
+ * scan_value - this function returns the first of the bytes from p to
+ * end that can't be in a header value, a control character other than
+ * tab, or end. That is the CR or LF that ends the value if it is well
+ * formed.
+ */
+const char *scan_value(const char *p, const char *end)
+{
+  return scan(p, end, CLASS_VALUE_END);
+}
+
+/*
+ * scan_uri - this function returns the first of the bytes from p to end
+ * that can't be in a uri, whitespace or a control character, or end
+ */
+const char *scan_uri(const char *p, const char *end)
+{
+  return scan(p, end, CLASS_URI_END);
+}
+
+/*
+ * scan_host - this function returns the first ':' or '/' from p to end,
+ * which ends the host name in the authority of a uri, or end
+ */
+const char *scan_host(const char *p, const char *end)
+{
+  return scan(p, end, CLASS_HOST_END);
+}
+
+/*
+ * scan_kernel - this function returns which of the SCAN_ kernels the
+ * searches run with
+ */
+int scan_kernel(void)
+{
+  pthread_once(&scan_once, scan_init);
+  return __atomic_load_n(&scan_current, __ATOMIC_RELAXED);
+}
+
+/*
+ * scan_set_kernel - this function makes the searches run with kernel, one
+ * of the SCAN_ kernels, so that they can be compared. It returns 0 on
+ * success and -1 if the CPU doesn't have what kernel needs.
+ */
+int scan_set_kernel(int kernel)
+{
+  pthread_once(&scan_once, scan_init);
+  if (!kernel_supported(kernel)) {
+    return -1;
+  }
+  __atomic_store_n(&scan_impl, kernels[kernel], __ATOMIC_RELAXED);
+  __atomic_store_n(&scan_current, kernel, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/*
+ * scan_kernel_name - this function returns the name of kernel
+ */
+const char *scan_kernel_name(int kernel)
+{
+  return kernel_names[kernel];
+}
+
+/*
+ * scan - this function returns the first of the bytes from p to end in
+ * the class cls, or end if there is none
+ */
+static const char *scan(const char *p, const char *end, int cls)
+{
+  const struct scan_class *c = &classes[cls];
+  scan_fn fn = __atomic_load_n(&scan_impl, __ATOMIC_RELAXED);
+  //a kernel may stop at bytes just outside the class, see above
+  while ((p = fn(p, end, c)) < end && !c->stop[(unsigned char)*p]) {
+    p++;
+  }
+  return p;
+}
+
+/*
+ * scan_resolve - this function is the kernel until one has been picked.
+ * It picks one, and runs it.
+ */
+static const char *scan_resolve(const char *p, const char *end,
+  const struct scan_class *c)
+{
+  pthread_once(&scan_once, scan_init);
+  return __atomic_load_n(&scan_impl, __ATOMIC_RELAXED)(p, end, c);
+}
+
+/*
+ * scan_init - this function makes the tables of each class, and picks
+ * the best kernel the CPU has
+ */
+static void scan_init(void)
+{
+  int kernel = SCAN_AVX2;
+  int i;
+  //the tchar that are in the last range are put back by the table
+  class_init(&classes[CLASS_TOKEN_END], "\x00 \"\"(),,//:@[]{\xff", 8);
+  for (i = 0; i < 256; i++) {
+    classes[CLASS_TOKEN_END].stop[i] = !scan_token_char[i];
+  }
+  class_nibbles(&classes[CLASS_TOKEN_END]);
+  class_init(&classes[CLASS_VALUE_END], "\x00\x08\x0a\x1f\x7f\x7f", 3);
+  class_init(&classes[CLASS_URI_END], "\x00 \x7f\x7f", 2);
+  class_init(&classes[CLASS_HOST_END], "//::", 2);
+  while (!kernel_supported(kernel)) {
+    kernel--;
+  }
+  __atomic_store_n(&scan_impl, kernels[kernel], __ATOMIC_RELAXED);
+  __atomic_store_n(&scan_current, kernel, __ATOMIC_RELAXED);
+}
+
+/*
+ * class_init - this function makes c the class of the bytes in the
+ * nranges ranges of ranges, each given by its first and last byte
+ */
+static void class_init(struct scan_class *c, const char *ranges,
+  int nranges)
+{
+  int i, b;
+  c->ranges = ranges;
+  c->nranges = nranges;
+  memset(c->stop, 0, sizeof(c->stop));
+  for (i = 0; i < nranges; i++) {
+    for (b = (unsigned char)ranges[2 * i];
+         b <= (unsigned char)ranges[2 * i + 1]; b++) {
+      c->stop[b] = 1;
+    }
+  }
+  class_nibbles(c);
+}
+
+/*
+ * class_nibbles - this function makes the nibble tables of c from its
+ * table of bytes. The bytes of the class that share a high half are a set
+ * of low halves; each different set gets a bit, which goes in the entry
+ * of the high halves that have it and of the low halves in it. A class
+ * with more than 8 different sets can't be looked up that way.
+ */
+static void class_nibbles(struct scan_class *c)
+{
+  unsigned short sets[8];
+  int nsets = 0, h, l, g;
+  memset(c->lo, 0, sizeof(c->lo));
+  memset(c->hi, 0, sizeof(c->hi));
+  c->nibbles = 0;
+  for (h = 0; h < 16; h++) {
+    unsigned short set = 0;
+    for (l = 0; l < 16; l++) {
+      if (c->stop[h << 4 | l]) {
+        set |= 1 << l;
+      }
+    }
+    if (set == 0) {
+      continue;
+    }
+    for (g = 0; g < nsets && sets[g] != set; g++) {
+    }
+    if (g == nsets) {
+      if (nsets == 8) {
+        return;
+      }
+      sets[nsets++] = set;
+    }
+    c->hi[h] = 1 << g;
+  }
+  for (g = 0; g < nsets; g++) {
+    for (l = 0; l < 16; l++) {
+      if (sets[g] & (1 << l)) {
+        c->lo[l] |= 1 << g;
+      }
+    }
+  }
+  c->nibbles = 1;
+}
+
+/*
+ * kernel_supported - this function returns whether kernel can run here
+ */
+static int kernel_supported(int kernel)
+{
+  if (kernel == SCAN_SCALAR) {
+    return 1;
+  }
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+  if (kernel == SCAN_SSE42) {
+    return __builtin_cpu_supports("sse4.2");
+  }
+  if (kernel == SCAN_AVX2) {
+    return __builtin_cpu_supports("avx2") &&
+      __builtin_cpu_supports("sse4.2");
+  }
+#endif
+  return 0;
+}
+
+/*
+ * kernel_scalar - this function is the search one byte at a time
+ */
+static const char *kernel_scalar(const char *p, const char *end,
+  const struct scan_class *c)
+{
+  while (p < end && !c->stop[(unsigned char)*p]) {
+    p++;
+  }
+  return p;
+}
+
+#ifdef SCAN_X86
+
+/*
+ * kernel_sse42 - this function is the search 16 bytes at a time,
+ * PCMPESTRI tells where in a block the first byte in any of the ranges of
+ * c is
+ */
+static const char *kernel_sse42(const char *p, const char *end,
+  const struct scan_class *c)
+{
+  char padded[16] = {0};
+  const char *start = p;
+  __m128i r, b;
+  int i;
+  memcpy(padded, c->ranges, 2 * c->nranges);
+  r = _mm_loadu_si128((const __m128i *)padded);
+  while (end - p >= 16) {
+    b = _mm_loadu_si128((const __m128i *)p);
+    i = _mm_cmpestri(r, 2 * c->nranges, b, 16,
+      _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+    if (i < 16) {
+      return p + i;
+    }
+    p += 16;
+  }
+  if (p == end || end - start < 16) {
+    return kernel_scalar(p, end, c);
+  }
+  //the bytes of the last block that were already looked at don't match
+  b = _mm_loadu_si128((const __m128i *)(end - 16));
+  i = _mm_cmpestri(r, 2 * c->nranges, b, 16,
+    _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+  return end - 16 + i;
+}
+
+/*
+ * kernel_avx2 - this function is the search 32 bytes at a time with the
+ * nibble tables of c, and 16 at a time for what is left
+ */
+static const char *kernel_avx2(const char *p, const char *end,
+  const struct scan_class *c)
+{
+  const char *start = p;
+  const char *block;
+  unsigned int mask;
+  if (!c->nibbles) {
+    return kernel_sse42(p, end, c);
+  }
+  __m128i lo = _mm_loadu_si128((const __m128i *)c->lo);
+  __m128i hi = _mm_loadu_si128((const __m128i *)c->hi);
+  __m128i low4 = _mm_set1_epi8(0x0f);
+  if (end - p >= 32) {
+    __m256i lo2 = _mm256_broadcastsi128_si256(lo);
+    __m256i hi2 = _mm256_broadcastsi128_si256(hi);
+    __m256i low4_2 = _mm256_set1_epi8(0x0f);
+    while (1) {
+      //the last block overlaps the one before it, whose bytes don't match
+      block = (end - p >= 32) ? p : end - 32;
+      __m256i b = _mm256_loadu_si256((const __m256i *)block);
+      __m256i groups = _mm256_and_si256(
+        _mm256_shuffle_epi8(lo2, _mm256_and_si256(b, low4_2)),
+        _mm256_shuffle_epi8(hi2,
+          _mm256_and_si256(_mm256_srli_epi16(b, 4), low4_2)));
+      mask = ~_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(groups, _mm256_setzero_si256()));
+      if (mask != 0) {
+        return block + __builtin_ctz(mask);
+      }
+      p = block + 32;
+      if (p == end) {
+        return end;
+      }
+    }
+  }
+  if (end - start < 16) {
+    return kernel_scalar(p, end, c);
+  }
+  //between 16 and 31 bytes, two blocks that may overlap
+  for (block = p; ; block = end - 16) {
+    __m128i b = _mm_loadu_si128((const __m128i *)block);
+    __m128i groups = _mm_and_si128(
+      _mm_shuffle_epi8(lo, _mm_and_si128(b, low4)),
+      _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(b, 4), low4)));
+    mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(groups, _mm_setzero_si128()))
+      & 0xffff;
+    if (mask != 0) {
+      return block + __builtin_ctz(mask);
+    }
+    if (block == end - 16) {
+      return end;
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,27 @@
+/*
+ * scan.h - vectorized searches for the bytes that end the parts of
+ * requests, responses and uris
+ */
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+#include "csapp.h"
+
+/* Kernels the searches can run with, the best one the CPU has is used
+   unless scan_set_kernel says otherwise */
+#define SCAN_SCALAR 0 //one byte at a time
+#define SCAN_SSE42 1 //16 bytes at a time with PCMPESTRI
+#define SCAN_AVX2 2 //32 bytes at a time with VPSHUFB table lookups
+
+/* Bytes that may be in a method or header name, the tchar of RFC 9110 */
+extern const char scan_token_char[256];
+
+const char *scan_token(const char *p, const char *end);
+const char *scan_value(const char *p, const char *end);
+const char *scan_uri(const char *p, const char *end);
+const char *scan_host(const char *p, const char *end);
+int scan_kernel(void);
+int scan_set_kernel(int kernel);
+const char *scan_kernel_name(int kernel);
+
+#endif /* __SCAN_H__ */
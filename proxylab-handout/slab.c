@@ -0,0 +1,305 @@
+/*
+ * slab.c - size-class slab allocator for the cache's objects
+ *
+ * The cache used to make three heap allocations per object (node, url
+ * and data) and free them one by one on eviction. Under churn the heap
+ * ends up full of holes of the wrong sizes, and the proxy uses far more
+ * memory than the cache accounts for. Here every object is one block,
+ * and blocks come from slabs, as in memcached.
+ *
+ * Memory is mapped in pages of SLAB_PAGE_SIZE bytes, aligned on their
+ * size, so the page a block belongs to is found by masking the block's
+ * address. Each page starts with a header and is cut into chunks of one
+ * size class. Classes grow by SLAB_GROWTH_FACTOR from SLAB_MIN_CHUNK up,
+ * so a block wastes at most about a fifth of its chunk. A page keeps its
+ * free chunks on a list of its own and is only carved as far as it has
+ * been used, so a new page costs no more memory than the chunks taken
+ * from it.
+ *
+ * Each class has a lock and a list of the pages it owns that have free
+ * chunks; pages that are full are on no list. When the last chunk of a
+ * page is freed, the page leaves its class: up to SLAB_SPARE_PAGES empty
+ * pages are kept for any class to pick up, and the others are unmapped.
+ * Evicting objects therefore hands whole pages back to the system instead
+ * of leaving free bytes in the middle of the heap.
+ *
+ * Blocks too big for the largest class get a mapping of their own, with
+ * the same header at its start, and are unmapped when they are freed.
+ */
+
+#include "slab.h"
+#include <stdint.h>
+
+/* The header at the start of every page */
+struct slab_page{
+  int cls; //size class of the chunks, -1 for a block with its own mapping
+  unsigned int nused; //chunks handed out
+  unsigned int ncarved; //chunks ever handed out, the rest was never touched
+  size_t size; //bytes mapped, for a block with its own mapping
+  void *free; //freed chunks, each holds a pointer to the next
+  struct slab_page *prev; //neighbours in the class's list of pages with room
+  struct slab_page *next;
+};
+
+/* A size class */
+struct slab_class{
+  size_t size; //bytes in a chunk
+  unsigned int perpage; //chunks in a page
+  pthread_mutex_t lock; //protects the pages of the class
+  struct slab_page *partial; //pages with free chunks
+};
+
+/* Chunks start this far into a page, aligned for anything */
+#define SLAB_HEADER ((sizeof(struct slab_page) + 15) & ~(size_t)15)
+
+static struct slab_class classes[SLAB_MAX_CLASSES];
+static int nclasses = 0;
+static struct slab_page *spare = NULL; //empty pages, linked through next
+static int nspare = 0;
+static pthread_mutex_t spare_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+
+static void make_classes(void);
+static int class_for(size_t size);
+static void *map_aligned(size_t size);
+static struct slab_page *page_of(void *p);
+static struct slab_page *get_page(void);
+static void put_page(struct slab_page *page);
+static void page_link(struct slab_class *c, struct slab_page *page);
+static void page_unlink(struct slab_class *c, struct slab_page *page);
+
+/*
+ * slab_init - this function sets up the size classes. It may be called
+ * more than once, only the first call does anything.
+ */
+void slab_init(void)
+{
+  pthread_once(&slab_once, make_classes);
+}
+
+/*
+ * slab_alloc - this function returns a block of at least size bytes,
+ * aligned on 16 bytes. Like Malloc, it never returns NULL.
+ */
+void *slab_alloc(size_t size)
+{
+  int i = class_for(size);
+  if (i < 0) {
+    //too big for any class, the block gets pages of its own
+    size_t total = (SLAB_HEADER + size + 4095) & ~(size_t)4095;
+    struct slab_page *page = map_aligned(total);
+    page->cls = -1;
+    page->size = total;
+    return (char *)page + SLAB_HEADER;
+  }
+  struct slab_class *c = &classes[i];
+  char *p;
+  pthread_mutex_lock(&c->lock);
+  struct slab_page *page = c->partial;
+  if (page == NULL) {
+    page = get_page();
+    page->cls = i;
+    page->nused = 0;
+    page->ncarved = 0;
+    page->free = NULL;
+    page_link(c, page);
+  }
+  if (page->free != NULL) {
+    p = page->free;
+    page->free = *(void **)p;
+  }
+  else {
+    p = (char *)page + SLAB_HEADER + page->ncarved * c->size;
+    page->ncarved += 1;
+  }
+  page->nused += 1;
+  if (page->nused == c->perpage) {
+    page_unlink(c, page);
+  }
+  pthread_mutex_unlock(&c->lock);
+  return p;
+}
+
+/*
+ * slab_free - this function gives back a block returned by slab_alloc.
+ * A page left with no blocks in use leaves its class.
+ */
+void slab_free(void *p)
+{
+  struct slab_page *page = page_of(p);
+  if (page->cls < 0) {
+    Munmap(page, page->size);
+    return;
+  }
+  struct slab_class *c = &classes[page->cls];
+  pthread_mutex_lock(&c->lock);
+  *(void **)p = page->free;
+  page->free = p;
+  if (page->nused == c->perpage) {
+    //the page was full, now it has room again
+    page_link(c, page);
+  }
+  page->nused -= 1;
+  if (page->nused == 0) {
+    page_unlink(c, page);
+    pthread_mutex_unlock(&c->lock);
+    put_page(page);
+    return;
+  }
+  pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * slab_size - this function returns the bytes taken up by the block p,
+ * which is what it really costs rather than what was asked for
+ */
+size_t slab_size(void *p)
+{
+  struct slab_page *page = page_of(p);
+  if (page->cls < 0) {
+    return page->size;
+  }
+  return classes[page->cls].size;
+}
+
+/*
+ * make_classes - this function computes the size of the chunks of each
+ * class. Sizes are multiples of 16, so every chunk is aligned, and the
+ * last class is the biggest that still fits two chunks in a page.
+ */
+static void make_classes(void)
+{
+  size_t size = SLAB_MIN_CHUNK;
+  while (nclasses < SLAB_MAX_CLASSES &&
+      (SLAB_PAGE_SIZE - SLAB_HEADER) / size >= 2) {
+    struct slab_class *c = &classes[nclasses];
+    c->size = size;
+    c->perpage = (SLAB_PAGE_SIZE - SLAB_HEADER) / size;
+    pthread_mutex_init(&c->lock, NULL);
+    c->partial = NULL;
+    nclasses += 1;
+    size = ((size_t)(size * SLAB_GROWTH_FACTOR) + 15) & ~(size_t)15;
+  }
+}
+
+/*
+ * class_for - this function returns the smallest class whose chunks can
+ * hold size bytes, or -1 if there is none
+ */
+static int class_for(size_t size)
+{
+  int lo = 0, hi = nclasses;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (classes[mid].size < size) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  return (lo < nclasses) ? lo : -1;
+}
+
+/*
+ * map_aligned - this function maps size bytes starting at a multiple of
+ * SLAB_PAGE_SIZE. It maps a page more than needed and unmaps what lies
+ * before and after the aligned part.
+ */
+static void *map_aligned(size_t size)
+{
+  char *p = Mmap(NULL, size + SLAB_PAGE_SIZE, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  char *start = (char *)(((uintptr_t)p + SLAB_PAGE_SIZE - 1) &
+      ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+  if (start > p) {
+    Munmap(p, start - p);
+  }
+  if (start + size < p + size + SLAB_PAGE_SIZE) {
+    Munmap(start + size, (p + size + SLAB_PAGE_SIZE) - (start + size));
+  }
+  return start;
+}
+
+/*
+ * page_of - this function returns the header of the page the block p is
+ * in, both kinds of blocks start within the first SLAB_PAGE_SIZE bytes
+ * of their mapping
+ */
+static struct slab_page *page_of(void *p)
+{
+  return (struct slab_page *)((uintptr_t)p &
+      ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+}
+
+/*
+ * get_page - this function returns an empty page, a spare one if there
+ * is one and a newly mapped one otherwise
+ */
+static struct slab_page *get_page(void)
+{
+  struct slab_page *page = NULL;
+  pthread_mutex_lock(&spare_lock);
+  if (spare != NULL) {
+    page = spare;
+    spare = page->next;
+    nspare -= 1;
+  }
+  pthread_mutex_unlock(&spare_lock);
+  if (page == NULL) {
+    page = map_aligned(SLAB_PAGE_SIZE);
+  }
+  return page;
+}
+
+/*
+ * put_page - this function takes back a page that no longer has any
+ * blocks in use. It is kept as a spare, or unmapped if there are enough
+ * spares already.
+ */
+static void put_page(struct slab_page *page)
+{
+  pthread_mutex_lock(&spare_lock);
+  if (nspare < SLAB_SPARE_PAGES) {
+    page->next = spare;
+    spare = page;
+    nspare += 1;
+    page = NULL;
+  }
+  pthread_mutex_unlock(&spare_lock);
+  if (page != NULL) {
+    Munmap(page, SLAB_PAGE_SIZE);
+  }
+}
+
+/*
+ * page_link - this function adds page to the front of the list of pages
+ * of c that have free chunks. The caller must hold c's lock.
+ */
+static void page_link(struct slab_class *c, struct slab_page *page)
+{
+  page->prev = NULL;
+  page->next = c->partial;
+  if (c->partial != NULL) {
+    c->partial->prev = page;
+  }
+  c->partial = page;
+}
+
+/*
+ * page_unlink - this function removes page from the list of pages of c
+ * that have free chunks. The caller must hold c's lock.
+ */
+static void page_unlink(struct slab_class *c, struct slab_page *page)
+{
+  if (page->prev != NULL) {
+    page->prev->next = page->next;
+  }
+  else {
+    c->partial = page->next;
+  }
+  if (page->next != NULL) {
+    page->next->prev = page->prev;
+  }
+  page->prev = page->next = NULL;
+}
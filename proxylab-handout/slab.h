@@ -0,0 +1,31 @@
+/*
+ * slab.h - size-class slab allocator for the cache's objects
+ *
+ * Memory is taken from the system in pages of SLAB_PAGE_SIZE bytes,
+ * and each page is cut into chunks of one size class. Requests are
+ * rounded up to the nearest class.
+ */
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include "csapp.h"
+
+/* Pages are this big and aligned on their size */
+#define SLAB_PAGE_SIZE 65536
+
+/* Size classes go from SLAB_MIN_CHUNK up, each this much bigger than the
+   last, until a page can't hold two chunks. Bigger requests get pages of
+   their own. */
+#define SLAB_MIN_CHUNK 64
+#define SLAB_GROWTH_FACTOR 1.25
+#define SLAB_MAX_CLASSES 64
+
+/* Empty pages kept for any class to reuse instead of being unmapped */
+#define SLAB_SPARE_PAGES 8
+
+void slab_init(void);
+void *slab_alloc(size_t size);
+void slab_free(void *p);
+size_t slab_size(void *p);
+
+#endif /* __SLAB_H__ */
@@ -0,0 +1,204 @@
+/*
+ * snapshot.c - saving the in-memory cache to a file and loading it back
+ *
+ * When the proxy is told to stop, snapshot_save writes every object held
+ * in memory to a file, and the next proxy started with the same file
+ * loads them with snapshot_load before it serves anything. The objects
+ * of each shard are written from the least to the most recently used,
+ * and loading adds them in file order, so each one goes back to the
+ * front of its shard in turn and the LRU order comes back as it was.
+ * Each object keeps the time it stops being fresh, so one that went stale
+ * while the proxy was down is revalidated on its next hit.
+ *
+ * The file is a header followed by one record per object. The header
+ * gives the format version and the size of the file, and each record
+ * carries a CRC-32 of its url and data. A file with a bad header is
+ * ignored, and loading stops at the first record that is cut short or
+ * doesn't match its checksum, keeping the ones before it. The file is
+ * mapped rather than read, so loading is one copy of each object into
+ * the cache. It is written under another name and renamed once complete,
+ * so a proxy killed while saving leaves the previous snapshot in place.
+ */
+
+#include "snapshot.h"
+
+/* Records are padded to this many bytes */
+#define SNAPSHOT_ALIGN 8
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void);
+static uint32_t crc32(uint32_t crc, const void *buf, size_t len);
+static size_t padding(size_t len);
+static int write_record(FILE *f, cache_node *p);
+
+/*
+ * snapshot_save - this function writes the objects c_cache holds in
+ * memory to the file path. It returns 0 on success and -1 if the file
+ * couldn't be written, in which case the previous snapshot is kept.
+ */
+int snapshot_save(cache *c_cache, char *path)
+{
+  struct snapshot_header header;
+  char tmp[MAXLINE];
+  size_t n, i;
+  int ok = 1;
+  //the nodes are pinned, not locked, so the proxy keeps serving while
+  //they are written
+  cache_node **nodes = cache_nodes(c_cache, &n);
+  FILE *f;
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if ((f = fopen(tmp, "w")) == NULL) {
+    ok = 0;
+  }
+  memset(&header, 0, sizeof(header));
+  header.magic = SNAPSHOT_MAGIC;
+  header.version = SNAPSHOT_VERSION;
+  header.nobjects = n;
+  header.size = sizeof(header);
+  for (i = 0; i < n; i++) {
+    header.size += sizeof(struct snapshot_record) +
+      padding(strlen(nodes[i]->url) + nodes[i]->data_size);
+  }
+  header.checksum = crc32(0, &header, sizeof(header));
+  ok = ok && fwrite(&header, sizeof(header), 1, f) == 1;
+  for (i = 0; i < n; i++) {
+    ok = ok && write_record(f, nodes[i]);
+    release_cache_node(nodes[i]);
+  }
+  Free(nodes);
+  if (f != NULL) {
+    ok = (fclose(f) == 0) && ok;
+  }
+  if (!ok || rename(tmp, path) < 0) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * snapshot_load - this function adds the objects saved in the file path
+ * to c_cache. It returns how many were loaded, or -1 if there is no
+ * usable snapshot.
+ */
+long snapshot_load(cache *c_cache, char *path)
+{
+  struct snapshot_header header;
+  struct stat st;
+  char *map, *pos, *end;
+  uint32_t checksum;
+  uint64_t i;
+  long loaded = 0;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(header)) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  map = Mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  memcpy(&header, map, sizeof(header));
+  checksum = header.checksum;
+  header.checksum = 0;
+  if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION ||
+      header.size != (uint64_t)st.st_size ||
+      crc32(0, &header, sizeof(header)) != checksum) {
+    Munmap(map, st.st_size);
+    return -1;
+  }
+  pos = map + sizeof(header);
+  end = map + st.st_size;
+  for (i = 0; i < header.nobjects; i++) {
+    struct snapshot_record rec;
+    cache_buf b;
+    char *url;
+    if ((size_t)(end - pos) < sizeof(rec)) {
+      break;
+    }
+    memcpy(&rec, pos, sizeof(rec));
+    pos += sizeof(rec);
+    if (rec.url_len >= MAXLINE || rec.len > (uint64_t)(end - pos) ||
+        padding(rec.url_len + rec.len) > (size_t)(end - pos) ||
+        crc32(0, pos, rec.url_len + rec.len) != rec.checksum) {
+      break;
+    }
+    url = Malloc(rec.url_len + 1);
+    memcpy(url, pos, rec.url_len);
+    url[rec.url_len] = '\0';
+    //the same path as a response relayed from a server
+    cache_buf_init(&b, c_cache);
+    cache_buf_append(&b, pos + rec.url_len, rec.len);
+    add_to_cache(c_cache, url, &b, rec.head_len, rec.expires, rec.lifetime);
+    Free(url);
+    pos += padding(rec.url_len + rec.len);
+    loaded++;
+  }
+  Munmap(map, st.st_size);
+  return loaded;
+}
+
+/*
+ * crc_init - this function fills the table of the CRC-32 of every byte
+ */
+static void crc_init(void)
+{
+  uint32_t i, j, c;
+  for (i = 0; i < 256; i++) {
+    c = i;
+    for (j = 0; j < 8; j++) {
+      c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+    }
+    crc_table[i] = c;
+  }
+}
+
+/*
+ * crc32 - this function continues the CRC-32 crc (0 to start one) over
+ * len bytes of buf and returns it
+ */
+static uint32_t crc32(uint32_t crc, const void *buf, size_t len)
+{
+  const unsigned char *p = buf;
+  pthread_once(&crc_once, crc_init);
+  crc = ~crc;
+  while (len-- > 0) {
+    crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+/*
+ * padding - this function returns len rounded up to SNAPSHOT_ALIGN
+ */
+static size_t padding(size_t len)
+{
+  return (len + SNAPSHOT_ALIGN - 1) & ~(size_t)(SNAPSHOT_ALIGN - 1);
+}
+
+/*
+ * write_record - this function writes the record of the node p to f. It
+ * returns 1 on success and 0 on failure.
+ */
+static int write_record(FILE *f, cache_node *p)
+{
+  static const char zeros[SNAPSHOT_ALIGN];
+  struct snapshot_record rec;
+  size_t url_len = strlen(p->url);
+  memset(&rec, 0, sizeof(rec));
+  rec.url_len = url_len;
+  rec.head_len = p->head_len;
+  rec.len = p->data_size;
+  rec.expires = __atomic_load_n(&p->expires, __ATOMIC_RELAXED);
+  rec.lifetime = p->lifetime;
+  rec.checksum = crc32(crc32(0, p->url, url_len), p->data, p->data_size);
+  return fwrite(&rec, sizeof(rec), 1, f) == 1 &&
+    fwrite(p->url, 1, url_len, f) == url_len &&
+    fwrite(p->data, 1, p->data_size, f) == p->data_size &&
+    fwrite(zeros, 1, padding(url_len + p->data_size) -
+      (url_len + p->data_size), f) ==
+      padding(url_len + p->data_size) - (url_len + p->data_size);
+}
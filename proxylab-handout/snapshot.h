@@ -0,0 +1,41 @@
+/*
+ * snapshot.h - saving the in-memory cache to a file and loading it back,
+ * so that a restarted proxy starts with a warm cache
+ */
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include <stdint.h>
+
+/* Marks snapshot files, and the version of their format */
+#define SNAPSHOT_MAGIC 0x50534e31u //"PSN1"
+#define SNAPSHOT_VERSION 3
+
+/* Start of a snapshot file, followed by the records */
+struct snapshot_header{
+  uint32_t magic; //SNAPSHOT_MAGIC
+  uint32_t version; //SNAPSHOT_VERSION
+  uint64_t nobjects; //records in the file
+  uint64_t size; //bytes in the file, header included
+  uint32_t checksum; //CRC-32 of the header, with this field 0
+  uint32_t pad;
+};
+
+/* Start of a record, followed by the url and the data, padded to 8
+   bytes */
+struct snapshot_record{
+  uint32_t url_len;
+  uint32_t head_len; //bytes of the head the data starts with
+  uint64_t len; //bytes of data
+  int64_t expires; //when the object stops being fresh
+  int64_t lifetime; //how long it stays fresh once revalidated
+  uint32_t checksum; //CRC-32 of the url and the data
+  uint32_t pad;
+};
+
+int snapshot_save(cache *c_cache, char *path);
+long snapshot_load(cache *c_cache, char *path);
+
+#endif /* __SNAPSHOT_H__ */
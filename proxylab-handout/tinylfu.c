@@ -0,0 +1,111 @@
+/*
+ * tinylfu.c - count-min frequency sketch used by the cache's TinyLFU
+ * admission policy
+ *
+ * Each url hash maps to one counter in each of SKETCH_DEPTH rows. An
+ * access increments the smallest of those counters (conservative update)
+ * and the estimated frequency is the smallest of them, which can only
+ * overestimate the real count. Counters are small and saturating, and
+ * once enough samples have been recorded every counter is halved, so
+ * the sketch follows the recent popularity of urls instead of their
+ * all-time popularity.
+ *
+ * The sketch is updated on every lookup, and lookups under the CLOCK
+ * policy only hold their shard's lock for reading, so all counter
+ * accesses are atomic. Concurrent increments may race past each other,
+ * which only makes the (already approximate) counts slightly less exact.
+ */
+
+#include "csapp.h"
+#include "tinylfu.h"
+
+static unsigned int sketch_index(freq_sketch *s, unsigned int h, int row);
+static void sketch_reset(freq_sketch *s);
+
+/*
+ * sketch_init - this function allocates a sketch with width counters per
+ * row. width is rounded up to a power of 2.
+ */
+void sketch_init(freq_sketch *s, unsigned int width){
+  unsigned int w = 1;
+  while (w < width){
+    w *= 2;
+  }
+  s->counters = Calloc((size_t)w * SKETCH_DEPTH, sizeof(unsigned char));
+  s->width = w;
+  s->samples = 0;
+  s->sample_limit = w * SKETCH_RESET_FACTOR;
+}
+
+/*
+ * sketch_index - this function returns the position of the counter for
+ * hash h in the given row. The rows use double hashing: the same hash
+ * stepped by a second hash derived from it, different for every row.
+ */
+static unsigned int sketch_index(freq_sketch *s, unsigned int h, int row){
+  unsigned int h2 = h;
+  h2 ^= h2 >> 15;
+  h2 *= 0x2c1b3c6du;
+  h2 ^= h2 >> 12;
+  h2 |= 1; //an odd step visits every counter of the row
+  return row * s->width + ((h + row * h2) & (s->width - 1));
+}
+
+/*
+ * sketch_increment - this function records one access to the url with
+ * hash h
+ */
+void sketch_increment(freq_sketch *s, unsigned int h){
+  unsigned int idx[SKETCH_DEPTH];
+  unsigned int min = SKETCH_MAX_COUNT;
+  int row;
+  for (row = 0; row < SKETCH_DEPTH; row++){
+    idx[row] = sketch_index(s, h, row);
+    unsigned int c = __atomic_load_n(&s->counters[idx[row]], __ATOMIC_RELAXED);
+    if (c < min){
+      min = c;
+    }
+  }
+  if (min < SKETCH_MAX_COUNT){
+    //only the counters holding the minimum need to grow, the others
+    //already overestimate this url
+    for (row = 0; row < SKETCH_DEPTH; row++){
+      if (__atomic_load_n(&s->counters[idx[row]], __ATOMIC_RELAXED) == min){
+        __atomic_add_fetch(&s->counters[idx[row]], 1, __ATOMIC_RELAXED);
+      }
+    }
+  }
+  if (__atomic_add_fetch(&s->samples, 1, __ATOMIC_RELAXED) == s->sample_limit){
+    sketch_reset(s);
+  }
+}
+
+/*
+ * sketch_estimate - this function returns the estimated number of recent
+ * accesses to the url with hash h
+ */
+unsigned int sketch_estimate(freq_sketch *s, unsigned int h){
+  unsigned int min = SKETCH_MAX_COUNT;
+  int row;
+  for (row = 0; row < SKETCH_DEPTH; row++){
+    unsigned int c = __atomic_load_n(&s->counters[sketch_index(s, h, row)],
+      __ATOMIC_RELAXED);
+    if (c < min){
+      min = c;
+    }
+  }
+  return min;
+}
+
+/*
+ * sketch_reset - this function ages the sketch by halving every counter.
+ * It is run by the one thread whose increment reached the sample limit.
+ */
+static void sketch_reset(freq_sketch *s){
+  unsigned int i;
+  for (i = 0; i < s->width * SKETCH_DEPTH; i++){
+    unsigned char c = __atomic_load_n(&s->counters[i], __ATOMIC_RELAXED);
+    __atomic_store_n(&s->counters[i], c / 2, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&s->samples, s->sample_limit / 2, __ATOMIC_RELAXED);
+}
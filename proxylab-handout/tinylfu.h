@@ -0,0 +1,31 @@
+/*
+ * tinylfu.h - count-min frequency sketch used by the cache's TinyLFU
+ * admission policy
+ *
+ * The sketch remembers roughly how often each url hash was requested
+ * recently, including urls that are not (or no longer) in the cache.
+ */
+#ifndef __TINYLFU_H__
+#define __TINYLFU_H__
+
+/* Number of rows (independent hash functions) in the sketch */
+#define SKETCH_DEPTH 4
+/* Counters saturate here, like the 4-bit counters of the TinyLFU paper */
+#define SKETCH_MAX_COUNT 15
+/* All counters are halved after this many samples per counter in a row */
+#define SKETCH_RESET_FACTOR 10
+
+struct freq_sketch{
+  unsigned char *counters; //SKETCH_DEPTH rows of width counters each
+  unsigned int width; //counters per row, always a power of 2
+  unsigned int samples; //increments since the last reset, atomic
+  unsigned int sample_limit; //reset the sketch when samples gets here
+};
+
+typedef struct freq_sketch freq_sketch;
+
+void sketch_init(freq_sketch *s, unsigned int width);
+void sketch_increment(freq_sketch *s, unsigned int h);
+unsigned int sketch_estimate(freq_sketch *s, unsigned int h);
+
+#endif /* __TINYLFU_H__ */
@@ -0,0 +1,225 @@
+/*
+ * upstream.c - pool of idle keep-alive connections to servers
+ *
+ * When keep-alive is on, the proxy talks HTTP/1.1 to servers and does not
+ * close a server connection once the response has been read in full.
+ * Instead upstream_put parks it here, under the server's host and port,
+ * and the next miss for the same server takes it with upstream_get and
+ * skips the TCP handshake.
+ *
+ * Each server keeps at most max_idle idle connections, newest first, and
+ * connections idle for more than idle_timeout seconds are closed the next
+ * time the server's list is looked at. A server may still close an idle
+ * connection at any time, so upstream_get checks that nothing (not even
+ * end of file) is waiting on a connection before it hands it out, and
+ * callers retry once on a fresh connection if a reused one fails before
+ * any of the response arrived.
+ *
+ * The whole pool is protected by one mutex, which is only held to move a
+ * descriptor in or out of a list.
+ */
+
+#include "upstream.h"
+
+static int idle_timeout = 0; //0 means keep-alive to servers is off
+static int max_idle = UPSTREAM_DEFAULT_MAX_IDLE;
+static struct origin *origins[UPSTREAM_BUCKETS];
+static pthread_mutex_t upstream_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct origin **find_origin(char *host, int port);
+static void expire_idle(struct origin *o, time_t now);
+static int still_open(int fd);
+
+/*
+ * upstream_init - this function turns on keep-alive to servers. Idle
+ * connections are kept for timeout seconds, and at most max connections
+ * are kept per server. A timeout of 0 leaves keep-alive off.
+ */
+void upstream_init(int timeout, int max)
+{
+  idle_timeout = timeout;
+  max_idle = max;
+}
+
+/*
+ * upstream_enabled - this function returns whether connections to
+ * servers are kept alive
+ */
+int upstream_enabled(void)
+{
+  return idle_timeout > 0;
+}
+
+/*
+ * upstream_get - this function returns an idle connection to host:port
+ * that still looks usable, or -1 if there is none. The caller owns the
+ * returned descriptor.
+ */
+int upstream_get(char *host, int port)
+{
+  int fd = -1;
+  time_t now = time(NULL);
+  if (!upstream_enabled()) {
+    return -1;
+  }
+  pthread_mutex_lock(&upstream_lock);
+  struct origin **op = find_origin(host, port);
+  if (*op != NULL) {
+    struct origin *o = *op;
+    expire_idle(o, now);
+    while (fd < 0 && o->idle != NULL) {
+      struct idle_conn *ic = o->idle;
+      o->idle = ic->next;
+      o->nidle -= 1;
+      if (still_open(ic->fd)) {
+        fd = ic->fd;
+      }
+      else {
+        close(ic->fd);
+      }
+      Free(ic);
+    }
+    if (o->idle == NULL) {
+      //forget servers with no idle connections
+      *op = o->next;
+      Free(o->host);
+      Free(o);
+    }
+  }
+  pthread_mutex_unlock(&upstream_lock);
+  return fd;
+}
+
+/*
+ * upstream_put - this function parks fd, a connection to host:port that
+ * has just finished a response, for the next request to the server. It
+ * is closed instead if the server already has enough idle connections.
+ */
+void upstream_put(char *host, int port, int fd)
+{
+  time_t now = time(NULL);
+  if (!upstream_enabled()) {
+    close(fd);
+    return;
+  }
+  pthread_mutex_lock(&upstream_lock);
+  struct origin **op = find_origin(host, port);
+  if (*op == NULL) {
+    struct origin *o = Calloc(1, sizeof(struct origin));
+    o->host = Malloc(strlen(host) + 1);
+    strcpy(o->host, host);
+    o->port = port;
+    *op = o;
+  }
+  struct origin *o = *op;
+  expire_idle(o, now);
+  if (o->nidle >= max_idle) {
+    pthread_mutex_unlock(&upstream_lock);
+    close(fd);
+    return;
+  }
+  struct idle_conn *ic = Malloc(sizeof(struct idle_conn));
+  ic->fd = fd;
+  ic->since = now;
+  ic->next = o->idle;
+  o->idle = ic;
+  o->nidle += 1;
+  pthread_mutex_unlock(&upstream_lock);
+}
+
+/*
+ * upstream_race - this function gets race ready to connect to port on
+ * the addresses in r, the IPv4 and IPv6 ones alike
+ */
+void upstream_race(race_t *race, dns_result *r, int port)
+{
+  int i;
+  for (i = 0; i < r->naddrs; i++) {
+    //the port is at the same place in both kinds of address
+    ((struct sockaddr_in *)&r->addrs[i])->sin_port = htons(port);
+  }
+  race_init(race, r->addrs, r->addrlens, r->naddrs);
+}
+
+/*
+ * upstream_connect - this function opens a new connection to port on
+ * one of the addresses in r. The addresses are raced, so one that
+ * doesn't answer only holds things up for RACE_ATTEMPT_DELAY. It
+ * returns a blocking socket, or -1 if no address could be connected to.
+ */
+int upstream_connect(dns_result *r, int port)
+{
+  race_t race;
+  upstream_race(&race, r, port);
+  return race_connect(&race);
+}
+
+/*
+ * set_nonblocking - this function turns O_NONBLOCK on or off for fd.
+ * Pooled connections move between the threaded proxy, which uses
+ * blocking sockets, and the event loops, which don't.
+ */
+void set_nonblocking(int fd, int on)
+{
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (on) {
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  }
+  else {
+    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+  }
+}
+
+/*
+ * find_origin - this function returns the link that points to the entry
+ * of host:port in the table, which is NULL if there is no such entry.
+ * The caller must hold upstream_lock.
+ */
+static struct origin **find_origin(char *host, int port)
+{
+  unsigned int h = 2166136261u; //FNV-1a, as for urls in the cache
+  unsigned char *c;
+  for (c = (unsigned char *)host; *c != '\0'; c++) {
+    h ^= *c;
+    h *= 16777619u;
+  }
+  h ^= port;
+  struct origin **op = &origins[h % UPSTREAM_BUCKETS];
+  while (*op != NULL &&
+      ((*op)->port != port || strcasecmp((*op)->host, host) != 0)) {
+    op = &(*op)->next;
+  }
+  return op;
+}
+
+/*
+ * expire_idle - this function closes the connections of o that have been
+ * idle for longer than the timeout. Since the list is newest first, they
+ * are all at its end. The caller must hold upstream_lock.
+ */
+static void expire_idle(struct origin *o, time_t now)
+{
+  struct idle_conn **icp = &o->idle;
+  while (*icp != NULL && now - (*icp)->since <= idle_timeout) {
+    icp = &(*icp)->next;
+  }
+  while (*icp != NULL) {
+    struct idle_conn *ic = *icp;
+    *icp = ic->next;
+    close(ic->fd);
+    Free(ic);
+    o->nidle -= 1;
+  }
+}
+
+/*
+ * still_open - this function returns whether the idle connection fd can
+ * be used for a request. If the server has closed it, or sent something
+ * nobody asked for, it can't.
+ */
+static int still_open(int fd)
+{
+  char c;
+  ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
@@ -0,0 +1,39 @@
+/*
+ * upstream.h - pool of idle keep-alive connections to servers
+ */
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include "csapp.h"
+#include "dns.h"
+
+/* Limits used unless the proxy is told otherwise */
+#define UPSTREAM_DEFAULT_IDLE_TIMEOUT 30 //seconds an idle connection is kept
+#define UPSTREAM_DEFAULT_MAX_IDLE 8 //idle connections kept per server
+#define UPSTREAM_BUCKETS 256 //size of the table of servers
+
+/* An idle connection to a server */
+struct idle_conn{
+  int fd;
+  time_t since; //when it became idle
+  struct idle_conn *next;
+};
+
+/* A server (host and port) with its idle connections, newest first */
+struct origin{
+  char *host;
+  int port;
+  int nidle; //length of the idle list
+  struct idle_conn *idle;
+  struct origin *next; //next server in the same bucket
+};
+
+void upstream_init(int idle_timeout, int max_idle);
+int upstream_enabled(void);
+int upstream_get(char *host, int port);
+void upstream_put(char *host, int port, int fd);
+void upstream_race(race_t *race, dns_result *r, int port);
+int upstream_connect(dns_result *r, int port);
+void set_nonblocking(int fd, int on);
+
+#endif /* __UPSTREAM_H__ */